@@ -0,0 +1,291 @@
+/*
+ * bank.c - patch bank in the top of internal flash
+ *
+ * Programs are kept as the pmem words fm_gen takes, so recalling one is
+ * just SPI writes. The bank is two halves of 8 pages used as a log: a
+ * store appends a record to the live half and the newest record of a
+ * program wins. When the live half is full the latest record of each
+ * program is copied to the other half, which then takes over. Each page
+ * is erased once per ~100 stores at worst and an unchanged store writes
+ * nothing, so the flash outlasts any amount of patch editing.
+ *
+ * A record's state is written last and a half's header only after all of
+ * its records, so a store cut short by a reset leaves the old program.
+ * Flash erase & program stall the CPU - up to ~40ms a page and ~600ms
+ * for a compaction - so stores are for editing, not for during a
+ * performance. PROTO_Store_Ms in proto.h is the limit hosts wait for.
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include "bank.h"
+
+/* start of the BANK region - from the linker script */
+extern uint8_t _bank_start[];
+
+#define BANK_Half (BANK_Size/2)
+#define BANK_Magic 0x31424D46		/* "FMB1" */
+#define BANK_Valid 0xA55A			/* record states, erased is 0xFFFF */
+#define BANK_Dead 0x0000
+#define BANK_Retry 4				/* records tried by one store */
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t gen;			/* higher is newer, the live half */
+} bank_header;
+
+typedef struct
+{
+	uint16_t state;			/* written last */
+	uint8_t prog;
+	uint8_t rsvd;
+	uint32_t check;			/* sum of the words & prog */
+	uint64_t pw[BANK_Words];
+} bank_record;
+
+#define BANK_Records ((BANK_Half - sizeof(bank_header)) / sizeof(bank_record))
+
+const bank_record *BANK_Index[BANK_Programs];	/* newest record, or NULL */
+uint8_t BANK_Live;			/* live half */
+uint16_t BANK_Next;			/* first free record of it */
+uint32_t BANK_Gen;
+
+/*
+ * flash address of a half's header & its records
+ */
+static const bank_header *BANK_Header(uint8_t half)
+{
+	return (const bank_header *)(_bank_start + half*BANK_Half);
+}
+
+static const bank_record *BANK_Record(uint8_t half, uint16_t n)
+{
+	return (const bank_record *)(_bank_start + half*BANK_Half +
+		sizeof(bank_header) + n*sizeof(bank_record));
+}
+
+/*
+ * check word of a record
+ */
+static uint32_t BANK_Check(uint8_t prog, const uint64_t *pw)
+{
+	uint32_t sum = prog;
+	uint8_t i;
+	
+	for(i=0;i<BANK_Words;i++)
+		sum = (sum << 1 | sum >> 31) + (uint32_t)pw[i] + (uint32_t)(pw[i] >> 32);
+	return sum;
+}
+
+/*
+ * check if flash is still erased
+ */
+static uint8_t BANK_Blank(const void *addr, uint32_t len)
+{
+	const uint32_t *p = addr;
+	
+	for(len/=4;len;len--)
+		if(*p++ != 0xFFFFFFFF)
+			return 0;
+	return 1;
+}
+
+/*
+ * program & verify - halfwords already erased are skipped. Flash must be
+ * unlocked. Returns 1 if it did not take.
+ */
+static uint8_t BANK_Write(const void *dst, const void *src, uint32_t len)
+{
+	uint32_t addr = (uint32_t)(uintptr_t)dst, i;
+	const uint8_t *s = src;
+	uint16_t hw;
+	
+	for(i=0;i<len;i+=2)
+	{
+		hw = s[i] | (s[i+1] << 8);
+		if((hw != 0xFFFF) && (FLASH_ProgramHalfWord(addr+i, hw) != FLASH_COMPLETE))
+			return 1;
+	}
+	return memcmp(dst, src, len) != 0;
+}
+
+/*
+ * erase the pages of a half that need it. Flash must be unlocked.
+ */
+static uint8_t BANK_Erase(uint8_t half)
+{
+	const uint8_t *page = _bank_start + half*BANK_Half;
+	uint8_t i;
+	
+	for(i=0;i<BANK_Half/BANK_Page;i++,page+=BANK_Page)
+	{
+		if(BANK_Blank(page, BANK_Page))
+			continue;
+		if((FLASH_ErasePage((uint32_t)(uintptr_t)page) != FLASH_COMPLETE) ||
+			!BANK_Blank(page, BANK_Page))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * start a flash update
+ */
+static void BANK_Unlock(void)
+{
+	FLASH_Unlock();
+	FLASH_ClearFlag(FLASH_FLAG_EOP | FLASH_FLAG_PGERR | FLASH_FLAG_WRPERR);
+}
+
+/*
+ * index the live half - free space starts after the last record touched
+ */
+static void BANK_Scan(void)
+{
+	const bank_record *r;
+	uint16_t n;
+	
+	memset(BANK_Index, 0, sizeof(BANK_Index));
+	BANK_Next = 0;
+	for(n=0;n<BANK_Records;n++)
+	{
+		r = BANK_Record(BANK_Live, n);
+		if((r->state == BANK_Valid) && (r->prog < BANK_Programs) &&
+			(r->check == BANK_Check(r->prog, r->pw)))
+			BANK_Index[r->prog] = r;
+		if(!BANK_Blank(r, sizeof(bank_record)))
+			BANK_Next = n + 1;
+	}
+}
+
+/*
+ * copy the newest record of each program to the other half & make it
+ * live. Flash must be unlocked. Returns 1 on a flash error.
+ */
+static uint8_t BANK_Compact(void)
+{
+	uint8_t half = BANK_Live ^ 1, p;
+	uint16_t n = 0;
+	bank_header hdr;
+	
+	if(BANK_Erase(half))
+		return 1;
+	
+	for(p=0;p<BANK_Programs;p++)
+		if(BANK_Index[p] &&
+			BANK_Write(BANK_Record(half, n++), BANK_Index[p], sizeof(bank_record)))
+			return 1;
+	
+	/* generation before magic so a torn header is never live */
+	hdr.magic = BANK_Magic;
+	hdr.gen = BANK_Gen + 1;
+	if(BANK_Write(&BANK_Header(half)->gen, &hdr.gen, sizeof(hdr.gen)) ||
+		BANK_Write(BANK_Header(half), &hdr.magic, sizeof(hdr.magic)))
+		return 1;
+	
+	BANK_Live = half;
+	BANK_Gen = hdr.gen;
+	BANK_Scan();
+	return 0;
+}
+
+/*
+ * find the live half, formatting a blank bank
+ */
+void BANK_Init(void)
+{
+	const bank_header *h0 = BANK_Header(0), *h1 = BANK_Header(1);
+	bank_header hdr;
+	
+	if((h0->magic == BANK_Magic) && ((h1->magic != BANK_Magic) ||
+		((int32_t)(h0->gen - h1->gen) > 0)))
+		BANK_Live = 0;
+	else if(h1->magic == BANK_Magic)
+		BANK_Live = 1;
+	else
+	{
+		/* never used */
+		BANK_Live = 0;
+		hdr.magic = BANK_Magic;
+		hdr.gen = 0;
+		BANK_Unlock();
+		if(!BANK_Erase(0))
+			BANK_Write(h0, &hdr, sizeof(hdr));
+		FLASH_Lock();
+	}
+	
+	BANK_Gen = BANK_Header(BANK_Live)->gen;
+	BANK_Scan();
+}
+
+/*
+ * stored words of a program, NULL if it was never stored
+ */
+const uint64_t *BANK_Get(uint8_t prog)
+{
+	if((prog >= BANK_Programs) || !BANK_Index[prog])
+		return NULL;
+	return BANK_Index[prog]->pw;
+}
+
+/*
+ * store a program - returns 1 if the flash would not take it
+ */
+uint8_t BANK_Store(uint8_t prog, const uint64_t *pw)
+{
+	const bank_record *r;
+	bank_record rec;
+	uint8_t i, err = 1;
+	
+	if(prog >= BANK_Programs)
+		return 1;
+	
+	/* nothing to wear out */
+	if(BANK_Index[prog] && !memcmp(BANK_Index[prog]->pw, pw, sizeof(rec.pw)))
+		return 0;
+	
+	rec.state = BANK_Valid;
+	rec.prog = prog;
+	rec.rsvd = 0xFF;
+	memcpy(rec.pw, pw, sizeof(rec.pw));
+	rec.check = BANK_Check(prog, rec.pw);
+	
+	BANK_Unlock();
+	for(i=0;err && (i<BANK_Retry);i++)
+	{
+		if((BANK_Next >= BANK_Records) && BANK_Compact())
+			break;
+		r = BANK_Record(BANK_Live, BANK_Next++);
+		
+		/* everything but the state, then the state */
+		err = !BANK_Blank(r, sizeof(bank_record)) ||
+			BANK_Write(&r->prog, &rec.prog, sizeof(bank_record) - offsetof(bank_record, prog)) ||
+			BANK_Write(&r->state, &rec.state, sizeof(rec.state));
+		
+		/* a bad record is skipped by the scan & compaction */
+		if(err)
+			FLASH_ProgramHalfWord((uint32_t)(uintptr_t)&r->state, BANK_Dead);
+		else
+			BANK_Index[prog] = r;
+	}
+	FLASH_Lock();
+	
+	return err;
+}
+
+/*
+ * programs stored, free records before the next compaction & how many
+ * compactions there have been
+ */
+void BANK_Stats(uint8_t *stored, uint16_t *left, uint32_t *gen)
+{
+	uint8_t p;
+	
+	*stored = 0;
+	for(p=0;p<BANK_Programs;p++)
+		if(BANK_Index[p])
+			(*stored)++;
+	*left = BANK_Records - BANK_Next;
+	*gen = BANK_Gen;
+}
@@ -0,0 +1,20 @@
+/*
+ * bank.h - patch bank in the top of internal flash
+ */
+ 
+#ifndef __BANK__
+#define __BANK__
+
+#include "stm32f30x.h"
+
+#define BANK_Programs 128		/* programs 0-127, one per MIDI program */
+#define BANK_Words 8			/* pmem words per program */
+#define BANK_Page 2048			/* flash erase page */
+#define BANK_Size (16*BANK_Page)	/* must match BANK in STM32_FLASH.ld */
+
+void BANK_Init(void);
+const uint64_t *BANK_Get(uint8_t prog);
+uint8_t BANK_Store(uint8_t prog, const uint64_t *pw);
+void BANK_Stats(uint8_t *stored, uint16_t *left, uint32_t *gen);
+
+#endif
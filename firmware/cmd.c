@@ -13,6 +13,8 @@
 #include "cyclesleep.h"
 #include "ice5.h"
 #include "fm.h"
+#include "bank.h"
+#include "midi.h"
 
 #define MAX_ARGS 4
 
@@ -30,9 +32,27 @@ const char *cmd_commands[] =
 	"setofreq",
 	"setoatten",
 	"setowave",
+	"spistat",
+	"setlayout",
+	"setmix",
+	"vstat",
+	"midi",
+	"txstat",
+	"tune",
+	"prog",
+	"store",
 	""
 };
 
+/* read an FPGA reg for printing */
+static unsigned long cmd_read(uint8_t reg)
+{
+	uint32_t data;
+	
+	ICE5_FPGA_Slave_Read(reg, &data);
+	return data;
+}
+
 /* reset buffer & display the prompt */
 void cmd_prompt(void)
 {
@@ -64,7 +84,7 @@ void cmd_proc(void)
 	if(argc > 0)
 	{
 		cmd = 0;
-		while(cmd_commands[cmd] != '\0')
+		while(*cmd_commands[cmd] != '\0')
 		{
 			if(strcmp(argv[0], cmd_commands[cmd])==0)
 				break;
@@ -72,7 +92,7 @@ void cmd_proc(void)
 		}
 	
 		/* Can we handle this? */
-		if(cmd_commands[cmd] != '\0')
+		if(*cmd_commands[cmd] != '\0')
 		{
 			printf("\r\n");
 
@@ -89,6 +109,15 @@ void cmd_proc(void)
 					printf("setofreq <voice> <op> <freq> - set op freq (ratio / -Hz)\r\n");
 					printf("setoatten <voice> <op> <atten> - set op atten\r\n");
 					printf("setowave <voice> <op> <wave> - set op wave\r\n");
+					printf("spistat [clr] - SPI write cache stats\r\n");
+					printf("setlayout <ops> - set ops per voice (8/6/4/2)\r\n");
+					printf("setmix <shift> [24] - mix gain (8=unity), 24-bit I2S\r\n");
+					printf("vstat [voice] - silent voices, quietest, voice atten\r\n");
+					printf("midi [clr|omni|<ch>] - MIDI latency stats, channel\r\n");
+					printf("txstat [clr|drop|block] - console TX drops, full policy\r\n");
+					printf("tune [cents|et] - global tuning, back to equal temperament\r\n");
+					printf("prog [prog] - program notes play, flash bank usage\r\n");
+					printf("store <prog> <slot> - save a patch slot as a flash program\r\n");
 					break;
 	
 				case 1: 	/* spi_read */
@@ -97,7 +126,7 @@ void cmd_proc(void)
 					else
 					{
 						reg = (int)strtoul(argv[1], NULL, 0) & 0x7f;
-						ICE5_FPGA_Slave_Read(reg, &data);
+						data = cmd_read(reg);
 						printf("spi_read: 0x%02X = 0x%08lX\r\n", reg, data);
 					}
 					break;
@@ -115,12 +144,12 @@ void cmd_proc(void)
 					break;
 	
 				case 3: 	/* readbus */
-					ICE5_FPGA_Slave_Read(14, &data);
+					data = cmd_read(14);
 					printf("freq: 0x%05lX\r\n", data & 0x7FFFF);
 					printf("  wv: 0x%01lX\r\n", data>>19 & 0x7);
 					printf(" adj: 0x%03lX\r\n", data>>22 & 0x1FF);
 					p_data = data>>31;
-					ICE5_FPGA_Slave_Read(15, &data);
+					data = cmd_read(15);
 					printf("  ar: 0x%05lX\r\n", (data<<1 | p_data) & 0x3F);
 					printf("  dr: 0x%05lX\r\n", data>>5 & 0x3F);
 					printf("  sl: 0x%05lX\r\n", data>>11 & 0x1F);
@@ -134,21 +163,21 @@ void cmd_proc(void)
 					break;
 	
 				case 4: 	/* readreg */
-					ICE5_FPGA_Slave_Read(2, &data);
+					data = cmd_read(2);
 					printf("freq: 0x%05lX\r\n", data & 0x7FFFF);
-					ICE5_FPGA_Slave_Read(4, &data);
+					data = cmd_read(4);
 					printf("  wv: 0x%01lX\r\n", data & 0x7);
-					ICE5_FPGA_Slave_Read(9, &data);
+					data = cmd_read(9);
 					printf(" adj: 0x%03lX\r\n", data & 0x1FF);
-					ICE5_FPGA_Slave_Read(5, &data);
+					data = cmd_read(5);
 					printf("  ar: 0x%05lX\r\n", data & 0x3F);
-					ICE5_FPGA_Slave_Read(6, &data);
+					data = cmd_read(6);
 					printf("  dr: 0x%05lX\r\n", data & 0x3F);
-					ICE5_FPGA_Slave_Read(7, &data);
+					data = cmd_read(7);
 					printf("  sl: 0x%05lX\r\n", data & 0x1F);
-					ICE5_FPGA_Slave_Read(8, &data);
+					data = cmd_read(8);
 					printf("  rr: 0x%05lX\r\n", data & 0x3F);
-					ICE5_FPGA_Slave_Read(10, &data);
+					data = cmd_read(10);
 					printf("  li: 0x%01lX\r\n", data>>4 & 0x1);
 					printf("  ri: 0x%01lX\r\n", data>>5 & 0x1);
 					printf(" mod: 0x%01lX\r\n", data>>3 & 0x1);
@@ -210,6 +239,150 @@ void cmd_proc(void)
 					}
 					break;
 	
+				case 9: 	/* SPI write cache stats */
+					{
+						uint32_t issued, elided;
+						
+						ICE5_FPGA_Cache_Stats(&issued, &elided);
+						printf("spistat: issued %lu elided %lu\r\n",
+							(unsigned long)issued, (unsigned long)elided);
+					}
+					if((argc > 1) && (strcmp(argv[1], "clr")==0))
+						ICE5_FPGA_Cache_ClrStats();
+					break;
+	
+				case 10: 	/* set ops per voice */
+					if(argc < 2)
+						printf("setlayout - missing arg(s)\r\n");
+					else
+					{
+						data = strtoul(argv[1], NULL, 0);
+						if(FM_SetLayout(data))
+							printf("setlayout: %ld not supported\r\n", data);
+						else
+							printf("setlayout: %d ops x %d voices\r\n",
+								FM_Layout->ops, FM_Layout->voices);
+					}
+					break;
+	
+				case 11: 	/* set mix gain & I2S width */
+					if(argc < 2)
+						printf("setmix - missing arg(s)\r\n");
+					else
+					{
+						data = strtoul(argv[1], NULL, 0) & 0xF;
+						p_data = (argc > 2) && (strtoul(argv[2], NULL, 0) == 24);
+						FM_SetMix(data, p_data);
+						printf("setmix: shift %ld, %d-bit I2S\r\n", data,
+							p_data ? 24 : 16);
+					}
+					break;
+	
+				case 12: 	/* voice activity */
+					{
+						uint32_t bits[4];
+						
+						FM_GetSilent(bits);
+						printf("vstat: silent %08lX %08lX %08lX %08lX\r\n",
+							(unsigned long)bits[3], (unsigned long)bits[2],
+							(unsigned long)bits[1], (unsigned long)bits[0]);
+						data = cmd_read(FM_Reg_QuietRel);
+						p_data = cmd_read(FM_Reg_QuietHeld);
+						printf("vstat: quietest off %d @ %d, on %d @ %d\r\n",
+							data & FM_Quiet_Valid ? (int)FM_Quiet_Voice(data) : -1,
+							(int)FM_Quiet_Atten(data),
+							p_data & FM_Quiet_Valid ? (int)FM_Quiet_Voice(p_data) : -1,
+							(int)FM_Quiet_Atten(p_data));
+						if(argc > 1)
+						{
+							voice = (int)strtoul(argv[1], NULL, 0) & 0x7F;
+							printf("vstat: voice %d atten %d\r\n", voice,
+								FM_GetVoiceAtten(voice));
+						}
+					}
+					break;
+	
+				case 13: 	/* MIDI stats & channel */
+					{
+						midi_stats st;
+						uint32_t us = SystemCoreClock/1000000;
+						
+						if(argc > 1)
+						{
+							if(strcmp(argv[1], "clr")==0)
+								MIDI_ClrStats();
+							else if(strcmp(argv[1], "omni")==0)
+								MIDI_Channel = MIDI_Omni;
+							else
+								MIDI_Channel = (strtoul(argv[1], NULL, 0) - 1) & 0xF;
+						}
+						MIDI_GetStats(&st);
+						if(MIDI_Channel == MIDI_Omni)
+							printf("midi: omni\r\n");
+						else
+							printf("midi: channel %d\r\n", MIDI_Channel + 1);
+						printf("midi: %lu events, max %lu us, avg %lu us, lost %lu\r\n",
+							(unsigned long)st.count, (unsigned long)(st.max/us),
+							(unsigned long)(st.avg/us), (unsigned long)st.lost);
+					}
+					break;
+	
+				case 14: 	/* console TX stats & policy */
+					if(argc > 1)
+					{
+						if(strcmp(argv[1], "drop")==0)
+							usart_tx_policy(0);
+						else if(strcmp(argv[1], "block")==0)
+							usart_tx_policy(1);
+					}
+					data = usart_tx_dropped((argc > 1) && (strcmp(argv[1], "clr")==0));
+					printf("txstat: dropped %lu\r\n", data);
+					break;
+	
+				case 15: 	/* global tuning */
+					if((argc > 1) && (strcmp(argv[1], "et")==0))
+						FM_SetNoteTable(0, NULL, 0);
+					else if(argc > 1)
+						FM_SetTune(strtol(argv[1], NULL, 0));
+					printf("tune: %d cents, %s\r\n", FM_GetTune(),
+						FM_GetNoteTable() ? "uploaded table" : "equal temperament");
+					break;
+	
+				case 16: 	/* note program & flash bank */
+					{
+						uint8_t stored;
+						uint16_t left;
+						uint32_t gen;
+						
+						if(argc > 1)
+							FM_SetNoteProgram(strtoul(argv[1], NULL, 0) & 0x7F);
+						if(FM_GetNoteProgram() == FM_No_Prog)
+							printf("prog: none, patch slot\r\n");
+						else
+							printf("prog: %d%s\r\n", FM_GetNoteProgram(),
+								BANK_Get(FM_GetNoteProgram()) ? "" : " (not stored)");
+						BANK_Stats(&stored, &left, &gen);
+						printf("prog: %d stored, %d records free, %lu compactions\r\n",
+							stored, left, (unsigned long)gen);
+					}
+					break;
+	
+				case 17: 	/* save a slot to the flash bank */
+					if(argc < 3)
+						printf("store - missing arg(s)\r\n");
+					else
+					{
+						reg = (int)strtoul(argv[1], NULL, 0);
+						voice = (int)strtoul(argv[2], NULL, 0);
+						if((reg >= BANK_Programs) || (voice >= FM_Num_Patches))
+							printf("store: out of range\r\n");
+						else if(FM_StoreProgram(reg, &voices[voice]))
+							printf("store: flash error\r\n");
+						else
+							printf("store: slot %d -> prog %d\r\n", voice, reg);
+					}
+					break;
+	
 				default:	/* shouldn't get here */
 					break;
 			}
@@ -4,12 +4,16 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include "fm.h"
 #include "ice5.h"
+#include "cyclesleep.h"
+#include "bank.h"
+#include "fm_tune.h"
 
-/* FPGA bitstream */
-extern uint8_t _binary_bitmap_bin_start;
-extern uint8_t _binary_bitmap_bin_end;
+/* FPGA bitstream - RLE compressed by tools/rlepack */
+extern uint8_t _binary_bitmap_rle_start;
+extern uint8_t _binary_bitmap_rle_end;
 
 /* predefined voices */
 const operator_struct test_voice_0[8] =
@@ -37,29 +41,119 @@ const operator_struct test_voice_1[8] =
 	{-4.0F,6,0,20,20,2,20, FM_Flag_Right|FM_Flag_MOD_EN}	// op 7
 };
 
-voice_struct voices[2];
+voice_struct voices[FM_Num_Patches];
+
+/* voice layouts - 256 ops scanned as whole voice pairs */
+const layout_struct FM_Layouts[4] =
+{
+	// mode,ops,voices
+	{0, 8,  32},
+	{1, 6,  42},
+	{2, 4,  64},
+	{3, 2, 128}
+};
+const layout_struct *FM_Layout = &FM_Layouts[0];
+
+/* shadow copies of the cfg reg and gate bits for all voices */
+uint32_t FM_Cfg;
+uint32_t FM_GateBits[4];
+
+/*
+ * note allocator - every voice of the layout is on one of two lists,
+ * released (oldest note-off at the head) or held (oldest note-on at the
+ * head), doubly linked through FM_VoicePrev/Next so all moves are O(1).
+ *
+ * A note patch change leaves sounding notes alone and marks every voice
+ * stale. FM_NoteService() loads stale released voices oldest first, one
+ * whole voice at a time; held ones wait for their note-off, and a stale
+ * voice a note-on takes is loaded in full before it gates. A commit while
+ * a voice is part loaded finishes that voice first, so no half-old,
+ * half-new voice goes live.
+ */
+#define FM_List_Rel 0
+#define FM_List_Held 1
+#define FM_Vel_Shift 1		/* carrier atten steps per velocity step */
+#define FM_Load_Backlog 96	/* max SPI bytes queued by the patch loader */
+#define FM_Quiet_Poll 1000	/* quietest voice reads per second, at most */
+
+voice_struct *FM_NotePatch;		/* patch slot notes play, or NULL */
+uint8_t FM_NoteProg = FM_No_Prog;	/* program notes play, or FM_No_Prog */
+uint64_t FM_NotePW[8];				/* what they play, packed */
+uint8_t FM_VoiceStale[FM_Max_Voices];	/* voice lacks FM_NotePW */
+uint8_t FM_StaleCount;
+uint8_t FM_LoadVoice, FM_LoadOp;	/* voice part loaded, op reached */
+uint8_t FM_LoadChanged;				/* its writes changed pmem */
+int16_t FM_BendCents, FM_TuneCents;
+uint32_t FM_NoteInc[128];			/* phase increment of each note */
+uint8_t FM_NoteCustom;				/* FM_NoteInc was uploaded */
+uint32_t FM_PitchMul = 1<<16;		/* bend & tuning, u16.16 */
+uint8_t FM_VoiceVel[FM_Max_Voices];
+uint8_t FM_NoteVoice[128];
+uint8_t FM_VoiceNote[FM_Max_Voices];
+uint8_t FM_VoicePrev[FM_Max_Voices], FM_VoiceNext[FM_Max_Voices];
+uint8_t FM_ListHead[2], FM_ListTail[2];
+
+/*
+ * quietest released & held voice as last read by FM_NoteService() - a
+ * read waits for the whole async queue, so note-ons never do one. An
+ * entry is dropped once its voice is taken.
+ */
+uint32_t FM_Quiet[2];
+uint32_t FM_QuietRead;				/* CYCCNT of the last read */
+
+/*
+ * fm_gen only sees a note-on as a gate edge between samples, so a voice
+ * that was gated off less than FM_RetrigCyc ago has its gate-on parked in
+ * a FIFO for FM_NoteService(). A voice is in the FIFO at most once. The
+ * release time is kept rather than a goal so the age test is an unsigned
+ * difference - a goal compare goes wrong once a voice idles for 2^31
+ * cycles. Every 2^32 cycles an idle voice looks just released for
+ * FM_RetrigCyc, which only delays a note-on by two samples.
+ *
+ * A note-on that changed a voice's pmem waits the same way for the bank
+ * swap, since the pitch & gate regs are not shadowed. fm_gen swaps
+ * within two samples of a commit arriving, so while FM_VoiceSwap[v] is
+ * set FM_VoiceRel[v] holds the commit's queue mark rather than a time,
+ * and the time it was seen sent replaces it. FM_NoteService() looks for
+ * sent marks every call, well before the frame count could wrap.
+ */
+uint32_t FM_RetrigCyc;
+uint32_t FM_VoiceRel[FM_Max_Voices];
+uint8_t FM_VoiceSwap[FM_Max_Voices];
+uint8_t FM_SwapCount;
+uint8_t FM_VoicePend[FM_Max_Voices];
+uint8_t FM_RetrigFifo[FM_Max_Voices];
+uint8_t FM_RetrigHead, FM_RetrigCount;
+
+static void FM_NoteLoadFinish(void);
+static void FM_VoiceSwapWait(uint8_t v);
 
 /*
  * set up the FPGA
  */
 void FM_Init(void)
 {
-	uint32_t bitmap_size = &_binary_bitmap_bin_end - &_binary_bitmap_bin_start;
-	uint8_t result;
-	uint32_t reg;
+	uint32_t bitmap_size = &_binary_bitmap_rle_end - &_binary_bitmap_rle_start;
+	uint8_t result, i;
+	uint32_t reg, act, tot;
 	
 	/* ICE5 FPGA interface setup */
 	ICE5_Init();
 	printf("FM_Init: ice5 interface initialized\n");
-	//printf("Bitstream start @ 0x%08x\n", (unsigned int)&_binary_bitmap_bin_start);
-	//printf("Bitstream end   @ 0x%08x\n", (unsigned int)&_binary_bitmap_bin_end);
+	//printf("Bitstream start @ 0x%08x\n", (unsigned int)&_binary_bitmap_rle_start);
+	//printf("Bitstream end   @ 0x%08x\n", (unsigned int)&_binary_bitmap_rle_end);
 	//printf("Bitstream length = 0x%08x bytes\n", (unsigned int)bitmap_size);
 	
 	/* load bitstream */
-	printf("FM_Init: Configuring %d bytes....", (unsigned int)bitmap_size);
-	result = ICE5_FPGA_Config(&_binary_bitmap_bin_start, bitmap_size);
+	printf("FM_Init: Configuring %d bytes from %d....",
+		(unsigned int)ICE5_RLE_Size(&_binary_bitmap_rle_start),
+		(unsigned int)bitmap_size);
+	start_meas();
+	result = ICE5_FPGA_ConfigRLE(&_binary_bitmap_rle_start, bitmap_size);
+	end_meas();
+	get_meas(&act, &tot);
 	if(!result)
-		printf("Done\n");
+		printf("Done in %u us\n", (unsigned int)(act/(SystemCoreClock/1000000)));
 	else
 		printf("Error code %d\n", result);
 	
@@ -68,15 +162,23 @@ void FM_Init(void)
 	printf("FM_Init: ID = 0x%08x\n", (unsigned int)reg);
 	
 	/* set blink rate */
-	ICE5_FPGA_Slave_Write(1, 1249);
+	ICE5_FPGA_Slave_Queue(1, 1249);
+	
+	/* patch changes go to the shadow bank until committed */
+	FM_SetShadow(1);
 	
-	/* set up voice 0 */
-	memcpy(&voices[0], &test_voice_0, sizeof(voice_struct));
-	FM_SetVoicePatch(0, &voices[0], 100.0F);
+	/* test voices in every patch slot until a bank is uploaded */
+	for(i=0;i<FM_Num_Patches;i++)
+		memcpy(&voices[i], i&1 ? &test_voice_1 : &test_voice_0, sizeof(voice_struct));
 	
-	/* set up voice 1 */
-	memcpy(&voices[1], &test_voice_1, sizeof(voice_struct));
-	FM_SetVoicePatch(1, &voices[1], 1000.0F);	
+	/* notes play program 0 - 2 samples is enough for a gate edge */
+	BANK_Init();
+	FM_RetrigCyc = 2*(uint32_t)(SystemCoreClock / FM_Fsample);
+	FM_NoteReset();
+	FM_SetNoteProgram(0);
+	
+	/* equal temperament until a tuning table is uploaded */
+	FM_SetNoteTable(0, NULL, 0);
 }
 
 /*
@@ -88,38 +190,60 @@ uint32_t FM_CalcFreq(float32_t freq)
 }
 
 /*
- * setup an operator
+ * compute u5.11 frequency ratio
  */
-void FM_SetOperator(uint8_t opnum, operator_struct *op, float32_t base_freq)
+uint32_t FM_CalcRatio(float32_t ratio)
 {
+	ratio = ratio * (float32_t)(1<<FM_Ratio_Bits) + 0.5F;
+	if(ratio > (float32_t)FM_Ratio_Mask)
+		return FM_Ratio_Mask;
+	return (uint32_t)ratio;
+}
+
+/*
+ * pack an operator into the 64-bit FPGA parameter word
+ */
+uint64_t FM_PackOperator(operator_struct *op)
+{
+	uint64_t pw;
+	
 	/* set freq */
 	if(op->freq < 0.0F)
-		/* negative freqs are relative to base */
-		ICE5_FPGA_Slave_Write(2, FM_CalcFreq(-op->freq*base_freq));
+	{
+		/* negative freqs are ratios of the voice pitch */
+		pw = (uint64_t)FM_CalcRatio(-op->freq) << FM_PW_Frq_Shift;
+		pw |= (uint64_t)1 << FM_PW_Ratio_Shift;
+	}
 	else
 		/* positive freqs are absolute */
-		ICE5_FPGA_Slave_Write(2, FM_CalcFreq(op->freq));
-	
-	/* set wave */
-	ICE5_FPGA_Slave_Write(4, op->wave&0x7);
-	
-	/* Set ADSR */
-	ICE5_FPGA_Slave_Write(5, op->ar&0x3F);
-	ICE5_FPGA_Slave_Write(6, op->dr&0x3F);
-	ICE5_FPGA_Slave_Write(7, op->sl&0x1F);
-	ICE5_FPGA_Slave_Write(8, op->dr&0x3F);
+		pw = (uint64_t)FM_CalcFreq(op->freq) << FM_PW_Frq_Shift;
 	
-	/* set atten */
-	ICE5_FPGA_Slave_Write(9, op->atten&0x1FF);
+	/* wave, atten & ADSR */
+	pw |= (uint64_t)(op->wave&0x7) << FM_PW_Wv_Shift;
+	pw |= (uint64_t)(op->atten&0x1FF) << FM_PW_Adj_Shift;
+	pw |= (uint64_t)(op->ar&0x3F) << FM_PW_Ar_Shift;
+	pw |= (uint64_t)(op->dr&0x3F) << FM_PW_Dr_Shift;
+	pw |= (uint64_t)(op->sl&0x1F) << FM_PW_Sl_Shift;
+	pw |= (uint64_t)(op->rr&0x3F) << FM_PW_Rr_Shift;
 	
-	/* set routing flags */
-	ICE5_FPGA_Slave_Write(10, op->flags&0x3F);
+	/* routing flags - bits 54-59 are li, ri, mod, acc_en, acc_cl, fb. li/ri
+	   keep reg 10's order, the other four are reversed (FM_PW_* in fm.h) */
+	pw |= (uint64_t)((op->flags & FM_Flag_Left) != 0) << FM_PW_Li_Shift;
+	pw |= (uint64_t)((op->flags & FM_Flag_Right) != 0) << FM_PW_Ri_Shift;
+	pw |= (uint64_t)((op->flags & FM_Flag_MOD_EN) != 0) << FM_PW_Mod_Shift;
+	pw |= (uint64_t)((op->flags & FM_Flag_ACC_EN) != 0) << FM_PW_AccEn_Shift;
+	pw |= (uint64_t)((op->flags & FM_Flag_ACC_CL) != 0) << FM_PW_AccCl_Shift;
+	pw |= (uint64_t)((op->flags & FM_Flag_FB_EN) != 0) << FM_PW_Fb_Shift;
 	
-	/* set address */
-	ICE5_FPGA_Slave_Write(11, opnum&0x7F);
-	
-	/* write strobe */
-	ICE5_FPGA_Slave_Write(12, 1);
+	return pw;
+}
+
+/*
+ * setup an operator - returns 0 if it was already set that way
+ */
+uint8_t FM_SetOperator(uint8_t opnum, operator_struct *op)
+{
+	return ICE5_FPGA_Param_Write(opnum, FM_PackOperator(op));
 }
 
 /*
@@ -147,30 +271,51 @@ void FM_SetVoiceOpWave(voice_struct *vs, uint8_t opnum, uint8_t wave)
 }
 
 /*
- * set voice freq but leave other params alone
- * note - doesn't work right because write strobe updats other params too.
+ * set voice pitch - ratio ops follow it in hardware
  */
-void FM_SetVoiceFreq(uint8_t voice_num, voice_struct *vs, float32_t base_freq)
+void FM_SetVoiceFreq(uint8_t voice_num, float32_t base_freq)
 {
-	uint8_t i;
+	ICE5_FPGA_Slave_Queue(0x13, ((voice_num&0x7F)<<24) | FM_CalcFreq(base_freq));
+}
+
+/*
+ * phase increment of a pitch in cents above MIDI note 0 - the semitone
+ * of the top octave times the cents, shifted down to the octave
+ */
+uint32_t FM_CalcPitch(int32_t cents)
+{
+	uint32_t oct, semi;
+	uint64_t inc;
 	
-	/* loop over all ops in the voice */
-	for(i=0;i<8;i++)
+	if(cents < 0)
+		cents = 0;
+	else if(cents > 1200*(FM_Tune_Top+1) - 1)
+		cents = 1200*(FM_Tune_Top+1) - 1;
+	
+	oct = cents / 1200;
+	cents -= oct*1200;
+	semi = cents / 100;
+	inc = (uint64_t)FM_Tune_Semi[semi] * FM_Tune_Cent[cents - semi*100];
+	inc >>= FM_Tune_Frac + FM_Tune_Cent_Bits + FM_Tune_Top - oct - 1;
+	
+	return ((uint32_t)inc + 1) >> 1;
+}
+
+/*
+ * set voice pitch from a MIDI note number - the note table scaled by the
+ * pitch bend & tuning
+ */
+void FM_SetVoicePitch(uint8_t voice_num, uint8_t note)
+{
+	uint32_t inc = FM_NoteInc[note&0x7F];
+	
+	if(FM_PitchMul != (1<<16))
 	{
-		/* set freq */
-		if(vs->ops[voice_num].freq < 0.0F)
-			/* negative freqs are relative to base */
-			ICE5_FPGA_Slave_Write(2, FM_CalcFreq(-vs->ops[voice_num].freq*base_freq));
-		else
-			/* positive freqs are absolute */
-			ICE5_FPGA_Slave_Write(2, FM_CalcFreq(vs->ops[voice_num].freq));
-		
-		/* set address */
-		ICE5_FPGA_Slave_Write(11, (voice_num*8 + i)&0x7F);
-		
-		/* write strobe */
-		ICE5_FPGA_Slave_Write(12, 1);
+		inc = ((uint64_t)inc * FM_PitchMul + (1<<15)) >> 16;
+		if(inc > FM_Freq_Mask)
+			inc = FM_Freq_Mask;
 	}
+	ICE5_FPGA_Slave_Queue(0x13, ((voice_num&0x7F)<<24) | inc);
 }
 
 /*
@@ -178,19 +323,700 @@ void FM_SetVoiceFreq(uint8_t voice_num, voice_struct *vs, float32_t base_freq)
  */
 void FM_SetVoicePatch(uint8_t voice_num, voice_struct *vs, float32_t base_freq)
 {
-	uint8_t i;
+	uint8_t i, changed = 0;
 	
 	/* loop over all ops in the patch */
+	for(i=0;i<FM_Layout->ops;i++)
+	{
+		changed |= FM_SetOperator(FM_Layout->ops*voice_num+i, &vs->ops[i]);
+	}
+	
+	/* whole patch goes live on one sample */
+	if(changed)
+		FM_Commit();
+	
+	/* ratio ops pick this up on their own */
+	FM_SetVoiceFreq(voice_num, base_freq);
+}
+
+/*
+ * packed words of a program - from the flash bank, or for a program never
+ * stored the patch slot it falls back to
+ */
+static const uint64_t *FM_GetProgram(uint8_t prog)
+{
+	static uint64_t pw[8];
+	const uint64_t *stored = BANK_Get(prog);
+	uint8_t i;
+	
+	if(stored)
+		return stored;
+	
+	for(i=0;i<8;i++)
+		pw[i] = FM_PackOperator(&voices[prog % FM_Num_Patches].ops[i]);
+	return pw;
+}
+
+/*
+ * setup a voice with a program - the stored words go straight out, no
+ * packing, and go live on one sample
+ */
+void FM_LoadProgram(uint8_t voice_num, uint8_t prog)
+{
+	const uint64_t *pw = FM_GetProgram(prog);
+	uint8_t i, changed = 0;
+	
+	for(i=0;i<FM_Layout->ops;i++)
+		changed |= ICE5_FPGA_Param_Write(FM_Layout->ops*voice_num+i, pw[i]);
+	
+	if(changed)
+		FM_Commit();
+}
+
+/*
+ * pack a patch into the flash bank - returns 1 if it could not be
+ * written. Takes up to a few hundred ms when the bank needs compacting.
+ */
+uint8_t FM_StoreProgram(uint8_t prog, voice_struct *vs)
+{
+	uint64_t pw[8];
+	uint8_t i;
+	
+	for(i=0;i<8;i++)
+		pw[i] = FM_PackOperator(&vs->ops[i]);
+	if(BANK_Store(prog, pw))
+		return 1;
+	
+	/* notes pick up a changed program straight away */
+	if(prog == FM_NoteProg)
+		FM_SetNoteProgram(prog);
+	return 0;
+}
+
+/*
+ * select shadowed (1) or direct (0) parameter writes
+ */
+void FM_SetShadow(uint8_t enable)
+{
+	FM_Cfg = (FM_Cfg & ~FM_Cfg_Shadow) | (enable ? FM_Cfg_Shadow : 0);
+	ICE5_FPGA_Slave_Queue(13, FM_Cfg);
+}
+
+/*
+ * select the number of operators per voice - 8, 6, 4 or 2. Voices
+ * should be silent and re-patched afterwards since op groupings change.
+ */
+uint8_t FM_SetLayout(uint8_t ops_per_voice)
+{
+	uint8_t i;
+	
+	for(i=0;i<4;i++)
+	{
+		if(FM_Layouts[i].ops == ops_per_voice)
+		{
+			FM_Layout = &FM_Layouts[i];
+			FM_Cfg = (FM_Cfg & ~FM_Cfg_Mode) | (FM_Layout->mode<<1);
+			ICE5_FPGA_Slave_Queue(13, FM_Cfg);
+			
+			/* ops moved between voices so stop & patch them all again */
+			FM_NoteReset();
+			if(FM_NoteProg != FM_No_Prog)
+				FM_SetNoteProgram(FM_NoteProg);
+			else if(FM_NotePatch)
+				FM_SetNotePatch(FM_NotePatch);
+			return 0;
+		}
+	}
+	
+	/* not a supported layout */
+	return 1;
+}
+
+/*
+ * set mix bus gain and I2S frame. The sum of all ops is shifted left by
+ * 0-15 bits and saturated to 24 bits - 8 gives the old 16-bit level. With
+ * i2s24 set the DAC gets all 24 bits in a 64fs frame, otherwise the top
+ * 16 bits in a 32fs frame.
+ */
+void FM_SetMix(uint8_t shift, uint8_t i2s24)
+{
+	ICE5_FPGA_Slave_Queue(23, shift & 15);
+	FM_Cfg = (FM_Cfg & ~FM_Cfg_I2S24) | (i2s24 ? FM_Cfg_I2S24 : 0);
+	ICE5_FPGA_Slave_Queue(13, FM_Cfg);
+}
+
+/*
+ * swap shadowed parameter writes into use at the next sample
+ */
+void FM_Commit(void)
+{
+	uint8_t v = FM_LoadOp ? FM_LoadVoice : FM_No_Voice;
+	
+	FM_NoteLoadFinish();
+	ICE5_FPGA_Slave_Queue(12, 4);
+	if(v != FM_No_Voice)
+		FM_VoiceSwapWait(v);
+}
+
+/*
+ * check if a commit is still waiting for a sample boundary
+ */
+uint8_t FM_CommitPending(void)
+{
+	uint32_t stat;
+	
+	ICE5_FPGA_Slave_Read(12, &stat);
+	return stat & 1;
+}
+
+/*
+ * trigger voice(s) 0-31
+ */
+void FM_Gate(uint32_t gate_word)
+{
+	FM_GateBits[0] = gate_word;
+	ICE5_FPGA_Slave_Queue(3, gate_word);
+}
+
+/*
+ * start / stop one voice - gate words for voices 32+ are at 0x14-0x16
+ */
+void FM_GateVoice(uint8_t voice_num, uint8_t on)
+{
+	uint8_t w = (voice_num>>5) & 3;
+	
+	if(on)
+		FM_GateBits[w] |= 1UL<<(voice_num&31);
+	else
+		FM_GateBits[w] &= ~(1UL<<(voice_num&31));
+	
+	ICE5_FPGA_Slave_Queue(w ? 0x13+w : 3, FM_GateBits[w]);
+}
+
+/*
+ * move a voice to the tail of a list
+ */
+static void FM_VoiceMove(uint8_t v, uint8_t from, uint8_t to)
+{
+	uint8_t p = FM_VoicePrev[v], n = FM_VoiceNext[v];
+	
+	/* unlink */
+	if(p == FM_No_Voice)
+		FM_ListHead[from] = n;
+	else
+		FM_VoiceNext[p] = n;
+	if(n == FM_No_Voice)
+		FM_ListTail[from] = p;
+	else
+		FM_VoicePrev[n] = p;
+	
+	/* append */
+	FM_VoicePrev[v] = FM_ListTail[to];
+	FM_VoiceNext[v] = FM_No_Voice;
+	if(FM_ListTail[to] == FM_No_Voice)
+		FM_ListHead[to] = v;
+	else
+		FM_VoiceNext[FM_ListTail[to]] = v;
+	FM_ListTail[to] = v;
+}
+
+/*
+ * gate a voice off and note when it can be retriggered
+ */
+static void FM_VoiceRelease(uint8_t v)
+{
+	FM_GateVoice(v, 0);
+	if(!FM_VoiceSwap[v])
+		FM_VoiceRel[v] = DWT->CYCCNT;
+}
+
+/*
+ * hold a voice's gate for the commit just queued
+ */
+static void FM_VoiceSwapWait(uint8_t v)
+{
+	if(!FM_VoiceSwap[v])
+	{
+		FM_VoiceSwap[v] = 1;
+		FM_SwapCount++;
+	}
+	FM_VoiceRel[v] = ICE5_FPGA_Slave_Mark();
+}
+
+/*
+ * start the swap wait of a voice once its commit has gone out - seen
+ * later than sent is only safer
+ */
+static void FM_VoiceSwapCheck(uint8_t v)
+{
+	if(FM_VoiceSwap[v] && ICE5_FPGA_Slave_Sent(FM_VoiceRel[v]))
+	{
+		FM_VoiceSwap[v] = 0;
+		FM_SwapCount--;
+		FM_VoiceRel[v] = DWT->CYCCNT;
+	}
+}
+
+/*
+ * check if fm_gen has seen a voice's gate low and its pmem swapped in
+ */
+static uint8_t FM_VoiceReady(uint8_t v)
+{
+	FM_VoiceSwapCheck(v);
+	if(FM_VoiceSwap[v])
+		return 0;
+	return (uint32_t)(DWT->CYCCNT - FM_VoiceRel[v]) >= FM_RetrigCyc;
+}
+
+/*
+ * write one op of the note patch to a voice, carriers scaled by the
+ * voice's velocity - 127 is the patch level
+ */
+static uint8_t FM_SetNoteOp(uint8_t v, uint8_t i)
+{
+	uint64_t pw = FM_NotePW[i];
+	uint32_t atten;
+	
+	if(pw & FM_PW_Carrier)
+	{
+		atten = ((pw & FM_PW_Adj_Mask) >> FM_PW_Adj_Shift) +
+			((127 - FM_VoiceVel[v]) << FM_Vel_Shift);
+		pw = (pw & ~FM_PW_Adj_Mask) |
+			((uint64_t)(atten > 511 ? 511 : atten) << FM_PW_Adj_Shift);
+	}
+	return ICE5_FPGA_Param_Write(FM_Layout->ops*v+i, pw);
+}
+
+/*
+ * a voice has all of FM_NotePW - drop it from the loader
+ */
+static void FM_VoiceLoaded(uint8_t v)
+{
+	if(FM_LoadOp && (FM_LoadVoice == v))
+		FM_LoadOp = 0;
+	FM_VoiceStale[v] = 0;
+	FM_StaleCount--;
+}
+
+/*
+ * complete the voice the loader is part way through
+ */
+static void FM_NoteLoadFinish(void)
+{
+	if(!FM_LoadOp)
+		return;
+	
+	while(FM_LoadOp < FM_Layout->ops)
+		FM_SetNoteOp(FM_LoadVoice, FM_LoadOp++);
+	FM_VoiceLoaded(FM_LoadVoice);
+}
+
+/*
+ * oldest released voice still to load, or FM_No_Voice
+ */
+static uint8_t FM_NextStale(void)
+{
+	uint8_t v;
+	
+	for(v=FM_ListHead[FM_List_Rel];v!=FM_No_Voice;v=FM_VoiceNext[v])
+		if(FM_VoiceStale[v])
+			break;
+	return v;
+}
+
+/*
+ * set the velocity of a voice and rewrite its carriers - all of its ops
+ * if it is stale
+ */
+static void FM_SetVoiceVelocity(uint8_t v, uint8_t velocity)
+{
+	uint8_t i, changed = 0, stale = FM_VoiceStale[v];
+	
+	FM_VoiceVel[v] = velocity & 0x7F;
+	for(i=0;i<FM_Layout->ops;i++)
+		if(stale || (FM_NotePW[i] & FM_PW_Carrier))
+			changed |= FM_SetNoteOp(v, i);
+	if(stale)
+		FM_VoiceLoaded(v);
+	
+	if(changed)
+	{
+		FM_Commit();
+		FM_VoiceSwapWait(v);
+	}
+}
+
+/*
+ * mark every voice stale for FM_NoteService() to load FM_NotePW onto a
+ * few writes at a time, so a gate write never waits behind more than
+ * FM_Load_Backlog bytes. A part loaded voice starts over - none of its
+ * new words have been committed.
+ */
+static void FM_NoteLoad(void)
+{
+	uint8_t v;
+	
+	for(v=0;v<FM_Layout->voices;v++)
+		FM_VoiceStale[v] = 1;
+	FM_StaleCount = FM_Layout->voices;
+	FM_LoadOp = 0;
+}
+
+/*
+ * notes play a patch slot
+ */
+void FM_SetNotePatch(voice_struct *vs)
+{
+	uint8_t i;
+	
+	FM_NotePatch = vs;
+	FM_NoteProg = FM_No_Prog;
 	for(i=0;i<8;i++)
+		FM_NotePW[i] = FM_PackOperator(&vs->ops[i]);
+	FM_NoteLoad();
+}
+
+/*
+ * notes play a program - a slot if it was never stored. Stored words are
+ * copied as they are so a program change costs no packing.
+ */
+void FM_SetNoteProgram(uint8_t prog)
+{
+	const uint64_t *pw = BANK_Get(prog);
+	
+	if(!pw)
+		FM_SetNotePatch(&voices[prog % FM_Num_Patches]);
+	else
+	{
+		FM_NotePatch = NULL;
+		memcpy(FM_NotePW, pw, sizeof(FM_NotePW));
+		FM_NoteLoad();
+	}
+	FM_NoteProg = prog;
+}
+
+/*
+ * program notes play, FM_No_Prog if a slot was picked directly
+ */
+uint8_t FM_GetNoteProgram(void)
+{
+	return FM_NoteProg;
+}
+
+/*
+ * check if the note patch loader has released voices left to do - held
+ * voices wait for their note-off
+ */
+uint8_t FM_NotePatchBusy(void)
+{
+	return FM_StaleCount && (FM_NextStale() != FM_No_Voice);
+}
+
+/*
+ * all voices off and released in voice order
+ */
+void FM_NoteReset(void)
+{
+	uint8_t v, n = FM_Layout->voices;
+	uint32_t then = DWT->CYCCNT - FM_RetrigCyc;
+	
+	for(v=0;v<4;v++)
+	{
+		FM_GateBits[v] = 0;
+		ICE5_FPGA_Slave_Queue(v ? 0x13+v : 3, 0);
+	}
+	
+	memset(FM_NoteVoice, FM_No_Voice, sizeof(FM_NoteVoice));
+	for(v=0;v<n;v++)
+	{
+		FM_VoiceNote[v] = FM_No_Note;
+		FM_VoicePrev[v] = v ? v-1 : FM_No_Voice;
+		FM_VoiceNext[v] = (v < n-1) ? v+1 : FM_No_Voice;
+		if(!FM_VoiceSwap[v])
+			FM_VoiceRel[v] = then;
+		FM_VoicePend[v] = 0;
+		FM_VoiceVel[v] = 127;
+	}
+	FM_ListHead[FM_List_Rel] = 0;
+	FM_ListTail[FM_List_Rel] = n-1;
+	FM_ListHead[FM_List_Held] = FM_ListTail[FM_List_Held] = FM_No_Voice;
+	FM_RetrigHead = FM_RetrigCount = 0;
+	FM_Quiet[FM_List_Rel] = FM_Quiet[FM_List_Held] = 0;
+}
+
+/*
+ * quietest voice fm_gen saw with the gate off or on when last read.
+ * Returns FM_No_Voice if there was none or the allocator has since moved
+ * it to the other list.
+ */
+static uint8_t FM_QuietVoice(uint8_t held)
+{
+	uint32_t q = FM_Quiet[held];
+	uint8_t v;
+	
+	v = FM_Quiet_Voice(q);
+	if(!(q & FM_Quiet_Valid) || (v >= FM_Layout->voices))
+		return FM_No_Voice;
+	if((FM_VoiceNote[v] != FM_No_Note) != held)
+		return FM_No_Voice;
+	return v;
+}
+
+/*
+ * start a note - returns the voice it got. Takes the quietest released
+ * voice, or steals the quietest held one when none are released. Falls
+ * back to the oldest when the hardware's view is out of date.
+ */
+uint8_t FM_NoteOn(uint8_t note, uint8_t velocity)
+{
+	uint8_t v, i;
+	
+	note &= 0x7F;
+	if(!velocity)
+	{
+		/* MIDI convention */
+		FM_NoteOff(note);
+		return FM_No_Voice;
+	}
+	
+	/* keys a tuning table leaves unmapped */
+	if(!FM_NoteInc[note])
+		return FM_No_Voice;
+	
+	/* restruck notes let the old voice ring out */
+	if(FM_NoteVoice[note] != FM_No_Voice)
+		FM_NoteOff(note);
+	
+	if(FM_ListHead[FM_List_Rel] != FM_No_Voice)
+	{
+		if((v = FM_QuietVoice(0)) == FM_No_Voice)
+			v = FM_ListHead[FM_List_Rel];
+		FM_VoiceMove(v, FM_List_Rel, FM_List_Held);
+	}
+	else
+	{
+		if((v = FM_QuietVoice(1)) == FM_No_Voice)
+			v = FM_ListHead[FM_List_Held];
+		FM_NoteVoice[FM_VoiceNote[v]] = FM_No_Voice;
+		FM_VoiceRelease(v);
+		FM_VoiceMove(v, FM_List_Held, FM_List_Held);
+	}
+	for(i=0;i<2;i++)
+		if(FM_Quiet_Voice(FM_Quiet[i]) == v)
+			FM_Quiet[i] = 0;
+	FM_VoiceNote[v] = note;
+	FM_NoteVoice[note] = v;
+	
+	FM_SetVoiceVelocity(v, velocity);
+	FM_SetVoicePitch(v, note);
+	
+	/* gate now if fm_gen has seen it low, otherwise park it */
+	if(FM_VoiceReady(v))
+		FM_GateVoice(v, 1);
+	else if(!FM_VoicePend[v])
 	{
-		FM_SetOperator(8*voice_num+i, &vs->ops[i], base_freq);
+		FM_VoicePend[v] = 1;
+		FM_RetrigFifo[(FM_RetrigHead + FM_RetrigCount++) % FM_Max_Voices] = v;
 	}
+	
+	return v;
+}
+
+/*
+ * check if a voice's gate-on is parked for FM_NoteService()
+ */
+uint8_t FM_GateParked(uint8_t v)
+{
+	return FM_VoicePend[v];
 }
 
 /*
- * trigger voice(s)
+ * release a note
  */
-void FM_Gate(uint16_t gate_word)
+void FM_NoteOff(uint8_t note)
 {
-	ICE5_FPGA_Slave_Write(3, gate_word);
-}
\ No newline at end of file
+	uint8_t v = FM_NoteVoice[note&0x7F];
+	
+	if(v == FM_No_Voice)
+		return;
+	
+	FM_NoteVoice[note&0x7F] = FM_No_Voice;
+	FM_VoiceNote[v] = FM_No_Note;
+	FM_VoiceMove(v, FM_List_Held, FM_List_Rel);
+	FM_VoiceRelease(v);
+}
+
+/*
+ * bend + tuning as a ratio for FM_SetVoicePitch & retune held voices
+ */
+static void FM_Retune(void)
+{
+	int32_t cents = FM_BendCents + FM_TuneCents;
+	uint8_t v;
+	
+	/* any note of the top octave gives the ratio */
+	if(cents > 1199)
+		cents = 1199;
+	else if(cents < -1199)
+		cents = -1199;
+	FM_PitchMul = ((uint64_t)FM_CalcPitch(12000 + cents) << 16) / FM_CalcPitch(12000);
+	
+	for(v=FM_ListHead[FM_List_Held];v!=FM_No_Voice;v=FM_VoiceNext[v])
+		FM_SetVoicePitch(v, FM_VoiceNote[v]);
+}
+
+/*
+ * pitch bend in cents
+ */
+void FM_SetBend(int16_t cents)
+{
+	FM_BendCents = cents;
+	FM_Retune();
+}
+
+/*
+ * global tuning in cents from the A4 the tables were built for
+ */
+void FM_SetTune(int16_t cents)
+{
+	FM_TuneCents = cents;
+	FM_Retune();
+}
+
+int16_t FM_GetTune(void)
+{
+	return FM_TuneCents;
+}
+
+/*
+ * load phase increments for count notes from first, or go back to equal
+ * temperament with count 0. Increments of 0 leave the note unplayed.
+ * Returns 1 if the range or an increment is out of bounds.
+ */
+uint8_t FM_SetNoteTable(uint8_t first, const uint32_t *inc, uint8_t count)
+{
+	uint8_t i;
+	
+	if(!count)
+	{
+		for(i=0;i<128;i++)
+			FM_NoteInc[i] = FM_CalcPitch(100*i);
+		FM_NoteCustom = 0;
+	}
+	else
+	{
+		if(first + count > 128)
+			return 1;
+		for(i=0;i<count;i++)
+			if(inc[i] > FM_Freq_Mask)
+				return 1;
+		memcpy(&FM_NoteInc[first], inc, count*sizeof(uint32_t));
+		FM_NoteCustom = 1;
+	}
+	
+	FM_Retune();
+	return 0;
+}
+
+/*
+ * 1 if notes play an uploaded table
+ */
+uint8_t FM_GetNoteTable(void)
+{
+	return FM_NoteCustom;
+}
+
+/*
+ * issue parked gate-ons once fm_gen has had time to see the gate low and
+ * swap in the voice's pmem, and move any patch load along. Call from the
+ * main loop.
+ */
+void FM_NoteService(void)
+{
+	uint32_t bytes;
+	uint8_t v;
+	
+	/* patch load, throttled to keep the SPI queue short */
+	if(FM_StaleCount)
+	{
+		ICE5_FPGA_Slave_Pending(&bytes);
+		while(bytes < FM_Load_Backlog)
+		{
+			if(!FM_LoadOp && ((FM_LoadVoice = FM_NextStale()) == FM_No_Voice))
+				break;
+			
+			if(!FM_LoadOp)
+				FM_LoadChanged = 0;
+			FM_LoadChanged |= FM_SetNoteOp(FM_LoadVoice, FM_LoadOp++);
+			if(FM_LoadOp == FM_Layout->ops)
+			{
+				/* whole voice in, it can go live */
+				FM_VoiceLoaded(FM_LoadVoice);
+				if(FM_LoadChanged)
+				{
+					FM_Commit();
+					FM_VoiceSwapWait(FM_LoadVoice);
+				}
+			}
+			ICE5_FPGA_Slave_Pending(&bytes);
+		}
+	}
+	
+	for(v=0;FM_SwapCount && (v<FM_Max_Voices);v++)
+		FM_VoiceSwapCheck(v);
+	
+	/* quietest voices for FM_NoteOn(), read only with the queue empty */
+	if(((uint32_t)(DWT->CYCCNT - FM_QuietRead) >= SystemCoreClock / FM_Quiet_Poll) &&
+		!ICE5_FPGA_Slave_Pending(NULL))
+	{
+		ICE5_FPGA_Slave_Read(FM_Reg_QuietRel, &FM_Quiet[FM_List_Rel]);
+		ICE5_FPGA_Slave_Read(FM_Reg_QuietHeld, &FM_Quiet[FM_List_Held]);
+		FM_QuietRead = DWT->CYCCNT;
+	}
+	
+	while(FM_RetrigCount)
+	{
+		v = FM_RetrigFifo[FM_RetrigHead];
+		if(!FM_VoiceReady(v))
+			break;
+		
+		FM_RetrigHead = (FM_RetrigHead + 1) % FM_Max_Voices;
+		FM_RetrigCount--;
+		FM_VoicePend[v] = 0;
+		
+		/* skip voices released while they waited */
+		if(FM_VoiceNote[v] != FM_No_Note)
+			FM_GateVoice(v, 1);
+	}
+}
+
+/*
+ * read the silent bitmap - 4 words, voice 0 in bit 0 of the first.
+ * fm_gen only updates the voices it scans, so voices past the layout
+ * keep what an earlier layout left and are set here instead.
+ */
+void FM_GetSilent(uint32_t *bits)
+{
+	uint8_t i, n = FM_Layout->voices;
+	
+	for(i=0;i<4;i++)
+	{
+		ICE5_FPGA_Slave_Read(FM_Reg_Silent+i, &bits[i]);
+		if(n <= 32*i)
+			bits[i] = 0xFFFFFFFF;
+		else if(n < 32*(i+1))
+			bits[i] |= 0xFFFFFFFF << (n - 32*i);
+	}
+}
+
+/*
+ * read the loudest carrier atten of a voice from the last scan
+ */
+uint16_t FM_GetVoiceAtten(uint8_t voice_num)
+{
+	uint32_t reg;
+	
+	ICE5_FPGA_Slave_Queue(FM_Reg_VoiceAtten, voice_num&0x7F);
+	ICE5_FPGA_Slave_Read(FM_Reg_VoiceAtten, &reg);
+	return reg & 0x1FF;
+}
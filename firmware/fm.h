@@ -9,9 +9,11 @@
 #include "stm32f30x.h"
 #include "arm_math.h"
 
-#define FM_Fsample 48000.0F
+#define FM_Fsample 46875.0F	/* 48MHz / 1024 */
 #define FM_Freq_Bits 19
 #define FM_Freq_Mask ((1<<FM_Freq_Bits)-1)
+#define FM_Ratio_Bits 11
+#define FM_Ratio_Mask 0xFFFF
 #define FM_Flag_FB_EN (1<<0)
 #define FM_Flag_ACC_CL (1<<1)
 #define FM_Flag_ACC_EN (1<<2)
@@ -19,6 +21,46 @@
 #define FM_Flag_Left (1<<4)
 #define FM_Flag_Right (1<<5)
 
+/* packed parameter word fields - matches pmem in fm_gen.v */
+#define FM_PW_Frq_Shift 0
+#define FM_PW_Wv_Shift 19
+#define FM_PW_Adj_Shift 22
+#define FM_PW_Ar_Shift 31
+#define FM_PW_Dr_Shift 37
+#define FM_PW_Sl_Shift 43
+#define FM_PW_Rr_Shift 48
+#define FM_PW_Li_Shift 54
+#define FM_PW_Ri_Shift 55
+#define FM_PW_Mod_Shift 56
+#define FM_PW_AccEn_Shift 57
+#define FM_PW_AccCl_Shift 58
+#define FM_PW_Fb_Shift 59
+#define FM_PW_Ratio_Shift 60
+#define FM_PW_Adj_Mask ((uint64_t)0x1FF << FM_PW_Adj_Shift)
+#define FM_PW_Carrier ((uint64_t)3 << FM_PW_Li_Shift)
+
+/* note allocator */
+#define FM_Max_Voices 128
+#define FM_Num_Patches 16	/* patch slots in voices[] */
+#define FM_No_Voice 0xFF
+#define FM_No_Note 0xFF
+#define FM_No_Prog 0xFF
+
+/* voice activity regs - silent bitmap, quietest voice gated off / on and
+   loudest carrier atten of the voice selected in 0x1E */
+#define FM_Reg_Silent 0x18
+#define FM_Reg_QuietRel 0x1C
+#define FM_Reg_QuietHeld 0x1D
+#define FM_Reg_VoiceAtten 0x1E
+#define FM_Quiet_Valid 0x80000000UL
+#define FM_Quiet_Voice(q) (((q)>>16)&0x7F)
+#define FM_Quiet_Atten(q) ((q)&0x1FF)
+
+/* cfg reg 0x0D fields */
+#define FM_Cfg_Shadow (1<<0)
+#define FM_Cfg_Mode (3<<1)
+#define FM_Cfg_I2S24 (1<<3)
+
 typedef struct
 {
 	float32_t freq;		/* operator frequency (+fixed or -relative) */
@@ -36,16 +78,53 @@ typedef struct
 	operator_struct ops[8];		/* array of operators */
 } voice_struct;
 
-extern voice_struct voices[2];
+/* voice layouts - fm_gen groups its ops into voices of 8, 6, 4 or 2 */
+typedef struct
+{
+	uint8_t mode;		/* fm_gen ops per voice mode in cfg reg */
+	uint8_t ops;		/* operators per voice */
+	uint8_t voices;		/* voices that fit in the op scan */
+} layout_struct;
+
+extern voice_struct voices[FM_Num_Patches];
+extern voice_struct *FM_NotePatch;
+extern const layout_struct *FM_Layout;
 
 void FM_Init(void);
-void FM_SetOperator(uint8_t opnum, operator_struct *op, float32_t base_freq);
+uint64_t FM_PackOperator(operator_struct *op);
+uint8_t FM_SetOperator(uint8_t opnum, operator_struct *op);
 void FM_SetVoiceOpFreq(voice_struct *vs, uint8_t opnum, float32_t freq);
 void FM_SetVoiceOpAtten(voice_struct *vs, uint8_t opnum, uint16_t atten);
 void FM_SetVoiceOpWave(voice_struct *vs, uint8_t opnum, uint8_t wave);
 
-void FM_SetVoiceFreq(uint8_t voice_num, voice_struct *vs, float32_t base_freq);
+void FM_SetVoiceFreq(uint8_t voice_num, float32_t base_freq);
+uint32_t FM_CalcPitch(int32_t cents);
+uint8_t FM_SetNoteTable(uint8_t first, const uint32_t *inc, uint8_t count);
+uint8_t FM_GetNoteTable(void);
+void FM_SetVoicePitch(uint8_t voice_num, uint8_t note);
 void FM_SetVoicePatch(uint8_t voice_num, voice_struct *vs, float32_t base_freq);
-void FM_Gate(uint16_t gate_word);
+void FM_LoadProgram(uint8_t voice_num, uint8_t prog);
+uint8_t FM_StoreProgram(uint8_t prog, voice_struct *vs);
+void FM_SetShadow(uint8_t enable);
+uint8_t FM_SetLayout(uint8_t ops_per_voice);
+void FM_SetMix(uint8_t shift, uint8_t i2s24);
+void FM_Commit(void);
+uint8_t FM_CommitPending(void);
+void FM_Gate(uint32_t gate_word);
+void FM_GateVoice(uint8_t voice_num, uint8_t on);
+void FM_SetNotePatch(voice_struct *vs);
+void FM_SetNoteProgram(uint8_t prog);
+uint8_t FM_GetNoteProgram(void);
+void FM_NoteReset(void);
+uint8_t FM_NoteOn(uint8_t note, uint8_t velocity);
+void FM_NoteOff(uint8_t note);
+uint8_t FM_GateParked(uint8_t v);
+void FM_NoteService(void);
+uint8_t FM_NotePatchBusy(void);
+void FM_SetBend(int16_t cents);
+void FM_SetTune(int16_t cents);
+int16_t FM_GetTune(void);
+void FM_GetSilent(uint32_t *bits);
+uint16_t FM_GetVoiceAtten(uint8_t voice_num);
 
 #endif
@@ -0,0 +1,12 @@
+/*
+ * arm_math.h - host build stand-in for the CMSIS DSP header
+ */
+
+#ifndef _ARM_MATH_H
+#define _ARM_MATH_H
+
+#include <math.h>
+
+typedef float float32_t;
+
+#endif
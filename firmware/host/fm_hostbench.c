@@ -0,0 +1,293 @@
+/*
+ * fm_hostbench.c - SPI cost of the FM API calls, measured on the host
+ *
+ * Runs the real fm.c, proto.c & cmd.c against the mock ice5 transport
+ * and reports for each call the SPI frames and bytes sent, how many
+ * writes the cache dropped, reads (which stall for the queue to drain)
+ * and the estimated bus time. -l lists the frames of each call. Flash
+ * bank stores report page erases & halfword writes instead.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "fm.h"
+#include "ice5.h"
+#include "proto.h"
+#include "bank.h"
+#include "cmd.h"
+#include "usart.h"
+#include "ice5_host.h"
+#include "host_hal.h"
+
+/* F303 datasheet maximum page erase & halfword program times */
+#define HOST_ERASE_MS 40.0
+#define HOST_PROG_MS 0.06
+
+int show_log, saved_stdout;
+uint32_t last_issued, last_elided;
+
+/*
+ * hide what the firmware prints while it runs
+ */
+static void quiet(int on)
+{
+	int fd;
+	
+	fflush(stdout);
+	if(on)
+	{
+		saved_stdout = dup(1);
+		fd = open("/dev/null", O_WRONLY);
+		dup2(fd, 1);
+		close(fd);
+	}
+	else
+	{
+		dup2(saved_stdout, 1);
+		close(saved_stdout);
+	}
+}
+
+/*
+ * print one row & start counting the next call
+ */
+static void report(const char *name)
+{
+	ice5_host_stats st;
+	uint32_t issued, elided;
+	
+	ICE5_Host_GetStats(&st);
+	ICE5_FPGA_Cache_Stats(&issued, &elided);
+	printf("%-26s %6u %7u %6u %5u %5u %5u %9.1f\n", name,
+		(unsigned)st.frames, (unsigned)st.bytes, (unsigned)(elided - last_elided),
+		(unsigned)st.reads, (unsigned)st.pmem, (unsigned)st.gates,
+		ICE5_Host_BusNs(&st) * 1e-3);
+	if(show_log)
+		ICE5_Host_Log(stdout);
+	
+	ICE5_Host_ClrStats();
+	last_issued = issued;
+	last_elided = elided;
+}
+
+/*
+ * flash work of a run of stores
+ */
+static void flash_report(const char *name, int stores)
+{
+	uint8_t stored;
+	uint16_t left;
+	uint32_t gen;
+	
+	BANK_Stats(&stored, &left, &gen);
+	printf("%-26s %6d stores %5u erases %6u writes, %u stored %u free %u compactions\n",
+		name, stores, (unsigned)host_flash_erases, (unsigned)host_flash_writes,
+		(unsigned)stored, (unsigned)left, (unsigned)gen);
+	host_flash_erases = host_flash_writes = 0;
+	ICE5_Host_ClrStats();
+}
+
+/*
+ * finish a throttled note patch load
+ */
+static void load_wait(void)
+{
+	while(FM_NotePatchBusy())
+		FM_NoteService();
+}
+
+/*
+ * feed a binary frame through the console as main() would
+ */
+static void send_frame(uint8_t cmd, const uint8_t *pl, uint32_t len)
+{
+	static uint8_t raw[PROTO_Max], enc[PROTO_Max + PROTO_Max/254 + 3];
+	uint16_t crc;
+	uint32_t n;
+	int ch;
+	
+	raw[0] = cmd;
+	raw[1] = 0;
+	memcpy(&raw[2], pl, len);
+	crc = PROTO_CRC(raw, len+2);
+	raw[len+2] = crc & 0xFF;
+	raw[len+3] = crc >> 8;
+	enc[0] = 0;
+	n = PROTO_Encode(&enc[1], raw, len+4) + 1;
+	enc[n++] = 0;
+	host_usart_feed(enc, n);
+	
+	while((ch = get_usart()) != EOF)
+		if(!PROTO_Byte(ch))
+			cmd_parse(ch);
+	n = host_usart_out(enc, sizeof(enc));
+	if((n < 4) || (enc[0] != 0))
+		printf("no reply to frame 0x%02X\n", cmd);
+}
+
+/*
+ * type a console command, after the pause that ends binary frames
+ */
+static void console(const char *line)
+{
+	int ch;
+	
+	usleep((PROTO_Idle + 1) * 1000);
+	PROTO_Service();
+	host_usart_feed((const uint8_t *)line, strlen(line));
+	host_usart_feed((const uint8_t *)"\r", 1);
+	while((ch = get_usart()) != EOF)
+		if(!PROTO_Byte(ch))
+			cmd_parse(ch);
+}
+
+int main(int argc, char **argv)
+{
+	static uint8_t bank[1 + FM_Num_Patches*sizeof(voice_struct)];
+	voice_struct vs;
+	uint32_t erases, writes;
+	double stall, worst = 0.0;
+	int opt, i;
+	
+	while((opt = getopt(argc, argv, "l")) != -1)
+	{
+		switch(opt)
+		{
+			case 'l': show_log = 1; break;
+			default:
+				fprintf(stderr, "usage: %s [-l]\n", argv[0]);
+				return 1;
+		}
+	}
+	
+	/* boot quietly */
+	setup_usart1();
+	quiet(1);
+	FM_Init();
+	init_cmd();
+	quiet(0);
+	
+	printf("%-26s %6s %7s %6s %5s %5s %5s %9s\n", "call", "frames", "bytes",
+		"elided", "reads", "pmem", "gates", "bus us");
+	report("FM_Init");
+	load_wait();
+	report("note patch load");
+	FM_SetNotePatch(FM_NotePatch);
+	load_wait();
+	report("note patch reload");
+	FM_SetNotePatch(&voices[1]);
+	load_wait();
+	report("note patch change");
+	
+	FM_SetVoicePatch(0, &voices[0], 440.0F);
+	report("FM_SetVoicePatch");
+	FM_SetVoicePatch(0, &voices[0], 440.0F);
+	report("FM_SetVoicePatch same");
+	FM_SetVoiceFreq(0, 220.0F);
+	report("FM_SetVoiceFreq");
+	FM_SetVoicePitch(0, 64);
+	report("FM_SetVoicePitch");
+	FM_Gate(1);
+	report("FM_Gate");
+	FM_GateVoice(40, 1);
+	report("FM_GateVoice");
+	FM_Gate(0);
+	FM_GateVoice(40, 0);
+	ICE5_Host_ClrStats();
+	
+	FM_NoteOn(60, 127);
+	report("FM_NoteOn");
+	FM_NoteOn(64, 80);
+	report("FM_NoteOn velocity");
+	FM_NoteOff(60);
+	report("FM_NoteOff");
+	FM_SetBend(100);
+	report("FM_SetBend 1 held");
+	for(i=0;i<8;i++)
+		FM_NoteOn(40+i, 100);
+	ICE5_Host_ClrStats();
+	FM_SetBend(0);
+	report("FM_SetBend 9 held");
+	FM_NoteReset();
+	report("FM_NoteReset");
+	
+	FM_SetLayout(4);
+	load_wait();
+	report("FM_SetLayout 4");
+	FM_SetLayout(8);
+	load_wait();
+	ICE5_Host_ClrStats();
+	
+	bank[0] = 0;
+	for(i=0;i<FM_Num_Patches;i++)
+		memcpy(&bank[1 + i*sizeof(voice_struct)], &voices[(i+1) & 1], sizeof(voice_struct));
+	send_frame(PROTO_Bank, bank, sizeof(bank));
+	report("bank upload");
+	load_wait();
+	report("bank upload patch load");
+	
+	quiet(1);
+	console("spistat");
+	quiet(0);
+	report("console spistat");
+	
+	/* flash bank - stores cost flash time, recalls only SPI */
+	vs = voices[1];
+	for(i=0;i<8;i++)
+		vs.ops[i].wave = 1;
+	host_flash_erases = host_flash_writes = 0;
+	FM_StoreProgram(5, &vs);
+	flash_report("FM_StoreProgram", 1);
+	FM_StoreProgram(5, &vs);
+	flash_report("FM_StoreProgram same", 1);
+	FM_LoadProgram(0, 5);
+	report("FM_LoadProgram");
+	FM_LoadProgram(0, 5);
+	report("FM_LoadProgram same");
+	FM_SetNoteProgram(5);
+	report("FM_SetNoteProgram");
+	load_wait();
+	report("note program load");
+	
+	/* program change under held notes - they wait for their note-off */
+	for(i=0;i<8;i++)
+		FM_NoteOn(48+i, 127);
+	ICE5_Host_ClrStats();
+	FM_SetNoteProgram(0);
+	load_wait();
+	report("program change 8 held");
+	for(i=0;i<8;i++)
+		FM_NoteOff(48+i);
+	load_wait();
+	report("8 released & reloaded");
+	
+	/* every program edited 4 times, then a reboot's rescan */
+	vs = voices[0];
+	for(i=0;i<4*BANK_Programs;i++)
+	{
+		vs.ops[1].atten = i;
+		erases = host_flash_erases;
+		writes = host_flash_writes;
+		FM_StoreProgram(i % BANK_Programs, &vs);
+		stall = (host_flash_erases - erases) * HOST_ERASE_MS +
+			(host_flash_writes - writes) * HOST_PROG_MS;
+		if(stall > worst)
+			worst = stall;
+	}
+	flash_report("FM_StoreProgram x512", 4*BANK_Programs);
+	printf("%-26s %6.1f ms at max flash timings, reply limit %d ms\n",
+		"longest store stall", worst, PROTO_Store_Ms);
+	BANK_Init();
+	flash_report("BANK_Init rescan", 0);
+	for(i=0;i<BANK_Programs;i++)
+	{
+		vs.ops[1].atten = 3*BANK_Programs + i;
+		if(!BANK_Get(i) || (BANK_Get(i)[1] != FM_PackOperator(&vs.ops[1])))
+			printf("program %d lost its last store\n", i);
+	}
+	
+	return 0;
+}
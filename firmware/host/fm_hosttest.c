@@ -0,0 +1,310 @@
+/*
+ * fm_hosttest.c - note allocator & console checks on the host
+ *
+ * Runs the real fm.c against the mock ice5 transport with a cycle counter
+ * the test steps by hand, so long idle times and the 32-bit CYCCNT wrap
+ * can be checked without waiting for them. Also checks that note patch
+ * changes leave held notes alone, that no gate goes live before the bank
+ * swap that brings in its voice's pmem, that binary frames can share
+ * their delimiters and that the console rings wrap and count drops.
+ * Prints each failed check and exits non-zero if there were any.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "fm.h"
+#include "ice5.h"
+#include "usart.h"
+#include "usart_ring.h"
+#include "proto.h"
+#include "ice5_host.h"
+#include "host_hal.h"
+
+uint32_t test_now;
+int fails;
+
+static uint32_t test_cycles(void)
+{
+	return test_now;
+}
+
+/*
+ * one check
+ */
+static void expect(int ok, const char *what)
+{
+	if(!ok)
+	{
+		printf("FAIL: %s\n", what);
+		fails++;
+	}
+}
+
+/*
+ * gate bit of a voice as fm_gen would see it
+ */
+static int gated(uint8_t v)
+{
+	static const uint8_t reg[4] = {0x03, 0x14, 0x15, 0x16};
+	
+	return (ICE5_Host_Reg(reg[v>>5]) >> (v&31)) & 1;
+}
+
+/*
+ * check a voice's pmem holds a patch at full velocity
+ */
+static int has_patch(uint8_t v, voice_struct *vs)
+{
+	uint8_t i, ops = FM_Layout->ops;
+	
+	for(i=0;i<ops;i++)
+		if(ICE5_Host_Pmem(ops*v+i) != FM_PackOperator(&vs->ops[i]))
+			return 0;
+	return 1;
+}
+
+/*
+ * COBS encoded ping with its CRC, no delimiters - returns the length
+ */
+static uint32_t ping(uint8_t *enc, uint8_t seq)
+{
+	uint8_t raw[4];
+	uint16_t crc;
+	
+	raw[0] = PROTO_Ping;
+	raw[1] = seq;
+	crc = PROTO_CRC(raw, 2);
+	raw[2] = crc & 0xFF;
+	raw[3] = crc >> 8;
+	return PROTO_Encode(enc, raw, 4);
+}
+
+/*
+ * feed console bytes as main() does - returns how many went to frames
+ */
+static int feed(const uint8_t *data, uint32_t len)
+{
+	int ch, n = 0;
+	
+	host_usart_feed(data, len);
+	while((ch = get_usart()) != EOF)
+		n += PROTO_Byte(ch);
+	return n;
+}
+
+/*
+ * hold notes on all voices but one so the next note-on reuses it
+ */
+static void hold_others(uint8_t on)
+{
+	uint8_t n;
+	
+	for(n=0;n<FM_Layout->voices-1;n++)
+		if(on)
+			FM_NoteOn(n, 100);
+		else
+			FM_NoteOff(n);
+}
+
+/*
+ * let fm_gen swap in any commits & FM_NoteService() gate what waited
+ */
+static void settle(void)
+{
+	test_now += 2*(SystemCoreClock / 46875);
+	FM_NoteService();
+}
+
+/*
+ * release a note, wait, then play it again on the same voice - returns
+ * the voice's gate straight after the note-on
+ */
+static int retrigger(uint8_t note, uint32_t wait)
+{
+	uint8_t v;
+	
+	v = FM_NoteOn(note, 100);
+	FM_NoteOff(note);
+	test_now += wait;
+	FM_NoteService();
+	if(FM_NoteOn(note, 100) != v)
+		printf("note %u moved voice\n", note);
+	return gated(v);
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t retrig = 2*(SystemCoreClock / 46875);
+	uint8_t buf[64], v, i, n;
+	static uint8_t line[RX_SZ + TX_SZ];
+	uint32_t len, sbits[4], j;
+	ice5_host_stats st;
+	int fd, out;
+	
+	host_cycles = test_cycles;
+	test_now = 0xFFFFF000;
+	
+	/* boot quietly */
+	fflush(stdout);
+	out = dup(1);
+	fd = open("/dev/null", O_WRONLY);
+	dup2(fd, 1);
+	close(fd);
+	setup_usart1();
+	FM_Init();
+	while(FM_NotePatchBusy())
+		FM_NoteService();
+	settle();
+	fflush(stdout);
+	dup2(out, 1);
+	close(out);
+	
+	/* a fresh voice with its pmem as loaded gates at once */
+	v = FM_NoteOn(60, 127);
+	expect(gated(v), "note-on after reset");
+	FM_NoteOff(60);
+	expect(!gated(v), "note-off");
+	
+	/* a new velocity waits for the bank swap */
+	test_now += retrig;
+	v = FM_NoteOn(60, 100);
+	expect(!gated(v), "note-on waits for its commit");
+	settle();
+	expect(gated(v), "note-on gated after the swap");
+	FM_NoteOff(60);
+	
+	/* too soon is parked until fm_gen has seen the gate low */
+	hold_others(1);
+	expect(!retrigger(60, 10), "quick retrigger parked");
+	test_now += retrig;
+	FM_NoteService();
+	expect(gated(v), "parked retrigger gated by service");
+	FM_NoteOff(60);
+	
+	/* across the CYCCNT wrap */
+	test_now = 0xFFFFFFF0;
+	expect(retrigger(61, retrig + 100), "retrigger across the wrap");
+	FM_NoteOff(61);
+	
+	/* idle for 2^31 cycles & more */
+	expect(retrigger(62, 0x80000000), "retrigger after 2^31 cycles idle");
+	FM_NoteOff(62);
+	expect(retrigger(63, 0xC0000000), "retrigger after 3*2^30 cycles idle");
+	FM_NoteOff(63);
+	hold_others(0);
+	
+	/* a voice left alone since reset */
+	FM_NoteReset();
+	test_now += 0x90000000;
+	expect(gated(FM_NoteOn(64, 100)), "note-on 2^31 cycles after reset");
+	FM_NoteReset();
+	
+	/* the quietest voice comes from the last service read, once */
+	ICE5_Host_SetReg(FM_Reg_QuietRel, FM_Quiet_Valid | (5<<16));
+	test_now += SystemCoreClock / 1000;
+	FM_NoteService();
+	ICE5_Host_GetStats(&st);
+	n = st.reads;
+	expect(FM_NoteOn(60, 100) == 5, "note-on takes the quietest voice");
+	expect(FM_NoteOn(61, 100) != 5, "quietest voice taken once");
+	ICE5_Host_GetStats(&st);
+	expect(st.reads == n, "note-on reads nothing");
+	ICE5_Host_SetReg(FM_Reg_QuietRel, 0);
+	FM_NoteReset();
+	
+	/* voices past the layout read silent whatever fm_gen has left */
+	FM_SetLayout(6);
+	for(i=0;i<4;i++)
+		ICE5_Host_SetReg(FM_Reg_Silent+i, 0);
+	FM_GetSilent(sbits);
+	expect((sbits[0] == 0) && (sbits[1] == 0xFFFFFC00) &&
+		(sbits[2] == 0xFFFFFFFF) && (sbits[3] == 0xFFFFFFFF),
+		"silent bits past the layout");
+	FM_SetLayout(8);
+	while(FM_NotePatchBusy())
+		FM_NoteService();
+	settle();
+	
+	/* a patch change leaves held notes sounding the old patch */
+	v = FM_NoteOn(60, 127);
+	settle();
+	expect(has_patch(v, &voices[0]), "first patch loaded");
+	FM_SetNotePatch(&voices[1]);
+	expect(gated(v), "held note kept through patch change");
+	expect(has_patch(v, &voices[0]), "held voice not reloaded");
+	
+	/* a stale voice is loaded in full by its note-on & gated once it is in */
+	i = FM_NoteOn(61, 127);
+	expect(!gated(i), "stale voice waits for its commit");
+	settle();
+	expect(gated(i) && has_patch(i, &voices[1]), "note-on loads a stale voice");
+	
+	/* the loader does idle voices, then held ones after their note-off */
+	while(FM_NotePatchBusy())
+		FM_NoteService();
+	settle();
+	for(i=n=0;i<FM_Layout->voices;i++)
+		if((i != v) && !has_patch(i, &voices[1]))
+			n++;
+	expect(!n, "idle voices loaded");
+	expect(has_patch(v, &voices[0]), "held voice still not reloaded");
+	FM_NoteOff(60);
+	expect(FM_NotePatchBusy(), "released voice queued for loading");
+	while(FM_NotePatchBusy())
+		FM_NoteService();
+	settle();
+	expect(has_patch(v, &voices[1]), "released voice reloaded");
+	FM_NoteOff(61);
+	
+	/* and none of the above went live on old pmem */
+	ICE5_Host_GetStats(&st);
+	expect(!st.early, "no gate before its pmem swapped in");
+	
+	/* 00 A 00 B 00 - both frames answered */
+	buf[0] = 0;
+	len = 1 + ping(&buf[1], 1);
+	buf[len++] = 0;
+	len += ping(&buf[len], 2);
+	buf[len++] = 0;
+	feed(buf, len);
+	len = host_usart_out(buf, sizeof(buf));
+	for(i=n=0;i<len;i++)
+		n += !buf[i];
+	expect(n == 4, "frames sharing a delimiter both answered");
+	
+	/* text goes to the console only once the line has been quiet */
+	expect(feed((const uint8_t *)"x", 1) == 1, "byte after a frame is frame data");
+	feed((const uint8_t *)"", 1);
+	test_now += PROTO_Idle*(SystemCoreClock/1000);
+	PROTO_Service();
+	expect(feed((const uint8_t *)"x", 1) == 0, "text after a pause");
+	
+	/* console TX ring - a held line fills it, the overflow is dropped &
+	   counted, and what fitted comes out in order across the wrap */
+	for(j=0;j<100;j++)
+		outbyte(j);
+	host_usart_out(line, sizeof(line));
+	usart_tx_dropped(1);
+	host_usart_hold(1);
+	for(j=0;j<TX_SZ+10;j++)
+		outbyte(j % 251);
+	expect(usart_tx_dropped(1) == 10, "full TX ring drops & counts");
+	host_usart_hold(0);
+	len = host_usart_out(line, sizeof(line));
+	for(j=n=0;j<len;j++)
+		n |= line[j] != j % 251;
+	expect((len == TX_SZ) && !n, "TX ring wraps in order");
+	
+	/* console RX ring wraps in order */
+	for(j=0;j<sizeof(line);j++)
+		line[j] = j % 251;
+	host_usart_feed(line, sizeof(line));
+	for(j=n=0;(out = get_usart()) != EOF;j++)
+		n |= out != j % 251;
+	expect((j == sizeof(line)) && !n, "RX ring wraps in order");
+	
+	printf("%s\n", fails ? "fm_hosttest failed" : "fm_hosttest passed");
+	return fails != 0;
+}
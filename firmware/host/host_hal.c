@@ -0,0 +1,247 @@
+/*
+ * host_hal.c - host build stand-ins for the board support code
+ *
+ * Cycle counter & delays off the host clock, or off a simulation's clock
+ * through host_cycles, the console UART transport for usart_ring.c, the
+ * patch bank flash as a RAM array and an empty bitstream. MIDI input is
+ * not part of the host build so its console hooks are stubs.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "stm32f30x.h"
+#include "cyclesleep.h"
+#include "usart.h"
+#include "usart_ring.h"
+#include "midi.h"
+#include "bank.h"
+#include "host_hal.h"
+
+#define HOST_RX_SZ 65536
+#define HOST_TX_SZ 4096
+
+uint32_t SystemCoreClock = 72000000;
+DWT_Type host_dwt_regs;
+uint32_t act_cyc, tot_cyc, s_tot;
+uint32_t (*host_cycles)(void);
+
+/* console line - host_rx waits to go into the RX ring, TX runs land in
+   host_tx unless the line is held */
+uint8_t host_rx[HOST_RX_SZ], host_tx[HOST_TX_SZ];
+uint32_t host_rx_wr, host_rx_rd, host_rx_dma, host_tx_n;
+const uint8_t *host_run;
+uint32_t host_run_len;
+uint8_t host_tx_hold;
+
+uint8_t _binary_bitmap_rle_start, _binary_bitmap_rle_end;
+
+/* patch bank flash - starts zeroed rather than erased, like a used chip */
+uint8_t _bank_start[BANK_Size] __attribute__((aligned(BANK_Page)));
+uint32_t host_flash_erases, host_flash_writes;
+
+uint8_t MIDI_Channel = MIDI_Omni;
+
+/*
+ * DWT->CYCCNT - host time in target cycles
+ */
+DWT_Type *host_dwt(void)
+{
+	struct timespec ts;
+	
+	if(host_cycles)
+	{
+		host_dwt_regs.CYCCNT = host_cycles();
+		return &host_dwt_regs;
+	}
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	host_dwt_regs.CYCCNT = (uint32_t)((uint64_t)ts.tv_sec * SystemCoreClock +
+		(uint64_t)ts.tv_nsec * (SystemCoreClock / 1000000) / 1000);
+	return &host_dwt_regs;
+}
+
+void cyccnt_enable(void)
+{
+}
+
+uint32_t cyclegoal(uint32_t cycles)
+{
+	return cycles + DWT->CYCCNT;
+}
+
+uint32_t cyclegoal_ms(uint32_t ms)
+{
+	return ms*(SystemCoreClock/1000) + DWT->CYCCNT;
+}
+
+uint32_t cyclecheck(uint32_t goal)
+{
+	return (((int32_t)DWT->CYCCNT - (int32_t)goal) < 0);
+}
+
+void cyclesleep(uint32_t cycles)
+{
+	uint32_t goal = cyclegoal(cycles);
+	
+	while(cyclecheck(goal));
+}
+
+void delay(uint32_t ms)
+{
+	cyclesleep(ms*(SystemCoreClock/1000));
+}
+
+void start_meas(void)
+{
+	s_tot = DWT->CYCCNT;
+}
+
+void end_meas(void)
+{
+	act_cyc = DWT->CYCCNT - s_tot;
+	tot_cyc = act_cyc;
+}
+
+void get_meas(uint32_t *act, uint32_t *tot)
+{
+	*act = act_cyc;
+	*tot = tot_cyc;
+}
+
+/*
+ * console - the RX ring gets what host_usart_feed() queued, TX runs are
+ * collected for host_usart_out()
+ */
+void setup_usart1(void)
+{
+	host_rx_wr = host_rx_rd = host_rx_dma = host_tx_n = 0;
+	host_run_len = 0;
+	host_tx_hold = 0;
+	usart_ring_init();
+}
+
+/*
+ * RX write index - the line keeps pace with the reader here, so fed
+ * bytes move into the ring as it has room and none are overrun
+ */
+uint32_t usart_rx_wptr(void)
+{
+	while((host_rx_rd != host_rx_wr) && ((host_rx_dma + 1) % RX_SZ != RX_rptr))
+	{
+		RX_buffer[host_rx_dma] = host_rx[host_rx_rd++ % HOST_RX_SZ];
+		host_rx_dma = (host_rx_dma + 1) % RX_SZ;
+	}
+	return host_rx_dma;
+}
+
+void usart_tx_start(const uint8_t *buf, uint32_t len)
+{
+	host_run = buf;
+	host_run_len = len;
+}
+
+/*
+ * interrupts unmasked - a TX run goes out at once unless the line is
+ * held, so outbyte() must not block while it is
+ */
+void host_irq(void)
+{
+	uint32_t n;
+	
+	while(!host_tx_hold && host_run_len)
+	{
+		n = HOST_TX_SZ - host_tx_n;
+		if(n > host_run_len)
+			n = host_run_len;
+		memcpy(&host_tx[host_tx_n], host_run, n);
+		host_tx_n += n;
+		host_run_len = 0;
+		usart_tx_done();
+	}
+}
+
+/*
+ * stop (1) or restart (0) the console TX line
+ */
+void host_usart_hold(uint8_t hold)
+{
+	host_tx_hold = hold;
+	host_irq();
+}
+
+void host_usart_feed(const uint8_t *data, uint32_t len)
+{
+	while(len--)
+		host_rx[host_rx_wr++ % HOST_RX_SZ] = *data++;
+}
+
+uint32_t host_usart_out(uint8_t *data, uint32_t max)
+{
+	uint32_t n = host_tx_n < max ? host_tx_n : max;
+	
+	memcpy(data, host_tx, n);
+	host_tx_n = 0;
+	return n;
+}
+
+/*
+ * flash driver on _bank_start - programming only clears bits, except
+ * that 0x0000 may go over anything, as on the STM32
+ */
+static uint8_t *host_flash(uint32_t addr, uint32_t len)
+{
+	uint32_t off = addr - (uint32_t)(uintptr_t)_bank_start;
+	
+	return (off <= BANK_Size - len) ? &_bank_start[off] : NULL;
+}
+
+void FLASH_Unlock(void)
+{
+}
+
+void FLASH_Lock(void)
+{
+}
+
+void FLASH_ClearFlag(uint32_t FLASH_FLAG)
+{
+}
+
+FLASH_Status FLASH_ErasePage(uint32_t Page_Address)
+{
+	uint8_t *p = host_flash(Page_Address, BANK_Page);
+	
+	if(!p || (Page_Address % BANK_Page))
+		return FLASH_ERROR_WRP;
+	memset(p, 0xFF, BANK_Page);
+	host_flash_erases++;
+	return FLASH_COMPLETE;
+}
+
+FLASH_Status FLASH_ProgramHalfWord(uint32_t Address, uint16_t Data)
+{
+	uint8_t *p = host_flash(Address, 2);
+	
+	if(!p || (Address & 1))
+		return FLASH_ERROR_WRP;
+	if(Data && ((p[0] != 0xFF) || (p[1] != 0xFF)))
+		return FLASH_ERROR_PROGRAM;
+	p[0] = Data & 0xFF;
+	p[1] = Data >> 8;
+	host_flash_writes++;
+	return FLASH_COMPLETE;
+}
+
+/*
+ * MIDI stubs for the console
+ */
+void MIDI_GetStats(midi_stats *st)
+{
+	memset(st, 0, sizeof(*st));
+}
+
+void MIDI_ClrStats(void)
+{
+}
@@ -0,0 +1,21 @@
+/*
+ * host_hal.h - host build stand-ins for the board support code
+ */
+
+#ifndef __HOST_HAL__
+#define __HOST_HAL__
+
+#include <stdint.h>
+
+/* target cycle count for DWT->CYCCNT, NULL for the host clock */
+extern uint32_t (*host_cycles)(void);
+
+/* patch bank flash page erases & halfword writes */
+extern uint32_t host_flash_erases, host_flash_writes;
+
+void host_irq(void);
+void host_usart_feed(const uint8_t *data, uint32_t len);
+void host_usart_hold(uint8_t hold);
+uint32_t host_usart_out(uint8_t *data, uint32_t max);
+
+#endif
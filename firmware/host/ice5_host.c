@@ -0,0 +1,294 @@
+/*
+ * ice5_host.c - mock ice5 transport for the host build
+ *
+ * Replaces ice5.c. The async queue & write cache in ice5_queue.c are the
+ * real ones - ICE5_Queue_Kick() here sends every queued frame at once
+ * into the model, so the queue is always empty when it returns.
+ *
+ * pmem has fm_gen's two banks. Shadowed writes go to the idle bank and a
+ * commit swaps them on a sample edge, a sample being 1/46875 s of
+ * DWT->CYCCNT, once a sample has passed since the last swap. A gate
+ * raised on a voice with shadowed writes not yet swapped in is counted
+ * as early.
+ */
+
+#include <string.h>
+#include "stm32f30x.h"
+#include "ice5.h"
+#include "ice5_queue.h"
+#include "ice5_host.h"
+
+#define HOST_ID 0x13370009
+#define HOST_LOG_SZ 64		/* frames kept for ICE5_Host_Log, power of 2 */
+
+#define HOST_FSAMPLE 46875
+
+/* model fm_gen state */
+uint32_t host_regs[128];
+uint64_t host_pmem[2][256];
+uint8_t host_pdirty[256];			/* shadow op newer than active */
+uint8_t host_abank, host_cmt_pend, host_rs_arm, host_rs_done;
+uint32_t host_cyc;					/* CYCCNT at the last step */
+uint64_t host_frac;					/* cycles since the last sample edge */
+
+/* stats & recent frames */
+ice5_host_stats host_stats;
+struct
+{
+	uint8_t reg;
+	uint8_t count;
+	uint8_t read;
+	uint32_t data;
+} host_log[HOST_LOG_SZ];
+uint32_t host_log_n;
+
+/*
+ * bring the bank swap up to DWT->CYCCNT - more than 3 sample edges all
+ * end the same way
+ */
+static void ICE5_Host_Step(void)
+{
+	uint32_t now = DWT->CYCCNT, smpl = SystemCoreClock / HOST_FSAMPLE;
+	uint64_t n;
+	
+	host_frac += now - host_cyc;
+	host_cyc = now;
+	n = host_frac / smpl;
+	host_frac %= smpl;
+	for(n=n>3?3:n;n;n--)
+	{
+		if(host_cmt_pend && host_rs_done)
+		{
+			host_abank ^= 1;
+			memcpy(host_pmem[host_abank^1], host_pmem[host_abank], sizeof(host_pmem[0]));
+			memset(host_pdirty, 0, sizeof(host_pdirty));
+			host_cmt_pend = 0;
+			host_rs_arm = 1;
+			host_rs_done = 0;
+		}
+		else
+		{
+			host_rs_done = host_rs_arm;
+			host_rs_arm = 1;
+		}
+	}
+}
+
+/*
+ * count gates raised on voices with writes still in the shadow bank
+ */
+static void ICE5_Host_Gate(uint8_t Word, uint32_t Old, uint32_t New)
+{
+	static const uint8_t ops[4] = {8, 6, 4, 2};
+	uint8_t n = ops[(host_regs[0x0D]>>1) & 3], i;
+	uint32_t up = New & ~Old, v;
+	
+	for(v=0;v<32;v++)
+		if(up & (1UL<<v))
+			for(i=0;i<n;i++)
+				if(host_pdirty[(n*(32*Word+v)+i) & 0xFF])
+				{
+					host_stats.early++;
+					break;
+				}
+	host_stats.gates++;
+}
+
+/*
+ * one SPI frame - a write burst of count words from reg, or a read
+ */
+static void ICE5_Host_Frame(uint8_t Reg, const uint32_t *Data, uint32_t Count, uint8_t Read)
+{
+	uint32_t i, l = host_log_n++ & (HOST_LOG_SZ-1), old;
+	uint8_t r, a;
+	
+	ICE5_Host_Step();
+	host_log[l].reg = Reg;
+	host_log[l].count = Count;
+	host_log[l].read = Read;
+	host_log[l].data = Count ? Data[0] : 0;
+	host_stats.frames++;
+	host_stats.bytes += 1 + 4*Count;
+	if(Read)
+	{
+		host_stats.reads++;
+		return;
+	}
+	
+	for(i=0;i<Count;i++)
+	{
+		r = (Reg + i) & 0x7F;
+		old = host_regs[r];
+		host_regs[r] = Data[i];
+		
+		/* strobes & counted registers */
+		if(r == 0x12)
+		{
+			a = Data[i] & 0xFF;
+			if(host_regs[0x0D] & 1)
+			{
+				host_pmem[host_abank^1][a] = ((uint64_t)host_regs[0x11] << 32) | host_regs[0x10];
+				host_pdirty[a] = 1;
+			}
+			else
+				host_pmem[host_abank][a] = ((uint64_t)host_regs[0x11] << 32) | host_regs[0x10];
+			host_stats.pmem++;
+		}
+		else if(r == 0x03)
+			ICE5_Host_Gate(0, old, Data[i]);
+		else if((r >= 0x14) && (r <= 0x16))
+			ICE5_Host_Gate(r - 0x13, old, Data[i]);
+		else if((r == 0x0C) && (Data[i] & 4))
+		{
+			if(host_regs[0x0D] & 1)
+				host_cmt_pend = 1;
+			host_stats.commits++;
+		}
+	}
+}
+
+void ICE5_Init(void)
+{
+	ICE5_Queue_Init();
+	memset(host_regs, 0, sizeof(host_regs));
+	memset(host_pmem, 0, sizeof(host_pmem));
+	memset(host_pdirty, 0, sizeof(host_pdirty));
+	host_abank = host_cmt_pend = 0;
+	
+	/* configuring takes far longer than fm_gen's first resync pass */
+	host_rs_arm = host_rs_done = 1;
+	host_cyc = DWT->CYCCNT;
+	host_frac = 0;
+	ICE5_Host_ClrStats();
+}
+
+uint8_t ICE5_FPGA_Config(uint8_t *bitmap, uint32_t size)
+{
+	ICE5_FPGA_Cache_Invalidate();
+	return 0;
+}
+
+uint8_t ICE5_FPGA_ConfigRLE(uint8_t *rle, uint32_t size)
+{
+	ICE5_FPGA_Cache_Invalidate();
+	return 0;
+}
+
+/* no bitstream in the host build */
+uint32_t ICE5_RLE_Size(uint8_t *rle)
+{
+	return 0;
+}
+
+/*
+ * send everything queued
+ */
+void ICE5_Queue_Kick(void)
+{
+	uint32_t hdr, cnt, i, data[ICE5_BURST_MAX];
+	
+	while(ICE5_q_rptr != ICE5_q_wptr)
+	{
+		hdr = ICE5_queue[ICE5_q_rptr++ & ICE5_QUEUE_MSK];
+		cnt = hdr >> 8;
+		for(i=0;i<cnt;i++)
+			data[i] = ICE5_queue[ICE5_q_rptr++ & ICE5_QUEUE_MSK];
+		ICE5_Host_Frame(hdr & 0x7F, data, cnt, 0);
+		ICE5_q_byt_done += 1 + 4*cnt;
+		ICE5_q_frm_done++;
+	}
+}
+
+void ICE5_FPGA_Slave_Write(uint8_t Reg, uint32_t Data)
+{
+	if(ICE5_Cache_Filter(Reg, &Data, 1))
+		return;
+	
+	ICE5_FPGA_Slave_Flush();
+	ICE5_Host_Frame(Reg & 0x7F, &Data, 1, 0);
+}
+
+void ICE5_FPGA_Slave_WriteBurst(uint8_t Reg, const uint32_t *Data, uint32_t Count)
+{
+	if(ICE5_Cache_Filter(Reg, Data, Count))
+		return;
+	
+	ICE5_FPGA_Slave_Flush();
+	ICE5_Host_Frame(Reg & 0x7F, Data, Count, 0);
+}
+
+void ICE5_FPGA_Slave_Read(uint8_t Reg, uint32_t *Data)
+{
+	ICE5_FPGA_Slave_Flush();
+	ICE5_Host_Step();
+	
+	Reg &= 0x7F;
+	*Data = Reg ? host_regs[Reg] : HOST_ID;
+	if(Reg == 0x0C)
+		*Data = (host_abank<<1) | host_cmt_pend;
+	
+	ICE5_Host_Frame(Reg, Data, 1, 1);
+}
+
+/*
+ * transport stats
+ */
+void ICE5_Host_GetStats(ice5_host_stats *st)
+{
+	*st = host_stats;
+}
+
+void ICE5_Host_ClrStats(void)
+{
+	memset(&host_stats, 0, sizeof(host_stats));
+	host_log_n = 0;
+}
+
+/*
+ * estimated time on the bus
+ */
+uint32_t ICE5_Host_BusNs(const ice5_host_stats *st)
+{
+	return (uint32_t)((uint64_t)st->bytes * 8 * 1000000000 / ICE5_HOST_SCK) +
+		st->frames * ICE5_HOST_FRAME_NS;
+}
+
+/*
+ * model state - pmem as the scan reads it
+ */
+uint32_t ICE5_Host_Reg(uint8_t Reg)
+{
+	return host_regs[Reg & 0x7F];
+}
+
+/* registers fm_gen drives */
+void ICE5_Host_SetReg(uint8_t Reg, uint32_t Data)
+{
+	host_regs[Reg & 0x7F] = Data;
+}
+
+uint64_t ICE5_Host_Pmem(uint8_t Addr)
+{
+	ICE5_Host_Step();
+	return host_pmem[host_abank][Addr];
+}
+
+/*
+ * print the most recent frames since the stats were cleared, oldest first
+ */
+void ICE5_Host_Log(FILE *f)
+{
+	uint32_t i, l, n = host_log_n < HOST_LOG_SZ ? host_log_n : HOST_LOG_SZ;
+	
+	for(i=host_log_n-n;i!=host_log_n;i++)
+	{
+		l = i & (HOST_LOG_SZ-1);
+		if(host_log[l].read)
+			fprintf(f, "  rd 0x%02X -> 0x%08X\n", host_log[l].reg,
+				(unsigned)host_log[l].data);
+		else
+			fprintf(f, "  wr 0x%02X x%d 0x%08X%s\n", host_log[l].reg,
+				host_log[l].count, (unsigned)host_log[l].data,
+				host_log[l].count > 1 ? " ..." : "");
+	}
+}
@@ -0,0 +1,38 @@
+/*
+ * ice5_host.h - mock ice5 transport for the host build
+ *
+ * Frames that would go out on SPI land in an in-memory model of the
+ * fm_gen register file and both pmem banks and are counted. Bus time is estimated
+ * from the byte count at the firmware's 9MHz SCK plus a fixed cost per
+ * frame for CS, DMA setup and the completion interrupt.
+ */
+
+#ifndef __ICE5_HOST__
+#define __ICE5_HOST__
+
+#include <stdio.h>
+#include "ice5.h"
+
+#define ICE5_HOST_SCK 9000000		/* 72MHz / 8 */
+#define ICE5_HOST_FRAME_NS 1500		/* per frame overhead */
+
+typedef struct
+{
+	uint32_t frames;		/* CS low to CS high */
+	uint32_t bytes;
+	uint32_t reads;
+	uint32_t pmem;			/* pmem words strobed */
+	uint32_t gates;			/* gate register writes */
+	uint32_t early;			/* gates raised before their pmem swapped in */
+	uint32_t commits;
+} ice5_host_stats;
+
+void ICE5_Host_GetStats(ice5_host_stats *st);
+void ICE5_Host_ClrStats(void);
+uint32_t ICE5_Host_BusNs(const ice5_host_stats *st);
+uint32_t ICE5_Host_Reg(uint8_t Reg);
+void ICE5_Host_SetReg(uint8_t Reg, uint32_t Data);
+uint64_t ICE5_Host_Pmem(uint8_t Addr);
+void ICE5_Host_Log(FILE *f);
+
+#endif
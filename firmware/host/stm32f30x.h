@@ -0,0 +1,59 @@
+/*
+ * stm32f30x.h - host build stand-in for the CMSIS device header
+ *
+ * Just enough of the core for the hardware independent firmware to
+ * build on Linux. DWT->CYCCNT counts at SystemCoreClock off the host's
+ * monotonic clock. The flash driver calls work on a RAM copy of the
+ * patch bank region.
+ */
+
+#ifndef __STM32F30x_H
+#define __STM32F30x_H
+
+#include <stdint.h>
+
+#define __IO volatile
+
+typedef enum {RESET = 0, SET = !RESET} FlagStatus, ITStatus;
+typedef enum {DISABLE = 0, ENABLE = !DISABLE} FunctionalState;
+
+typedef struct
+{
+	uint32_t CTRL;
+	uint32_t CYCCNT;
+} DWT_Type;
+
+extern uint32_t SystemCoreClock;
+DWT_Type *host_dwt(void);
+#define DWT (host_dwt())
+
+/* flash driver - host_hal.c */
+typedef enum
+{
+	FLASH_BUSY = 1,
+	FLASH_ERROR_WRP,
+	FLASH_ERROR_PROGRAM,
+	FLASH_COMPLETE,
+	FLASH_TIMEOUT
+} FLASH_Status;
+
+#define FLASH_FLAG_EOP 0x20
+#define FLASH_FLAG_PGERR 0x04
+#define FLASH_FLAG_WRPERR 0x10
+
+void FLASH_Unlock(void);
+void FLASH_Lock(void);
+void FLASH_ClearFlag(uint32_t FLASH_FLAG);
+FLASH_Status FLASH_ErasePage(uint32_t Page_Address);
+FLASH_Status FLASH_ProgramHalfWord(uint32_t Address, uint16_t Data);
+
+/* single threaded - barriers do nothing and unmasking interrupts runs
+   whatever host_irq() models as pending */
+void host_irq(void);
+#define __DMB() do {} while(0)
+#define __disable_irq() do {} while(0)
+#define __enable_irq() host_irq()
+#define __get_PRIMASK() 0
+#define __set_PRIMASK(x) do { if(!(x)) host_irq(); } while(0)
+
+#endif
@@ -4,7 +4,9 @@
  */
  
 #include "ice5.h"
+#include "ice5_queue.h"
 #include "cyclesleep.h"
+#include <string.h>
 
 /**
   * @brief  SPI Interface pins
@@ -48,10 +50,36 @@
 #define ICE5_CDONE_GET()        GPIO_ReadInputDataBit(ICE5_CDONE_GPIO_PORT, ICE5_CDONE_PIN)
 #define ICE5_SPI_DUMMY_BYTE     0xFF
 
+/* SPI1 is on 72MHz APB2 - /8 for slave regs, /4 (18MHz) is the fastest
+   that meets the 25MHz max of iCE40 slave configuration */
+#define ICE5_SPI_PRESC_REG      SPI_BaudRatePrescaler_8
+#define ICE5_SPI_PRESC_CFG      SPI_BaudRatePrescaler_4
+
+/**
+  * @brief  SPI DMA channels
+  */
+#define ICE5_DMA_CLK            RCC_AHBPeriph_DMA1
+#define ICE5_DMA_RX_CHL         DMA1_Channel2
+#define ICE5_DMA_RX_IRQn        DMA1_Channel2_IRQn
+#define ICE5_DMA_RX_IT_TC       DMA1_IT_TC2
+#define ICE5_DMA_RX_IT_GL       DMA1_IT_GL2
+#define ICE5_DMA_TX_CHL         DMA1_Channel3
+#define ICE5_DMA_TX_IT_GL       DMA1_IT_GL3
+#define ICE5_DMA_TX_FLAG_TC     DMA1_FLAG_TC3
+#define ICE5_DMA_TX_FLAG_GL     DMA1_FLAG_GL3
+
+/* queued frame staging buffer for the TX DMA */
+#define ICE5_FRAME_MAX          (1+4*ICE5_BURST_MAX)
+
+uint8_t ICE5_q_txbuf[ICE5_FRAME_MAX], ICE5_q_rxbuf;
+uint8_t ICE5_q_txlen;
+
 void ICE5_Init(void)
 {
 	GPIO_InitTypeDef  GPIO_InitStructure;
 	SPI_InitTypeDef   SPI_InitStructure;
+	DMA_InitTypeDef   DMA_InitStructure;
+	NVIC_InitTypeDef  NVIC_InitStructure;
 
 	/* GPIO Periph clock enables */
 	RCC_AHBPeriphClockCmd(ICE5_CDONE_GPIO_CLK | 
@@ -119,7 +147,7 @@ void ICE5_Init(void)
 	SPI_InitStructure.SPI_CPHA = SPI_CPHA_1Edge;
 #endif
 	SPI_InitStructure.SPI_NSS = SPI_NSS_Soft;
-	SPI_InitStructure.SPI_BaudRatePrescaler = SPI_BaudRatePrescaler_8;
+	SPI_InitStructure.SPI_BaudRatePrescaler = ICE5_SPI_PRESC_REG;
 
 	SPI_InitStructure.SPI_FirstBit = SPI_FirstBit_MSB;
 	SPI_InitStructure.SPI_CRCPolynomial = 7;
@@ -128,6 +156,43 @@ void ICE5_Init(void)
 	SPI_RxFIFOThresholdConfig(ICE5_SPI, SPI_RxFIFOThreshold_QF);
 
 	SPI_Cmd(ICE5_SPI, ENABLE); /* ICE5_SPI enable */
+	
+	/* init async write queue */
+	ICE5_Queue_Init();
+	
+	/* DMA Periph clock enable */
+	RCC_AHBPeriphClockCmd(ICE5_DMA_CLK, ENABLE);
+	
+	/* TX DMA - staging buffer -> SPI, length set per frame */
+	DMA_DeInit(ICE5_DMA_TX_CHL);
+	DMA_InitStructure.DMA_PeripheralBaseAddr = (uint32_t)&ICE5_SPI->DR;
+	DMA_InitStructure.DMA_MemoryBaseAddr = (uint32_t)ICE5_q_txbuf;
+	DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralDST;
+	DMA_InitStructure.DMA_BufferSize = 0;
+	DMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+	DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
+	DMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
+	DMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_Byte;
+	DMA_InitStructure.DMA_Mode = DMA_Mode_Normal;
+	DMA_InitStructure.DMA_Priority = DMA_Priority_High;
+	DMA_InitStructure.DMA_M2M = DMA_M2M_Disable;
+	DMA_Init(ICE5_DMA_TX_CHL, &DMA_InitStructure);
+	
+	/* RX DMA - SPI -> dummy sink, completion marks end of frame */
+	DMA_DeInit(ICE5_DMA_RX_CHL);
+	DMA_InitStructure.DMA_MemoryBaseAddr = (uint32_t)&ICE5_q_rxbuf;
+	DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralSRC;
+	DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Disable;
+	DMA_InitStructure.DMA_Priority = DMA_Priority_VeryHigh;
+	DMA_Init(ICE5_DMA_RX_CHL, &DMA_InitStructure);
+	DMA_ITConfig(ICE5_DMA_RX_CHL, DMA_IT_TC, ENABLE);
+	
+	/* Enable the RX DMA Interrupt */
+	NVIC_InitStructure.NVIC_IRQChannel = ICE5_DMA_RX_IRQn;
+	NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 1;
+	NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
+	NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+	NVIC_Init(&NVIC_InitStructure);
 }
 
 void ICE5_SPI_WriteByte(uint8_t Data)
@@ -216,9 +281,135 @@ void ICE5_SPI_WriteBlk(uint8_t *Data, uint32_t Count)
 }
 
 /*
- * configure the FPGA
+ * change SPI bit rate - must be idle
  */
-uint8_t ICE5_FPGA_Config(uint8_t *bitmap, uint32_t size)
+void ICE5_SPI_SetPrescaler(uint16_t Presc)
+{
+	SPI_Cmd(ICE5_SPI, DISABLE);
+	ICE5_SPI->CR1 = (ICE5_SPI->CR1 & ~SPI_CR1_BR) | Presc;
+	SPI_Cmd(ICE5_SPI, ENABLE);
+}
+
+/*
+ * start a TX DMA chunk to the ICE5 SPI - Inc = 0 repeats the byte at Data
+ */
+void ICE5_SPI_StartDMA(const uint8_t *Data, uint16_t Count, uint8_t Inc)
+{
+	ICE5_DMA_TX_CHL->CMAR = (uint32_t)Data;
+	if(Inc)
+		ICE5_DMA_TX_CHL->CCR |= DMA_CCR_MINC;
+	else
+		ICE5_DMA_TX_CHL->CCR &= ~DMA_CCR_MINC;
+	DMA_SetCurrDataCounter(ICE5_DMA_TX_CHL, Count);
+	DMA_ClearFlag(ICE5_DMA_TX_FLAG_GL);
+	DMA_Cmd(ICE5_DMA_TX_CHL, ENABLE);
+}
+
+/*
+ * wait for a TX DMA chunk to be taken by the SPI
+ */
+void ICE5_SPI_WaitDMA(void)
+{
+	while(DMA_GetFlagStatus(ICE5_DMA_TX_FLAG_TC) == RESET)
+	{
+	}
+	DMA_Cmd(ICE5_DMA_TX_CHL, DISABLE);
+}
+
+/*
+ * finish a run of TX DMA chunks. RX is ignored so its FIFO is drained and
+ * the overrun cleared, then the channel is put back for the write queue.
+ */
+void ICE5_SPI_EndDMA(void)
+{
+	SPI_I2S_DMACmd(ICE5_SPI, SPI_I2S_DMAReq_Tx, DISABLE);
+	
+	/* wait for last byte to shift out */
+	while((ICE5_SPI->SR & SPI_I2S_FLAG_BSY) != (uint16_t)RESET)
+	{
+	}
+	
+	/* drain RX and clear overrun */
+	while((ICE5_SPI->SR & SPI_I2S_FLAG_RXNE) != (uint16_t)RESET)
+		(void)*(__IO uint8_t *) ((uint32_t)ICE5_SPI+0x0C);
+	(void)ICE5_SPI->SR;
+	
+	/* restore queue staging buffer */
+	ICE5_DMA_TX_CHL->CMAR = (uint32_t)ICE5_q_txbuf;
+	ICE5_DMA_TX_CHL->CCR |= DMA_CCR_MINC;
+}
+
+/*
+ * Write a block of bytes to the ICE5 SPI with TX DMA
+ */
+void ICE5_SPI_WriteBlkDMA(uint8_t *Data, uint32_t Count)
+{
+	uint16_t len;
+	
+	SPI_I2S_DMACmd(ICE5_SPI, SPI_I2S_DMAReq_Tx, ENABLE);
+	while(Count)
+	{
+		/* DMA counter is only 16 bits */
+		len = Count > 0xffff ? 0xffff : Count;
+		ICE5_SPI_StartDMA(Data, len, 1);
+		ICE5_SPI_WaitDMA();
+		Data += len;
+		Count -= len;
+	}
+	ICE5_SPI_EndDMA();
+}
+
+/*
+ * Decompress an RLE block (see tools/rlepack.c) to the ICE5 SPI. Each
+ * token becomes one DMA chunk - literals straight from the source and
+ * zero runs from a single zero byte - so no bytes are copied and the
+ * next token is parsed while the current one shifts out.
+ */
+void ICE5_SPI_WriteRLE(uint8_t *Data, uint32_t Count)
+{
+	static const uint8_t zero = 0;
+	uint8_t *end = Data + Count, tok, busy = 0;
+	uint16_t len;
+	
+	/* skip length header */
+	Data += 4;
+	
+	SPI_I2S_DMACmd(ICE5_SPI, SPI_I2S_DMAReq_Tx, ENABLE);
+	while(Data < end)
+	{
+		tok = *Data++;
+		if(tok < 0x80)
+		{
+			/* literal */
+			len = tok + 1;
+			if(busy)
+				ICE5_SPI_WaitDMA();
+			ICE5_SPI_StartDMA(Data, len, 1);
+			Data += len;
+		}
+		else
+		{
+			/* zero run */
+			if(tok < 0xC0)
+				len = (tok & 0x3F) + 1;
+			else
+				len = (((tok & 0x3F) << 8) | *Data++) + 1;
+			if(busy)
+				ICE5_SPI_WaitDMA();
+			ICE5_SPI_StartDMA(&zero, len, 0);
+		}
+		busy = 1;
+	}
+	if(busy)
+		ICE5_SPI_WaitDMA();
+	ICE5_SPI_EndDMA();
+}
+
+/*
+ * configure the FPGA, sending the bitstream with the supplied routine
+ */
+uint8_t ICE5_FPGA_Config_Send(uint8_t *bitmap, uint32_t size,
+	void (*send)(uint8_t *, uint32_t))
 {
 	uint32_t timeout;
 	
@@ -249,8 +440,10 @@ uint8_t ICE5_FPGA_Config(uint8_t *bitmap, uint32_t size)
 	/* delay to allow FPGA to reset */
 	delay(1);
 	
-	/* send the bitstream */
-	ICE5_SPI_WriteBlk(bitmap, size);
+	/* send the bitstream at full rate */
+	ICE5_SPI_SetPrescaler(ICE5_SPI_PRESC_CFG);
+	send(bitmap, size);
+	ICE5_SPI_SetPrescaler(ICE5_SPI_PRESC_REG);
 	
 	/* send clocks while waiting for DONE to assert */
 	timeout = 100;
@@ -277,15 +470,115 @@ uint8_t ICE5_FPGA_Config(uint8_t *bitmap, uint32_t size)
 	/* Raise CS bit for subsequent slave transactions */
 	ICE5_SPI_CS_HIGH();
 	
+	/* fresh FPGA has nothing we wrote */
+	ICE5_FPGA_Cache_Invalidate();
+	
 	/* no error handling for now */
 	return 0;
 }
 
+/*
+ * configure the FPGA from a raw bitstream
+ */
+uint8_t ICE5_FPGA_Config(uint8_t *bitmap, uint32_t size)
+{
+	return ICE5_FPGA_Config_Send(bitmap, size, ICE5_SPI_WriteBlkDMA);
+}
+
+/*
+ * configure the FPGA from an RLE compressed bitstream
+ */
+uint8_t ICE5_FPGA_ConfigRLE(uint8_t *rle, uint32_t size)
+{
+	return ICE5_FPGA_Config_Send(rle, size, ICE5_SPI_WriteRLE);
+}
+
+/*
+ * get uncompressed length of an RLE compressed bitstream
+ */
+uint32_t ICE5_RLE_Size(uint8_t *rle)
+{
+	return rle[0] | (rle[1]<<8) | (rle[2]<<16) | ((uint32_t)rle[3]<<24);
+}
+
+/*
+ * start DMA on the next queued frame if the SPI is idle
+ * - called from the DMA IRQ or with interrupts masked
+ */
+void ICE5_Queue_Kick(void)
+{
+	uint32_t hdr, cnt, i, data;
+	uint8_t *ptr;
+	
+	if(ICE5_q_busy || (ICE5_q_rptr == ICE5_q_wptr))
+		return;
+	
+	/* serialize frame into the staging buffer */
+	hdr = ICE5_queue[ICE5_q_rptr++ & ICE5_QUEUE_MSK];
+	cnt = hdr >> 8;
+	ptr = ICE5_q_txbuf;
+	*ptr++ = hdr & 0x7f;
+	for(i=0;i<cnt;i++)
+	{
+		data = ICE5_queue[ICE5_q_rptr++ & ICE5_QUEUE_MSK];
+		*ptr++ = (data>>24) & 0xff;
+		*ptr++ = (data>>16) & 0xff;
+		*ptr++ = (data>> 8) & 0xff;
+		*ptr++ = (data>> 0) & 0xff;
+	}
+	ICE5_q_txlen = ptr - ICE5_q_txbuf;
+	ICE5_q_busy = 1;
+	
+	/* Drop CS */
+	ICE5_SPI_CS_LOW();
+	
+	/* RX first so no byte is missed, then TX to start the clocks */
+	DMA_SetCurrDataCounter(ICE5_DMA_RX_CHL, ICE5_q_txlen);
+	DMA_SetCurrDataCounter(ICE5_DMA_TX_CHL, ICE5_q_txlen);
+	SPI_I2S_DMACmd(ICE5_SPI, SPI_I2S_DMAReq_Rx, ENABLE);
+	DMA_Cmd(ICE5_DMA_RX_CHL, ENABLE);
+	DMA_Cmd(ICE5_DMA_TX_CHL, ENABLE);
+	SPI_I2S_DMACmd(ICE5_SPI, SPI_I2S_DMAReq_Tx, ENABLE);
+}
+
+/*
+ * RX DMA done - last byte has shifted so the frame is complete
+ */
+void DMA1_Channel2_IRQHandler(void)
+{
+	if(DMA_GetITStatus(ICE5_DMA_RX_IT_TC) != RESET)
+	{
+		DMA_ClearITPendingBit(ICE5_DMA_RX_IT_GL | ICE5_DMA_TX_IT_GL);
+		
+		/* shut down DMA */
+		SPI_I2S_DMACmd(ICE5_SPI, SPI_I2S_DMAReq_Tx | SPI_I2S_DMAReq_Rx, DISABLE);
+		DMA_Cmd(ICE5_DMA_TX_CHL, DISABLE);
+		DMA_Cmd(ICE5_DMA_RX_CHL, DISABLE);
+		
+		/* Raise CS */
+		ICE5_SPI_CS_HIGH();
+		
+		/* update stats */
+		ICE5_q_byt_done += ICE5_q_txlen;
+		ICE5_q_frm_done++;
+		ICE5_q_busy = 0;
+		
+		/* on to the next one */
+		ICE5_Queue_Kick();
+	}
+}
+
 /*
  * Write a long to the FPGA SPI slave
  */
 void ICE5_FPGA_Slave_Write(uint8_t Reg, uint32_t Data)
 {
+	if(ICE5_Cache_Filter(Reg, &Data, 1))
+		return;
+	
+	/* keep order with queued writes */
+	ICE5_FPGA_Slave_Flush();
+	
 	/* Drop CS */
 	ICE5_SPI_CS_LOW();
 	
@@ -302,6 +595,37 @@ void ICE5_FPGA_Slave_Write(uint8_t Reg, uint32_t Data)
 	ICE5_SPI_CS_HIGH();
 }
 
+/*
+ * Write an auto-increment burst of longs to the FPGA SPI slave
+ */
+void ICE5_FPGA_Slave_WriteBurst(uint8_t Reg, const uint32_t *Data, uint32_t Count)
+{
+	if(ICE5_Cache_Filter(Reg, Data, Count))
+		return;
+	
+	/* keep order with queued writes */
+	ICE5_FPGA_Slave_Flush();
+	
+	/* Drop CS */
+	ICE5_SPI_CS_LOW();
+	
+	/* msbit of byte 0 is 0 for write */
+	ICE5_SPI_WriteByte(Reg & 0x7f);
+
+	/* slave bumps the address after every four bytes */
+	while(Count--)
+	{
+		ICE5_SPI_WriteByte((*Data>>24) & 0xff);
+		ICE5_SPI_WriteByte((*Data>>16) & 0xff);
+		ICE5_SPI_WriteByte((*Data>> 8) & 0xff);
+		ICE5_SPI_WriteByte((*Data>> 0) & 0xff);
+		Data++;
+	}
+	
+	/* Raise CS */
+	ICE5_SPI_CS_HIGH();
+}
+
 /*
  * Read a long from the FPGA SPI slave
  */
@@ -309,6 +633,9 @@ void ICE5_FPGA_Slave_Read(uint8_t Reg, uint32_t *Data)
 {
 	uint8_t rx[4];
 	
+	/* queued writes must land first */
+	ICE5_FPGA_Slave_Flush();
+	
 	/* Drop CS */
 	ICE5_SPI_CS_LOW();
 	
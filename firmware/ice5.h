@@ -8,9 +8,24 @@
 
 #include "stm32f30x.h"
 
+#define ICE5_BURST_MAX 16
+
 void ICE5_Init(void);
 uint8_t ICE5_FPGA_Config(uint8_t *bitmap, uint32_t size);
+uint8_t ICE5_FPGA_ConfigRLE(uint8_t *rle, uint32_t size);
+uint32_t ICE5_RLE_Size(uint8_t *rle);
 void ICE5_FPGA_Slave_Write(uint8_t Reg, uint32_t Data);
+void ICE5_FPGA_Slave_WriteBurst(uint8_t Reg, const uint32_t *Data, uint32_t Count);
 void ICE5_FPGA_Slave_Read(uint8_t Reg, uint32_t *Data);
+void ICE5_FPGA_Slave_Queue(uint8_t Reg, uint32_t Data);
+void ICE5_FPGA_Slave_QueueBurst(uint8_t Reg, const uint32_t *Data, uint32_t Count);
+void ICE5_FPGA_Slave_Flush(void);
+uint32_t ICE5_FPGA_Slave_Pending(uint32_t *Bytes);
+uint32_t ICE5_FPGA_Slave_Mark(void);
+uint8_t ICE5_FPGA_Slave_Sent(uint32_t Mark);
+uint8_t ICE5_FPGA_Param_Write(uint8_t Addr, uint64_t Data);
+void ICE5_FPGA_Cache_Invalidate(void);
+void ICE5_FPGA_Cache_Stats(uint32_t *Issued, uint32_t *Elided);
+void ICE5_FPGA_Cache_ClrStats(void);
 
 #endif
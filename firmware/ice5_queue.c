@@ -0,0 +1,272 @@
+/*
+ * ice5_queue.c - async write queue & write cache for the ice5 SPI slave
+ *
+ * Nothing in here touches the hardware. The transport - ice5.c on the
+ * STM32, host/ice5_host.c off target - supplies ICE5_Queue_Kick() to
+ * send queued frames and retires them by bumping the done counts.
+ */
+ 
+#include <string.h>
+#include "ice5.h"
+#include "ice5_queue.h"
+
+uint32_t ICE5_queue[ICE5_QUEUE_SZ];
+volatile uint32_t ICE5_q_wptr, ICE5_q_rptr;
+volatile uint32_t ICE5_q_frm_posted, ICE5_q_frm_done;
+volatile uint32_t ICE5_q_byt_posted, ICE5_q_byt_done;
+volatile uint8_t ICE5_q_busy;
+
+/*
+ * shadow register cache - last value written to each plain register and
+ * to each operator's pmem word, with valid bits. Writes that would not
+ * change anything are dropped. Strobe registers (0x0C ctrl, 0x12 pmem
+ * address) are never cached since writing them has side effects.
+ */
+#define ICE5_NREGS              128
+#define ICE5_NOPS               256
+#define ICE5_REG_CTRL           0x0C
+#define ICE5_REG_CFG            0x0D
+#define ICE5_REG_PWLO           0x10
+
+const uint32_t ICE5_reg_plain[ICE5_NREGS/32] =
+{
+	0x40F32FFE,		/* 0x01-0x0B, 0x0D, 0x10-0x11, 0x14-0x17, 0x1E */
+	0x00000000,
+	0x00000000,
+	0x00000000
+};
+uint32_t ICE5_reg_cache[ICE5_NREGS], ICE5_reg_vld[ICE5_NREGS/32];
+uint64_t ICE5_pmem_cache[ICE5_NOPS];
+uint32_t ICE5_pmem_vld[ICE5_NOPS/32];
+uint32_t ICE5_tx_issued, ICE5_tx_elided;
+
+/*
+ * empty the async write queue
+ */
+void ICE5_Queue_Init(void)
+{
+	ICE5_q_wptr = ICE5_q_rptr = 0;
+	ICE5_q_frm_posted = ICE5_q_frm_done = 0;
+	ICE5_q_byt_posted = ICE5_q_byt_done = 0;
+	ICE5_q_busy = 0;
+}
+
+/*
+ * check if a run of writes would leave the cached registers unchanged
+ */
+uint8_t ICE5_Cache_Match(uint8_t Reg, const uint32_t *Data, uint32_t Count)
+{
+	uint32_t i;
+	uint8_t r;
+	
+	for(i=0;i<Count;i++)
+	{
+		r = (Reg + i) & 0x7f;
+		if(!(ICE5_reg_plain[r>>5] & (1UL<<(r&31))) ||
+			!(ICE5_reg_vld[r>>5] & (1UL<<(r&31))) ||
+			(ICE5_reg_cache[r] != Data[i]))
+			return 0;
+	}
+	
+	return 1;
+}
+
+/*
+ * record a run of writes in the cache
+ */
+void ICE5_Cache_Update(uint8_t Reg, const uint32_t *Data, uint32_t Count)
+{
+	uint32_t i;
+	uint8_t r;
+	
+	for(i=0;i<Count;i++)
+	{
+		r = (Reg + i) & 0x7f;
+		if(ICE5_reg_plain[r>>5] & (1UL<<(r&31)))
+		{
+			ICE5_reg_cache[r] = Data[i];
+			ICE5_reg_vld[r>>5] |= 1UL<<(r&31);
+		}
+		
+		/* legacy strobe or FM reset overwrite pmem behind our back and
+		   a shadow mode change moves which bank we're tracking */
+		if(((r == ICE5_REG_CTRL) && (Data[i] & 3)) || (r == ICE5_REG_CFG))
+			memset(ICE5_pmem_vld, 0, sizeof(ICE5_pmem_vld));
+	}
+}
+
+/*
+ * Filter a write through the cache - returns 1 if it can be dropped
+ */
+uint8_t ICE5_Cache_Filter(uint8_t Reg, const uint32_t *Data, uint32_t Count)
+{
+	if(ICE5_Cache_Match(Reg, Data, Count))
+	{
+		ICE5_tx_elided++;
+		return 1;
+	}
+	
+	ICE5_Cache_Update(Reg, Data, Count);
+	ICE5_tx_issued++;
+	return 0;
+}
+
+/*
+ * Forget everything in the cache - next writes always go out
+ */
+void ICE5_FPGA_Cache_Invalidate(void)
+{
+	memset(ICE5_reg_vld, 0, sizeof(ICE5_reg_vld));
+	memset(ICE5_pmem_vld, 0, sizeof(ICE5_pmem_vld));
+}
+
+/*
+ * Get counts of issued and elided write transactions
+ */
+void ICE5_FPGA_Cache_Stats(uint32_t *Issued, uint32_t *Elided)
+{
+	*Issued = ICE5_tx_issued;
+	*Elided = ICE5_tx_elided;
+}
+
+/*
+ * Zero the issued / elided counts
+ */
+void ICE5_FPGA_Cache_ClrStats(void)
+{
+	ICE5_tx_issued = 0;
+	ICE5_tx_elided = 0;
+}
+
+/*
+ * Post a frame header + data to the async queue, waiting for room if full.
+ * Not to be called from interrupts.
+ */
+void ICE5_Queue_Post(uint8_t Reg, const uint32_t *Data, uint8_t Count)
+{
+	uint32_t wptr = ICE5_q_wptr, primask, i;
+	
+	/* wait for room - DMA IRQ frees up space */
+	while((ICE5_QUEUE_SZ - (wptr - ICE5_q_rptr)) < (uint32_t)(Count+1))
+	{
+	}
+	
+	/* fill the frame then publish it */
+	ICE5_queue[wptr++ & ICE5_QUEUE_MSK] = (Count<<8) | (Reg & 0x7f);
+	for(i=0;i<Count;i++)
+		ICE5_queue[wptr++ & ICE5_QUEUE_MSK] = Data[i];
+	ICE5_q_byt_posted += 1 + 4*Count;
+	ICE5_q_frm_posted++;
+	ICE5_q_wptr = wptr;
+	
+	/* start DMA if idle */
+	primask = __get_PRIMASK();
+	__disable_irq();
+	ICE5_Queue_Kick();
+	__set_PRIMASK(primask);
+}
+
+/*
+ * Queue a long write to the FPGA SPI slave - returns immediately
+ */
+void ICE5_FPGA_Slave_Queue(uint8_t Reg, uint32_t Data)
+{
+	if(ICE5_Cache_Filter(Reg, &Data, 1))
+		return;
+	
+	ICE5_Queue_Post(Reg, &Data, 1);
+}
+
+/*
+ * Queue an auto-increment burst of longs starting at Reg - returns
+ * immediately. Long bursts are split into ICE5_BURST_MAX word frames.
+ */
+void ICE5_FPGA_Slave_QueueBurst(uint8_t Reg, const uint32_t *Data, uint32_t Count)
+{
+	uint8_t len;
+	
+	if(ICE5_Cache_Filter(Reg, Data, Count))
+		return;
+	
+	while(Count)
+	{
+		len = Count > ICE5_BURST_MAX ? ICE5_BURST_MAX : Count;
+		ICE5_Queue_Post(Reg, Data, len);
+		Reg += len;
+		Data += len;
+		Count -= len;
+	}
+}
+
+/*
+ * Queue a packed 64-bit parameter word for an operator. Regs 0x10/0x11
+ * hold the word and writing the address to 0x12 strobes it into pmem,
+ * all in one burst. Returns 0 if pmem already has the word and nothing
+ * was sent.
+ */
+uint8_t ICE5_FPGA_Param_Write(uint8_t Addr, uint64_t Data)
+{
+	uint32_t regs[3];
+	
+	if((ICE5_pmem_vld[Addr>>5] & (1UL<<(Addr&31))) &&
+		(ICE5_pmem_cache[Addr] == Data))
+	{
+		ICE5_tx_elided++;
+		return 0;
+	}
+	
+	regs[0] = Data & 0xffffffff;
+	regs[1] = Data >> 32;
+	regs[2] = Addr;
+	
+	/* often only the high word differs from the last op written */
+	if(ICE5_Cache_Match(ICE5_REG_PWLO, regs, 1))
+		ICE5_Queue_Post(ICE5_REG_PWLO+1, &regs[1], 2);
+	else
+		ICE5_Queue_Post(ICE5_REG_PWLO, regs, 3);
+	ICE5_Cache_Update(ICE5_REG_PWLO, regs, 3);
+	ICE5_tx_issued++;
+	
+	ICE5_pmem_cache[Addr] = Data;
+	ICE5_pmem_vld[Addr>>5] |= 1UL<<(Addr&31);
+	
+	return 1;
+}
+
+/*
+ * Wait until all queued writes have been sent
+ */
+void ICE5_FPGA_Slave_Flush(void)
+{
+	while(ICE5_q_busy || (ICE5_q_rptr != ICE5_q_wptr))
+	{
+	}
+}
+
+/*
+ * Get number of queued transactions and optionally bytes not yet sent
+ */
+uint32_t ICE5_FPGA_Slave_Pending(uint32_t *Bytes)
+{
+	if(Bytes)
+		*Bytes = ICE5_q_byt_posted - ICE5_q_byt_done;
+	
+	return ICE5_q_frm_posted - ICE5_q_frm_done;
+}
+
+/*
+ * Mark the last transaction queued so far
+ */
+uint32_t ICE5_FPGA_Slave_Mark(void)
+{
+	return ICE5_q_frm_posted;
+}
+
+/*
+ * Check if everything up to a mark has been sent
+ */
+uint8_t ICE5_FPGA_Slave_Sent(uint32_t Mark)
+{
+	return (int32_t)(ICE5_q_frm_done - Mark) >= 0;
+}
+
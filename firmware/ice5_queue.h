@@ -0,0 +1,28 @@
+/*
+ * ice5_queue.h - async write queue internals shared by the ice5 transports
+ */
+ 
+#ifndef __ICE5_QUEUE__
+#define __ICE5_QUEUE__
+
+#include "ice5.h"
+
+/*
+ * async write queue - ring of 32-bit words holding frames of one header
+ * word (count<<8 | reg) followed by count data words. Indexes are free
+ * running and only masked on access so full/empty are unambiguous.
+ */
+#define ICE5_QUEUE_SZ           512
+#define ICE5_QUEUE_MSK          (ICE5_QUEUE_SZ-1)
+
+extern uint32_t ICE5_queue[ICE5_QUEUE_SZ];
+extern volatile uint32_t ICE5_q_wptr, ICE5_q_rptr;
+extern volatile uint32_t ICE5_q_frm_posted, ICE5_q_frm_done;
+extern volatile uint32_t ICE5_q_byt_posted, ICE5_q_byt_done;
+extern volatile uint8_t ICE5_q_busy;
+
+void ICE5_Queue_Init(void);
+void ICE5_Queue_Kick(void);
+uint8_t ICE5_Cache_Filter(uint8_t Reg, const uint32_t *Data, uint32_t Count);
+
+#endif
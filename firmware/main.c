@@ -13,20 +13,28 @@
 #include "led.h"
 
 #include "fm.h"
+#include "midi.h"
+#include "proto.h"
 #include "cmd.h"
 
+/* notes the two buttons play - near the old 100Hz & 1kHz test tones */
+const uint8_t key_notes[2] = {43, 83};
+
 /*
  * start 
  */
 int main(void)
 {
-	int rxchar;
+	int rxchar, i;
 	uint32_t delaygoal;
 	uint16_t curr_sw, prev_sw = 0;
 	
 	/* start cycle counter */
 	cyccnt_enable();
 	
+	/* 2 bits of preemption priority - SPI, MIDI & console IRQs use 0-3 */
+	NVIC_PriorityGroupConfig(NVIC_PriorityGroup_2);
+	
 	/* init LEDs & Switches */
 	SysTick_Init();
 	LEDInit();
@@ -39,6 +47,9 @@ int main(void)
 	FM_Init();
 	printf("FM configured.\n");
 	
+	/* MIDI in */
+	setup_midi();
+	
 	/* loop forever */
 	init_cmd();
 	delaygoal = cyclegoal_ms(100);
@@ -55,16 +66,28 @@ int main(void)
 		curr_sw = SysTick_GetSw();
 		if(curr_sw != prev_sw)
 		{
-			FM_Gate(curr_sw);
+			for(i=0;i<2;i++)
+			{
+				if((curr_sw & ~prev_sw) & (1<<i))
+					FM_NoteOn(key_notes[i], 100);
+				else if((prev_sw & ~curr_sw) & (1<<i))
+					FM_NoteOff(key_notes[i]);
+			}
 			prev_sw = curr_sw;
 			printf("Key = %d\n", curr_sw);
 		}
 		
-		/* UART command processing */
-		if((rxchar = get_usart())!= EOF)
+		/* MIDI events, then retriggers & patch loads */
+		MIDI_Service();
+		FM_NoteService();
+		
+		/* UART command processing - binary frames or text */
+		PROTO_Service();
+		while((rxchar = get_usart())!= EOF)
 		{
 			/* Parse commands */
-			cmd_parse(rxchar);
+			if(!PROTO_Byte(rxchar))
+				cmd_parse(rxchar);
 		}
 	}
 }
@@ -0,0 +1,314 @@
+/*
+ * midi.c - MIDI input on USART2 for the FM engine
+ *
+ * The RX interrupt parses the byte stream (running status, realtime bytes
+ * interleaved anywhere, SysEx skipped) and posts complete channel messages
+ * to a single producer / single consumer queue. MIDI_Service() drains it
+ * from the main loop into the note allocator.
+ */
+ 
+#include <stdio.h>
+#include "stm32f30x.h"
+#include "fm.h"
+#include "ice5.h"
+#include "midi.h"
+
+#define MIDI_Q_SZ 64		/* event queue, power of 2 */
+#define MIDI_P_SZ 16		/* outstanding latency probes, power of 2 */
+#define MIDI_Bend_Range 200	/* pitch bend range, cents */
+
+/* status nybbles we act on */
+#define MIDI_NoteOff 0x8
+#define MIDI_NoteOn 0x9
+#define MIDI_CC 0xB
+#define MIDI_Program 0xC
+#define MIDI_Bend 0xE
+
+uint8_t MIDI_Channel = MIDI_Omni;
+
+/* parser state - ISR only */
+uint8_t MIDI_status, MIDI_need, MIDI_cnt, MIDI_data[2];
+
+/* event queue - ISR writes head, main loop writes tail */
+midi_event MIDI_queue[MIDI_Q_SZ];
+volatile uint32_t MIDI_q_head, MIDI_q_tail, MIDI_q_drop;
+
+/* latency probes - SPI frame mark & event time, and the voice of a
+   note-on whose gate is still parked or FM_No_Voice */
+uint32_t MIDI_p_mark[MIDI_P_SZ], MIDI_p_time[MIDI_P_SZ];
+uint8_t MIDI_p_voice[MIDI_P_SZ];
+uint32_t MIDI_p_head, MIDI_p_tail;
+midi_stats MIDI_stats;
+
+/* USART2 RX on PA3, 31250-8-N-1 */
+void setup_midi(void)
+{
+	GPIO_InitTypeDef GPIO_InitStructure;
+	USART_InitTypeDef USART_InitStructure;
+	NVIC_InitTypeDef NVIC_InitStructure;
+	
+	MIDI_status = MIDI_need = MIDI_cnt = 0;
+	MIDI_q_head = MIDI_q_tail = MIDI_q_drop = 0;
+	MIDI_p_head = MIDI_p_tail = 0;
+	MIDI_ClrStats();
+	
+	/* Connect PA3 to USART2_Rx */
+	RCC_AHBPeriphClockCmd(RCC_AHBPeriph_GPIOA, ENABLE);
+	GPIO_PinAFConfig(GPIOA, GPIO_PinSource3, GPIO_AF_7);
+	GPIO_InitStructure.GPIO_Pin = GPIO_Pin_3;
+	GPIO_InitStructure.GPIO_Mode = GPIO_Mode_AF;
+	GPIO_InitStructure.GPIO_Speed = GPIO_Speed_50MHz;
+	GPIO_InitStructure.GPIO_OType = GPIO_OType_PP;
+	GPIO_InitStructure.GPIO_PuPd = GPIO_PuPd_UP;
+	GPIO_Init(GPIOA, &GPIO_InitStructure);
+	
+	/* USART = 31250-8-N-1, RX only */
+	RCC_APB1PeriphClockCmd(RCC_APB1Periph_USART2, ENABLE);
+	USART_InitStructure.USART_BaudRate = 31250;
+	USART_InitStructure.USART_WordLength = USART_WordLength_8b;
+	USART_InitStructure.USART_StopBits = USART_StopBits_1;
+	USART_InitStructure.USART_Parity = USART_Parity_No;
+	USART_InitStructure.USART_HardwareFlowControl = USART_HardwareFlowControl_None;
+	USART_InitStructure.USART_Mode = USART_Mode_Rx;
+	USART_Init(USART2, &USART_InitStructure);
+	
+	/* Enable RX interrupt */
+	USART_ITConfig(USART2, USART_IT_RXNE, ENABLE);
+	NVIC_InitStructure.NVIC_IRQChannel = USART2_IRQn;
+	NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 0;
+	NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
+	NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+	NVIC_Init(&NVIC_InitStructure);
+	
+	USART_Cmd(USART2, ENABLE);
+}
+
+/*
+ * post a complete message to the queue
+ */
+static void MIDI_Post(uint32_t time)
+{
+	uint32_t head = MIDI_q_head;
+	midi_event *ev;
+	
+	/* only the messages the engine uses */
+	switch(MIDI_status >> 4)
+	{
+		case MIDI_NoteOff:
+		case MIDI_NoteOn:
+		case MIDI_CC:
+		case MIDI_Program:
+		case MIDI_Bend:
+			break;
+		
+		default:
+			return;
+	}
+	if((MIDI_Channel != MIDI_Omni) && ((MIDI_status & 0xF) != MIDI_Channel))
+		return;
+	
+	if(head - MIDI_q_tail >= MIDI_Q_SZ)
+	{
+		MIDI_q_drop++;
+		return;
+	}
+	
+	ev = &MIDI_queue[head & (MIDI_Q_SZ-1)];
+	ev->type = MIDI_status >> 4;
+	ev->ch = MIDI_status & 0xF;
+	ev->d1 = MIDI_data[0];
+	ev->d2 = MIDI_data[1];
+	ev->time = time;
+	
+	/* note on with zero velocity is a note off */
+	if((ev->type == MIDI_NoteOn) && (ev->d2 == 0))
+		ev->type = MIDI_NoteOff;
+	
+	/* entry has to land before the index the main loop polls */
+	__DMB();
+	MIDI_q_head = head + 1;
+}
+
+/*
+ * parse one received byte
+ */
+static void MIDI_Parse(uint8_t byte, uint32_t time)
+{
+	if(byte >= 0xF8)
+	{
+		/* realtime - may appear anywhere, doesn't touch running status */
+		return;
+	}
+	else if(byte >= 0xF0)
+	{
+		/* system common & SysEx cancel running status, data ignored */
+		MIDI_status = 0;
+		return;
+	}
+	else if(byte & 0x80)
+	{
+		/* new channel status */
+		MIDI_status = byte;
+		MIDI_need = ((byte & 0xE0) == 0xC0) ? 1 : 2;
+		MIDI_cnt = 0;
+		MIDI_data[1] = 0;
+		return;
+	}
+	
+	/* data - dropped with no running status (SysEx body etc) */
+	if(!MIDI_status)
+		return;
+	
+	MIDI_data[MIDI_cnt++] = byte;
+	if(MIDI_cnt == MIDI_need)
+	{
+		MIDI_Post(time);
+		MIDI_cnt = 0;
+	}
+}
+
+/*
+ * USART2 IRQ handler - MIDI RX
+ */
+void USART2_IRQHandler(void)
+{
+	uint32_t time = DWT->CYCCNT;
+	
+	/* overrun blocks RXNE until cleared */
+	if(USART_GetFlagStatus(USART2, USART_FLAG_ORE) != RESET)
+		USART_ClearFlag(USART2, USART_FLAG_ORE);
+	
+	if(USART_GetITStatus(USART2, USART_IT_RXNE) != RESET)
+		MIDI_Parse(USART_ReceiveData(USART2), time);
+}
+
+/*
+ * retire latency probes whose gate writes have gone out on SPI. A parked
+ * gate-on is queued by FM_NoteService(), so its mark is taken on the
+ * first pass after - late by whatever was queued since, never early.
+ */
+static void MIDI_Probe_Check(void)
+{
+	uint32_t lat, i;
+	
+	while(MIDI_p_tail != MIDI_p_head)
+	{
+		i = MIDI_p_tail & (MIDI_P_SZ-1);
+		if(MIDI_p_voice[i] != FM_No_Voice)
+		{
+			if(FM_GateParked(MIDI_p_voice[i]))
+				break;
+			MIDI_p_voice[i] = FM_No_Voice;
+			MIDI_p_mark[i] = ICE5_FPGA_Slave_Mark();
+		}
+		if(!ICE5_FPGA_Slave_Sent(MIDI_p_mark[i]))
+			break;
+		
+		lat = DWT->CYCCNT - MIDI_p_time[i];
+		if(lat > MIDI_stats.max)
+			MIDI_stats.max = lat;
+		if(MIDI_stats.count)
+			MIDI_stats.avg += ((int32_t)lat - (int32_t)MIDI_stats.avg) / 16;
+		else
+			MIDI_stats.avg = lat;
+		MIDI_stats.count++;
+		MIDI_p_tail++;
+	}
+}
+
+/*
+ * time an event from its last MIDI byte until its gate write has been
+ * sent - voice is the one a note-on got, or FM_No_Voice
+ */
+static void MIDI_Probe(uint32_t time, uint8_t voice)
+{
+	uint32_t i = MIDI_p_head & (MIDI_P_SZ-1);
+	
+	if(MIDI_p_head - MIDI_p_tail >= MIDI_P_SZ)
+	{
+		MIDI_stats.lost++;
+		return;
+	}
+	MIDI_p_mark[i] = ICE5_FPGA_Slave_Mark();
+	MIDI_p_time[i] = time;
+	MIDI_p_voice[i] = ((voice != FM_No_Voice) && FM_GateParked(voice)) ?
+		voice : FM_No_Voice;
+	MIDI_p_head++;
+}
+
+/*
+ * feed queued events to the FM engine. Call from the main loop.
+ */
+void MIDI_Service(void)
+{
+	midi_event *ev;
+	uint32_t tail;
+	uint8_t n, v;
+	
+	MIDI_Probe_Check();
+	
+	while((tail = MIDI_q_tail) != MIDI_q_head)
+	{
+		ev = &MIDI_queue[tail & (MIDI_Q_SZ-1)];
+		switch(ev->type)
+		{
+			case MIDI_NoteOn:
+				v = FM_NoteOn(ev->d1, ev->d2);
+				MIDI_Probe(ev->time, v);
+				break;
+			
+			case MIDI_NoteOff:
+				FM_NoteOff(ev->d1);
+				MIDI_Probe(ev->time, FM_No_Voice);
+				break;
+			
+			case MIDI_CC:
+				if(ev->d1 == 120)
+				{
+					/* all sound off - cut everything */
+					FM_NoteReset();
+				}
+				else if(ev->d1 == 123)
+				{
+					/* all notes off - released, so they ring out */
+					for(n=0;n<128;n++)
+						FM_NoteOff(n);
+				}
+				break;
+			
+			case MIDI_Program:
+				FM_SetNoteProgram(ev->d1);
+				break;
+			
+			case MIDI_Bend:
+				FM_SetBend(MIDI_Bend_Range *
+					((ev->d2<<7 | ev->d1) - 8192) / 8192);
+				break;
+		}
+		
+		/* done with the entry - hand it back to the ISR */
+		__DMB();
+		MIDI_q_tail = tail + 1;
+	}
+}
+
+/*
+ * get latency stats
+ */
+void MIDI_GetStats(midi_stats *st)
+{
+	*st = MIDI_stats;
+	st->lost += MIDI_q_drop;
+}
+
+/*
+ * reset latency stats
+ */
+void MIDI_ClrStats(void)
+{
+	MIDI_stats.count = 0;
+	MIDI_stats.max = 0;
+	MIDI_stats.avg = 0;
+	MIDI_stats.lost = 0;
+	MIDI_q_drop = 0;
+}
@@ -0,0 +1,38 @@
+/*
+ * midi.h - MIDI input on USART2 for the FM engine
+ */
+
+#ifndef __midi__
+#define __midi__
+
+#include "stm32f30x.h"
+
+#define MIDI_Omni 0xFF		/* MIDI_Channel value that takes every channel */
+
+/* queued channel messages - type is the status high nybble */
+typedef struct
+{
+	uint8_t type;
+	uint8_t ch;
+	uint8_t d1;
+	uint8_t d2;
+	uint32_t time;			/* DWT cycle count at the last byte */
+} midi_event;
+
+/* MIDI byte to gate write latency, cycles */
+typedef struct
+{
+	uint32_t count;
+	uint32_t max;
+	uint32_t avg;			/* running average, 1/16 weight */
+	uint32_t lost;			/* events dropped or not measured */
+} midi_stats;
+
+extern uint8_t MIDI_Channel;
+
+void setup_midi(void);
+void MIDI_Service(void);
+void MIDI_GetStats(midi_stats *st);
+void MIDI_ClrStats(void);
+
+#endif
@@ -0,0 +1,279 @@
+/*
+ * proto.c - binary framed commands on the console UART
+ *
+ * The text console never sends 0x00, so a 0x00 switches the input over
+ * to frame decoding. Each 0x00 after that closes a frame and opens the
+ * next until the line has been quiet between frames for PROTO_Idle ms,
+ * when text goes back to the console. COBS is undone on the fly
+ * into PROTO_buf and the frame is handled once it closes. Bulk patch
+ * data only touches RAM here - FM_NoteService() streams the note patch
+ * to the FPGA at its own pace. PROTO_Store is the exception, it writes
+ * flash and holds the reply for up to PROTO_Store_Ms.
+ */
+
+#include <string.h>
+#include "stm32f30x.h"
+#include "usart.h"
+#include "ice5.h"
+#include "fm.h"
+#include "bank.h"
+#include "proto.h"
+
+/* decoder state */
+uint8_t PROTO_buf[PROTO_Max];
+uint32_t PROTO_len;
+uint8_t PROTO_in, PROTO_code, PROTO_left, PROTO_ovfl;
+uint32_t PROTO_delim;		/* cycle count at the last 0x00 */
+
+/*
+ * CRC-16/CCITT-FALSE, nybble table
+ */
+uint16_t PROTO_CRC(const uint8_t *buf, uint32_t len)
+{
+	static const uint16_t tab[16] =
+	{
+		0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+		0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF
+	};
+	uint16_t crc = 0xFFFF;
+	
+	while(len--)
+	{
+		crc = (crc << 4) ^ tab[(crc >> 12) ^ (*buf >> 4)];
+		crc = (crc << 4) ^ tab[(crc >> 12) ^ (*buf++ & 0xF)];
+	}
+	return crc;
+}
+
+/*
+ * COBS encode len bytes - dst needs len + len/254 + 1 bytes. Returns
+ * the encoded length, delimiters not included.
+ */
+uint32_t PROTO_Encode(uint8_t *dst, const uint8_t *src, uint32_t len)
+{
+	uint8_t *code = dst, *out = dst + 1;
+	
+	*code = 1;
+	while(len--)
+	{
+		if(*src)
+		{
+			*out++ = *src;
+			(*code)++;
+		}
+		if(!*src++ || (*code == 0xFF))
+		{
+			/* close this block - a full one doesn't stand for a zero */
+			if(!len && (*code == 0xFF))
+				break;
+			code = out++;
+			*code = 1;
+		}
+	}
+	return out - dst;
+}
+
+/*
+ * send a reply frame
+ */
+static void PROTO_Reply_Send(uint8_t cmd, uint8_t seq, uint8_t status)
+{
+	uint8_t raw[5], enc[6], block;
+	uint16_t crc;
+	uint32_t i, len;
+	
+	raw[0] = cmd | PROTO_Reply;
+	raw[1] = seq;
+	raw[2] = status;
+	crc = PROTO_CRC(raw, 3);
+	raw[3] = crc & 0xFF;
+	raw[4] = crc >> 8;
+	len = PROTO_Encode(enc, raw, 5);
+	
+	/* a dropped byte would cost the host the whole reply */
+	block = usart_tx_policy(1);
+	outbyte(0);
+	for(i=0;i<len;i++)
+		outbyte(enc[i]);
+	outbyte(0);
+	usart_tx_policy(block);
+}
+
+/*
+ * unpack little endian fields
+ */
+static uint32_t PROTO_Get32(const uint8_t *p)
+{
+	return p[0] | (p[1]<<8) | (p[2]<<16) | ((uint32_t)p[3]<<24);
+}
+
+static uint64_t PROTO_Get64(const uint8_t *p)
+{
+	return PROTO_Get32(p) | ((uint64_t)PROTO_Get32(p+4) << 32);
+}
+
+/*
+ * act on a complete frame - returns reply status
+ */
+static uint8_t PROTO_Exec(uint8_t cmd, const uint8_t *pl, uint32_t len)
+{
+	uint32_t i, slot, n;
+	
+	switch(cmd)
+	{
+		case PROTO_Ping:
+			return PROTO_OK;
+		
+		case PROTO_Regs:
+			if(len % 5)
+				return PROTO_Err_Len;
+			for(i=0;i<len;i+=5)
+				ICE5_FPGA_Slave_Queue(pl[i] & 0x7F, PROTO_Get32(&pl[i+1]));
+			return PROTO_OK;
+		
+		case PROTO_Params:
+			if(len % 9)
+				return PROTO_Err_Len;
+			for(i=0;i<len;i+=9)
+				ICE5_FPGA_Param_Write(pl[i], PROTO_Get64(&pl[i+1]));
+			FM_Commit();
+			return PROTO_OK;
+		
+		case PROTO_Voice:
+		case PROTO_Bank:
+			if(!len || ((len-1) % PROTO_Voice_Size))
+				return PROTO_Err_Len;
+			slot = pl[0];
+			n = (len-1) / PROTO_Voice_Size;
+			if((cmd == PROTO_Voice) && (n != 1))
+				return PROTO_Err_Len;
+			if(slot + n > FM_Num_Patches)
+				return PROTO_Err_Range;
+			memcpy(&voices[slot], &pl[1], n * sizeof(voice_struct));
+			
+			/* notes pick up a changed patch straight away */
+			if(FM_NotePatch && (FM_NotePatch >= &voices[slot]) &&
+				(FM_NotePatch < &voices[slot + n]))
+				FM_SetNotePatch(FM_NotePatch);
+			return PROTO_OK;
+		
+		case PROTO_Program:
+			if(len != 1)
+				return PROTO_Err_Len;
+			if(pl[0] >= FM_Num_Patches)
+				return PROTO_Err_Range;
+			FM_SetNotePatch(&voices[pl[0]]);
+			return PROTO_OK;
+		
+		case PROTO_Tuning:
+			{
+				static uint32_t inc[128];
+				
+				if(!len)
+				{
+					FM_SetNoteTable(0, NULL, 0);
+					return PROTO_OK;
+				}
+				if((len-1) % 4)
+					return PROTO_Err_Len;
+				n = (len-1) / 4;
+				if(pl[0] + n > 128 || !n)
+					return PROTO_Err_Range;
+				for(i=0;i<n;i++)
+					inc[i] = PROTO_Get32(&pl[1+4*i]);
+				return FM_SetNoteTable(pl[0], inc, n) ? PROTO_Err_Range : PROTO_OK;
+			}
+		
+		case PROTO_Store:
+			{
+				voice_struct vs;
+				
+				if(len != 1 + PROTO_Voice_Size)
+					return PROTO_Err_Len;
+				if(pl[0] >= BANK_Programs)
+					return PROTO_Err_Range;
+				memcpy(&vs, &pl[1], sizeof(vs));
+				return FM_StoreProgram(pl[0], &vs) ? PROTO_Err_Flash : PROTO_OK;
+			}
+		
+		default:
+			return PROTO_Err_Cmd;
+	}
+}
+
+/*
+ * frame closed - check it & run it
+ */
+static void PROTO_Frame(void)
+{
+	uint8_t status;
+	
+	if(PROTO_ovfl)
+		status = PROTO_Err_Overflow;
+	else if(PROTO_len < 4)
+		status = PROTO_Err_Len;
+	else if(PROTO_CRC(PROTO_buf, PROTO_len-2) !=
+		(PROTO_buf[PROTO_len-2] | (PROTO_buf[PROTO_len-1]<<8)))
+		status = PROTO_Err_CRC;
+	else
+		status = PROTO_Exec(PROTO_buf[0], &PROTO_buf[2], PROTO_len-4);
+	
+	PROTO_Reply_Send(PROTO_buf[0], PROTO_buf[1], status);
+}
+
+/*
+ * hand the console back to text once no frame has been started for
+ * PROTO_Idle ms. Call from the main loop.
+ */
+void PROTO_Service(void)
+{
+	if(PROTO_in && !PROTO_code &&
+		((uint32_t)(DWT->CYCCNT - PROTO_delim) >= PROTO_Idle*(SystemCoreClock/1000)))
+		PROTO_in = 0;
+}
+
+/*
+ * feed one console byte - returns 1 if it belongs to a frame and the
+ * text console shouldn't see it
+ */
+uint8_t PROTO_Byte(int ch)
+{
+	if(ch == 0)
+	{
+		/* a frame closes on a 0x00 & the next opens - empty ones just resync */
+		if(PROTO_in && (PROTO_len || PROTO_ovfl))
+			PROTO_Frame();
+		PROTO_in = 1;
+		PROTO_len = 0;
+		PROTO_code = PROTO_left = 0;
+		PROTO_ovfl = 0;
+		PROTO_delim = DWT->CYCCNT;
+		return 1;
+	}
+	
+	if(!PROTO_in)
+		return 0;
+	
+	/* undo COBS - each code byte stands for a zero unless it was 0xFF */
+	if(!PROTO_left)
+	{
+		if(PROTO_code && (PROTO_code != 0xFF))
+		{
+			if(PROTO_len < PROTO_Max)
+				PROTO_buf[PROTO_len++] = 0;
+			else
+				PROTO_ovfl = 1;
+		}
+		PROTO_code = ch;
+		PROTO_left = ch - 1;
+	}
+	else
+	{
+		if(PROTO_len < PROTO_Max)
+			PROTO_buf[PROTO_len++] = ch;
+		else
+			PROTO_ovfl = 1;
+		PROTO_left--;
+	}
+	return 1;
+}
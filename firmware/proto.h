@@ -0,0 +1,61 @@
+/*
+ * proto.h - binary framed commands on the console UART
+ *
+ * Shared with the host tools so it only depends on stdint.
+ */
+
+#ifndef __proto__
+#define __proto__
+
+#include <stdint.h>
+
+/*
+ * A frame is COBS encoded between 0x00 delimiters. Decoded it is
+ *   cmd, seq, payload..., crc lo, crc hi
+ * with CRC-16/CCITT-FALSE over cmd through payload. Every frame is
+ * answered with cmd|PROTO_Reply, seq, status. A 0x00 closes one frame
+ * and opens the next, so back to back frames can share a delimiter.
+ * After PROTO_Idle ms with no frame open the console goes back to text;
+ * a sender that has paused leads with a 0x00.
+ */
+#define PROTO_Max 1600		/* largest decoded frame */
+#define PROTO_Idle 100		/* ms between frames before text resumes */
+#define PROTO_Reply 0x80
+
+/* commands & payloads, multi-byte fields little endian */
+#define PROTO_Ping 0x00		/* none */
+#define PROTO_Regs 0x01		/* {reg, data32} x n */
+#define PROTO_Params 0x02	/* {op, pw64} x n then commit */
+#define PROTO_Voice 0x03	/* slot, voice_struct */
+#define PROTO_Bank 0x04		/* first slot, voice_struct x n */
+#define PROTO_Program 0x05	/* slot - notes play it */
+#define PROTO_Tuning 0x06	/* first note, inc32 x n - none for equal temp */
+#define PROTO_Store 0x07	/* program, voice_struct - saved to flash */
+
+/*
+ * PROTO_Store is answered once the flash write is done, which takes up to
+ * PROTO_Store_Ms when the bank has to be compacted. The CPU stalls all
+ * that time: send nothing more until the reply, as the RX ring only holds
+ * 20 ms at 1 Mbaud, and expect MIDI input in that time to be lost.
+ */
+#define PROTO_Store_Ms 700
+
+/* voice_struct as the firmware lays it out */
+#define PROTO_Op_Size 12
+#define PROTO_Voice_Size (8*PROTO_Op_Size)
+
+/* reply status */
+#define PROTO_OK 0
+#define PROTO_Err_CRC 1
+#define PROTO_Err_Len 2
+#define PROTO_Err_Cmd 3
+#define PROTO_Err_Range 4
+#define PROTO_Err_Overflow 5
+#define PROTO_Err_Flash 6
+
+uint16_t PROTO_CRC(const uint8_t *buf, uint32_t len);
+uint32_t PROTO_Encode(uint8_t *dst, const uint8_t *src, uint32_t len);
+uint8_t PROTO_Byte(int ch);
+void PROTO_Service(void);
+
+#endif
@@ -0,0 +1,397 @@
+/*
+ * fmload.c - host tool to upload a voice bank over the binary console
+ *
+ * Reads a bank in the gateware/model/fm_bank text format:
+ *   voice <name>
+ * followed by eight operator_struct rows
+ *   freq atten wave ar dr sl rr flags
+ * and sends it to patch slots as PROTO_Bank frames (see proto.h), then
+ * optionally selects the program notes play. Each frame waits for its
+ * reply and the round trip is timed. -w stores the voices in the flash
+ * bank instead, one PROTO_Store frame each, as programs from -s on.
+ *
+ * -t converts a Scala scale (and -k keyboard map) to the note table of
+ * phase increments and uploads it as a PROTO_Tuning frame, -e goes back
+ * to equal temperament. -n prints the table instead of sending anything.
+ */
+
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include "../proto.h"
+#include "scala.h"
+
+#define MAX_VOICES 128
+#define FRAME_VOICES 16		/* fits PROTO_Max */
+
+/* FM_Flag_ bits */
+static const struct
+{
+	const char *name;
+	uint8_t bit;
+} flag_names[] =
+{
+	{"FB_EN", 1<<0},
+	{"ACC_CL", 1<<1},
+	{"ACC_EN", 1<<2},
+	{"MOD_EN", 1<<3},
+	{"Left", 1<<4},
+	{"Right", 1<<5},
+};
+
+static uint8_t bank[MAX_VOICES][PROTO_Voice_Size];
+static int nvoices;
+
+/* CRC-16/CCITT-FALSE */
+static uint16_t crc16(const uint8_t *buf, int len)
+{
+	uint16_t crc = 0xFFFF;
+	int i;
+	
+	while(len--)
+	{
+		crc ^= *buf++ << 8;
+		for(i=0;i<8;i++)
+			crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+	return crc;
+}
+
+/* COBS encode, returns encoded length */
+static int cobs(uint8_t *dst, const uint8_t *src, int len)
+{
+	uint8_t *code = dst, *out = dst + 1;
+	
+	*code = 1;
+	while(len--)
+	{
+		if(*src)
+		{
+			*out++ = *src;
+			(*code)++;
+		}
+		if(!*src++ || (*code == 0xFF))
+		{
+			if(!len && (*code == 0xFF))
+				break;
+			code = out++;
+			*code = 1;
+		}
+	}
+	return out - dst;
+}
+
+static double now_ms(void)
+{
+	struct timeval tv;
+	
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec*1e3 + tv.tv_usec*1e-3;
+}
+
+/* operator_struct row -> firmware layout, little endian */
+static int parse_op(char *line, uint8_t *op)
+{
+	char *tok[8], *f, *save;
+	unsigned i, j;
+	float freq;
+	uint16_t atten;
+	
+	for(i=0;i<8;i++)
+		if(!(tok[i] = strtok_r(i ? NULL : line, " \t\r\n,{}", &save)))
+			return 1;
+	
+	freq = strtof(tok[0], NULL);
+	atten = strtoul(tok[1], NULL, 0) & 0x1FF;
+	memcpy(&op[0], &freq, 4);
+	op[4] = atten & 0xFF;
+	op[5] = atten >> 8;
+	op[6] = strtoul(tok[2], NULL, 0) & 7;
+	op[7] = strtoul(tok[3], NULL, 0) & 0x3F;
+	op[8] = strtoul(tok[4], NULL, 0) & 0x3F;
+	op[9] = strtoul(tok[5], NULL, 0) & 0x1F;
+	op[10] = strtoul(tok[6], NULL, 0) & 0x3F;
+	op[11] = 0;
+	for(f=strtok_r(tok[7], "|", &save);f;f=strtok_r(NULL, "|", &save))
+	{
+		if(!strncmp(f, "FM_Flag_", 8))
+			f += 8;
+		for(j=0;j<sizeof(flag_names)/sizeof(flag_names[0]);j++)
+			if(!strcmp(f, flag_names[j].name))
+				break;
+		if(j < sizeof(flag_names)/sizeof(flag_names[0]))
+			op[11] |= flag_names[j].bit;
+		else if(f[0] >= '0' && f[0] <= '9')
+			op[11] |= strtoul(f, NULL, 0) & 0x3F;
+		else
+			return 1;
+	}
+	return 0;
+}
+
+static int load_bank(const char *fname)
+{
+	FILE *f;
+	char line[256], *p;
+	int lnum = 0, nop = 8;
+	
+	if(!(f = fopen(fname, "r")))
+	{
+		perror(fname);
+		return 1;
+	}
+	while(fgets(line, sizeof(line), f))
+	{
+		lnum++;
+		if((p = strchr(line, '#')) || (p = strstr(line, "//")))
+			*p = 0;
+		p = line + strspn(line, " \t\r\n,{}");
+		if(!*p)
+			continue;
+		
+		if(!strncmp(p, "voice", 5) && (p[5] == ' ' || p[5] == '\t'))
+		{
+			if((nvoices && nop != 8) || nvoices == MAX_VOICES)
+				break;
+			nvoices++;
+			nop = 0;
+		}
+		else if(!nvoices || nop == 8 ||
+			parse_op(p, &bank[nvoices-1][PROTO_Op_Size*nop++]))
+		{
+			fprintf(stderr, "%s:%d: bad line\n", fname, lnum);
+			fclose(f);
+			return 1;
+		}
+	}
+	fclose(f);
+	
+	if(nop != 8)
+	{
+		fprintf(stderr, "%s: voice %d is short or too many voices\n", fname, nvoices-1);
+		return 1;
+	}
+	return 0;
+}
+
+static int open_port(const char *dev, int baud)
+{
+	struct termios tio;
+	speed_t spd;
+	int fd;
+	
+	switch(baud)
+	{
+		case 115200: spd = B115200; break;
+		case 1000000: spd = B1000000; break;
+		case 2000000: spd = B2000000; break;
+		default:
+			fprintf(stderr, "unsupported baud %d\n", baud);
+			return -1;
+	}
+	if((fd = open(dev, O_RDWR | O_NOCTTY)) < 0)
+	{
+		perror(dev);
+		return -1;
+	}
+	tcgetattr(fd, &tio);
+	cfmakeraw(&tio);
+	cfsetispeed(&tio, spd);
+	cfsetospeed(&tio, spd);
+	tio.c_cc[VMIN] = 0;
+	tio.c_cc[VTIME] = 0;
+	tcsetattr(fd, TCSANOW, &tio);
+	tcflush(fd, TCIOFLUSH);
+	return fd;
+}
+
+/*
+ * send a frame & wait for its reply - returns the status or -1. Text
+ * console output between frames is skipped.
+ */
+static int transact(int fd, uint8_t cmd, uint8_t seq, const uint8_t *pl, int len)
+{
+	static uint8_t raw[PROTO_Max], enc[PROTO_Max + PROTO_Max/254 + 3];
+	uint8_t rep[16], ch;
+	int n, in = 0, rlen = 0, code = 0, left = 0;
+	uint16_t crc;
+	struct timeval tv;
+	fd_set fds;
+	
+	raw[0] = cmd;
+	raw[1] = seq;
+	memcpy(&raw[2], pl, len);
+	crc = crc16(raw, len+2);
+	raw[len+2] = crc & 0xFF;
+	raw[len+3] = crc >> 8;
+	enc[0] = 0;
+	n = cobs(&enc[1], raw, len+4) + 1;
+	enc[n++] = 0;
+	if(write(fd, enc, n) != n)
+		return -1;
+	
+	/* reply - undo COBS as it comes in */
+	while(1)
+	{
+		FD_ZERO(&fds);
+		FD_SET(fd, &fds);
+		/* a flash store may compact the bank, plus USB latency */
+		tv.tv_sec = (PROTO_Store_Ms + 1000) / 1000;
+		tv.tv_usec = (PROTO_Store_Ms + 1000) % 1000 * 1000;
+		if(select(fd+1, &fds, NULL, NULL, &tv) <= 0 || read(fd, &ch, 1) != 1)
+			return -1;
+		
+		if(!ch)
+		{
+			if(in && rlen >= 5 && rep[0] == (cmd|PROTO_Reply) && rep[1] == seq &&
+				crc16(rep, 3) == (rep[3] | rep[4]<<8))
+				return rep[2];
+			in = 1;
+			rlen = code = left = 0;
+		}
+		else if(in && rlen < (int)sizeof(rep) - 1)
+		{
+			if(!left)
+			{
+				if(code && code != 0xFF)
+					rep[rlen++] = 0;
+				code = ch;
+				left = ch - 1;
+			}
+			else
+			{
+				rep[rlen++] = ch;
+				left--;
+			}
+		}
+	}
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-d dev] [-b baud] [-s slot] [-w] [-p prog] "
+		"[-t scl [-k kbm] [-n] | -e] [bank]\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *dev = "/dev/ttyUSB0", *scl = NULL, *kbm = NULL;
+	int baud = 1000000, slot = 0, prog = -1, et = 0, dry = 0, store = 0;
+	int opt, fd, i, n, st;
+	uint8_t pl[1 + FRAME_VOICES*PROTO_Voice_Size], seq = 0;
+	uint32_t inc[128];
+	double t, t0, hz[128];
+	
+	while((opt = getopt(argc, argv, "d:b:s:wp:t:k:en")) != -1)
+	{
+		switch(opt)
+		{
+			case 'd': dev = optarg; break;
+			case 'b': baud = atoi(optarg); break;
+			case 's': slot = atoi(optarg); break;
+			case 'w': store = 1; break;
+			case 'p': prog = atoi(optarg); break;
+			case 't': scl = optarg; break;
+			case 'k': kbm = optarg; break;
+			case 'e': et = 1; break;
+			case 'n': dry = 1; break;
+			default: usage(argv[0]);
+		}
+	}
+	if((optind < argc-1) || ((optind == argc) && !scl && !et) ||
+		(kbm && !scl) || (dry && !scl) || (et && scl))
+		usage(argv[0]);
+	
+	if(scl)
+	{
+		if(scala_load(scl, kbm, hz))
+			return 1;
+		if((n = scala_inc(hz, inc)))
+			fprintf(stderr, "%d keys past Nyquist left unplayed\n", n);
+		if(dry)
+		{
+			for(i=0;i<128;i++)
+				printf("%3d %10.3f Hz %6u\n", i, hz[i], (unsigned)inc[i]);
+			return 0;
+		}
+	}
+	if(optind < argc && load_bank(argv[optind]))
+		return 1;
+	if((fd = open_port(dev, baud)) < 0)
+		return 1;
+	
+	/* tuning first so a program change below plays in it */
+	if(scl || et)
+	{
+		pl[0] = 0;
+		for(i=0;i<128;i++)
+		{
+			pl[1+4*i] = inc[i] & 0xFF;
+			pl[2+4*i] = (inc[i] >> 8) & 0xFF;
+			pl[3+4*i] = (inc[i] >> 16) & 0xFF;
+			pl[4+4*i] = inc[i] >> 24;
+		}
+		t = now_ms();
+		if((st = transact(fd, PROTO_Tuning, seq++, pl, et ? 0 : 1 + 4*128)))
+		{
+			fprintf(stderr, "tuning: %s %d\n", st < 0 ? "no reply" : "error", st);
+			return 1;
+		}
+		printf("tuning %s: %.1f ms\n", et ? "equal temperament" : scl, now_ms() - t);
+	}
+	
+	t0 = now_ms();
+	for(i=0;store && (i<nvoices);i++)
+	{
+		pl[0] = slot + i;
+		memcpy(&pl[1], bank[i], PROTO_Voice_Size);
+		t = now_ms();
+		if((st = transact(fd, PROTO_Store, seq++, pl, 1 + PROTO_Voice_Size)))
+		{
+			fprintf(stderr, "program %d: %s %d\n", slot+i,
+				st < 0 ? "no reply" : "error", st);
+			return 1;
+		}
+		printf("program %d stored: %.1f ms\n", slot+i, now_ms() - t);
+	}
+	for(i=0;!store && (i<nvoices);i+=n)
+	{
+		n = nvoices - i > FRAME_VOICES ? FRAME_VOICES : nvoices - i;
+		pl[0] = slot + i;
+		memcpy(&pl[1], bank[i], n*PROTO_Voice_Size);
+		t = now_ms();
+		st = transact(fd, PROTO_Bank, seq++, pl, 1 + n*PROTO_Voice_Size);
+		if(st)
+		{
+			fprintf(stderr, "slots %d-%d: %s %d\n", slot+i, slot+i+n-1,
+				st < 0 ? "no reply" : "error", st);
+			return 1;
+		}
+		printf("slots %d-%d: %.1f ms\n", slot+i, slot+i+n-1, now_ms() - t);
+	}
+	if(nvoices)
+		printf("%d voices in %.1f ms\n", nvoices, now_ms() - t0);
+	
+	if(prog >= 0)
+	{
+		pl[0] = prog;
+		if((st = transact(fd, PROTO_Program, seq++, pl, 1)))
+		{
+			fprintf(stderr, "program %d: %s %d\n", prog,
+				st < 0 ? "no reply" : "error", st);
+			return 1;
+		}
+		printf("program %d\n", prog);
+	}
+	
+	close(fd);
+	return 0;
+}
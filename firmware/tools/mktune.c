@@ -0,0 +1,92 @@
+/*
+ * mktune.c - host tool to generate the note -> phase increment tables
+ *
+ * Writes fm_tune.h for fm.c: the phase increment of each semitone in the
+ * top octave (MIDI notes 120-131) with fraction bits, and 2^(c/1200) for
+ * c = 0-99 cents. FM_CalcPitch() multiplies the two and shifts down to
+ * the octave, so note-on needs no float maths. The sample rate is what
+ * clkgen.v really runs fm_gen at, 48MHz / 1024.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <math.h>
+
+#define FSAMPLE 46875.0		/* 48MHz / 1024 */
+#define FREQ_BITS 19
+#define FRAC_BITS 8			/* extra bits kept in the semitone table */
+#define CENT_BITS 15		/* u1.15 cent ratios */
+#define TOP_OCTAVE 10		/* MIDI notes 120-131 */
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-a A4 Hz] [-f sample Hz] [-o fm_tune.h]\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	double a4 = 440.0, fs = FSAMPLE, f, inc;
+	const char *out = NULL;
+	FILE *o = stdout;
+	int opt, i;
+	
+	while((opt = getopt(argc, argv, "a:f:o:")) != -1)
+	{
+		switch(opt)
+		{
+			case 'a': a4 = atof(optarg); break;
+			case 'f': fs = atof(optarg); break;
+			case 'o': out = optarg; break;
+			default: usage(argv[0]);
+		}
+	}
+	if(optind != argc || a4 <= 0.0 || fs <= 0.0)
+		usage(argv[0]);
+	
+	/* the table tops out at note 132 */
+	f = a4 * pow(2.0, (12*(TOP_OCTAVE+1) - 69) / 12.0);
+	if(f >= fs/2)
+	{
+		fprintf(stderr, "A4 = %.3f Hz puts the top octave past Nyquist\n", a4);
+		return 1;
+	}
+	if(out && !(o = fopen(out, "w")))
+	{
+		perror(out);
+		return 1;
+	}
+	
+	fprintf(o, "/*\n");
+	fprintf(o, " * fm_tune.h - generated by tools/mktune, do not edit\n");
+	fprintf(o, " * A4 = %.3f Hz, sample rate %.3f Hz\n", a4, fs);
+	fprintf(o, " */\n\n");
+	fprintf(o, "#ifndef __FM_TUNE__\n#define __FM_TUNE__\n\n");
+	fprintf(o, "#define FM_Tune_Frac %d\t\t/* fraction bits in FM_Tune_Semi */\n", FRAC_BITS);
+	fprintf(o, "#define FM_Tune_Cent_Bits %d\t/* FM_Tune_Cent is u1.%d */\n",
+		CENT_BITS, CENT_BITS);
+	fprintf(o, "#define FM_Tune_Top %d\t\t/* octave of FM_Tune_Semi */\n\n", TOP_OCTAVE);
+	
+	fprintf(o, "/* phase increment << FM_Tune_Frac of MIDI notes %d-%d */\n",
+		12*TOP_OCTAVE, 12*TOP_OCTAVE+11);
+	fprintf(o, "static const uint32_t FM_Tune_Semi[12] =\n{");
+	for(i=0;i<12;i++)
+	{
+		f = a4 * pow(2.0, (12*TOP_OCTAVE + i - 69) / 12.0);
+		inc = f * (1<<FREQ_BITS) / fs * (1<<FRAC_BITS);
+		fprintf(o, "%s%lu,", i%6 ? " " : "\n\t", (unsigned long)(inc + 0.5));
+	}
+	fprintf(o, "\n};\n\n");
+	
+	fprintf(o, "/* 2^(cents/1200) */\n");
+	fprintf(o, "static const uint16_t FM_Tune_Cent[100] =\n{");
+	for(i=0;i<100;i++)
+		fprintf(o, "%s%lu,", i%10 ? " " : "\n\t",
+			(unsigned long)(pow(2.0, i / 1200.0) * (1<<CENT_BITS) + 0.5));
+	fprintf(o, "\n};\n\n#endif\n");
+	
+	if(out)
+		fclose(o);
+	return 0;
+}
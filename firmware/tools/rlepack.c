@@ -0,0 +1,113 @@
+/*
+ * rlepack.c - host tool to compress an iCE40 bitstream for the firmware
+ *
+ * Output is a 4-byte little-endian uncompressed length followed by tokens:
+ *   0x00-0x7F : (tok+1) literal bytes follow
+ *   0x80-0xBF : run of (tok&0x3F)+1 zero bytes
+ *   0xC0-0xFF : run of ((tok&0x3F)<<8 | next)+1 zero bytes
+ * Bitstreams are mostly zeros so only zero runs are coded.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#define MAX_LIT 128
+#define MAX_RUN 16384
+
+/* write out pending literals */
+static void flush_lit(FILE *out, uint8_t *lit, int *nlit)
+{
+	int n, i = 0;
+	
+	while(*nlit)
+	{
+		n = *nlit > MAX_LIT ? MAX_LIT : *nlit;
+		fputc(n-1, out);
+		fwrite(&lit[i], 1, n, out);
+		i += n;
+		*nlit -= n;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	FILE *in, *out;
+	uint8_t *buf, *lit;
+	long size, i, j, n, m;
+	int nlit = 0;
+	
+	if(argc != 3)
+	{
+		fprintf(stderr, "usage: %s <in.bin> <out.rle>\n", argv[0]);
+		return 1;
+	}
+	
+	/* slurp input */
+	if(!(in = fopen(argv[1], "rb")))
+	{
+		perror(argv[1]);
+		return 1;
+	}
+	fseek(in, 0, SEEK_END);
+	size = ftell(in);
+	fseek(in, 0, SEEK_SET);
+	buf = malloc(size);
+	lit = malloc(size);
+	if(!buf || !lit || fread(buf, 1, size, in) != (size_t)size)
+	{
+		fprintf(stderr, "%s: read failed\n", argv[1]);
+		return 1;
+	}
+	fclose(in);
+	
+	if(!(out = fopen(argv[2], "wb")))
+	{
+		perror(argv[2]);
+		return 1;
+	}
+	
+	/* header */
+	fputc((size>> 0) & 0xff, out);
+	fputc((size>> 8) & 0xff, out);
+	fputc((size>>16) & 0xff, out);
+	fputc((size>>24) & 0xff, out);
+	
+	/* tokens - single zeros are cheaper as literals */
+	i = 0;
+	while(i < size)
+	{
+		j = i;
+		while(j < size && buf[j] == 0)
+			j++;
+		n = j - i;
+		
+		if(n >= 2)
+		{
+			flush_lit(out, lit, &nlit);
+			while(n)
+			{
+				m = n > MAX_RUN ? MAX_RUN : n;
+				if(m <= 64)
+					fputc(0x80 | (m-1), out);
+				else
+				{
+					fputc(0xC0 | ((m-1)>>8), out);
+					fputc((m-1) & 0xff, out);
+				}
+				n -= m;
+			}
+			i = j;
+		}
+		else
+			lit[nlit++] = buf[i++];
+	}
+	flush_lit(out, lit, &nlit);
+	
+	printf("%s: %ld -> %ld bytes\n", argv[2], size, ftell(out));
+	fclose(out);
+	free(buf);
+	free(lit);
+	
+	return 0;
+}
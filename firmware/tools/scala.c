@@ -0,0 +1,230 @@
+/*
+ * scala.c - Scala .scl / .kbm tunings to fm_gen phase increments
+ *
+ * The scale gives cents above degree 0 of each degree, the last being the
+ * period. The keyboard map picks which MIDI keys are retuned, the key
+ * degree 0 sits on, a reference key & its frequency and the key pattern
+ * that repeats each period. Without a map every key is retuned, degree 0
+ * is on key 60 and key 69 is 440 Hz. Unmapped keys get 0 Hz.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "scala.h"
+
+#define SCALA_MAX 1024		/* degrees in a scale or keys in a map */
+
+/* next line that is not a '!' comment, NULL at the end */
+static char *next_line(FILE *f, char *line, int len, int *lnum)
+{
+	while(fgets(line, len, f))
+	{
+		(*lnum)++;
+		if(line[0] != '!')
+			return line;
+	}
+	return NULL;
+}
+
+/* one scale degree - cents if it has a '.', else a ratio n/d or n */
+static int parse_pitch(const char *s, double *cents)
+{
+	char *end;
+	double n, d = 1.0;
+	
+	s += strspn(s, " \t");
+	if(strchr(s, '.') && (strcspn(s, ".") < strcspn(s, " \t\r\n")))
+	{
+		*cents = strtod(s, &end);
+		return end == s;
+	}
+	n = strtod(s, &end);
+	if(end == s)
+		return 1;
+	if(*end == '/')
+	{
+		s = end + 1;
+		d = strtod(s, &end);
+		if(end == s)
+			return 1;
+	}
+	if(n <= 0.0 || d <= 0.0)
+		return 1;
+	*cents = 1200.0 * log2(n / d);
+	return 0;
+}
+
+/* whole number from a map line */
+static int parse_int(FILE *f, const char *name, char *line, int *lnum, int *v)
+{
+	char *end;
+	
+	if(!next_line(f, line, 256, lnum))
+	{
+		fprintf(stderr, "%s: ends early\n", name);
+		return 1;
+	}
+	*v = strtol(line, &end, 10);
+	if(end == line + strspn(line, " \t"))
+	{
+		fprintf(stderr, "%s:%d: expected a number\n", name, *lnum);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * frequency of every MIDI key - returns 0 if all went well
+ */
+int scala_load(const char *scl, const char *kbm, double hz[128])
+{
+	static double deg[SCALA_MAX+1];
+	static int map[SCALA_MAX];
+	char line[256];
+	FILE *f;
+	int lnum = 0, n, i, size = 0, first = 0, last = 127, mid = 60, ref = 69, oct = 0;
+	int k, d, m;
+	double ref_hz = 440.0, period, ref_cents, c;
+	
+	/* scale */
+	if(!(f = fopen(scl, "r")))
+	{
+		perror(scl);
+		return 1;
+	}
+	if(!next_line(f, line, sizeof(line), &lnum) ||
+		!next_line(f, line, sizeof(line), &lnum))
+	{
+		fprintf(stderr, "%s: no degree count\n", scl);
+		fclose(f);
+		return 1;
+	}
+	n = atoi(line);
+	if(n < 1 || n > SCALA_MAX)
+	{
+		fprintf(stderr, "%s:%d: bad degree count %d\n", scl, lnum, n);
+		fclose(f);
+		return 1;
+	}
+	deg[0] = 0.0;
+	for(i=1;i<=n;i++)
+		if(!next_line(f, line, sizeof(line), &lnum) || parse_pitch(line, &deg[i]))
+		{
+			fprintf(stderr, "%s:%d: bad pitch\n", scl, lnum);
+			fclose(f);
+			return 1;
+		}
+	fclose(f);
+	
+	/* keyboard map, degree 0 to n-1 on consecutive keys by default */
+	if(kbm)
+	{
+		if(!(f = fopen(kbm, "r")))
+		{
+			perror(kbm);
+			return 1;
+		}
+		lnum = 0;
+		if(parse_int(f, kbm, line, &lnum, &size) ||
+			parse_int(f, kbm, line, &lnum, &first) ||
+			parse_int(f, kbm, line, &lnum, &last) ||
+			parse_int(f, kbm, line, &lnum, &mid) ||
+			parse_int(f, kbm, line, &lnum, &ref) ||
+			!next_line(f, line, sizeof(line), &lnum) ||
+			(ref_hz = atof(line)) <= 0.0 ||
+			parse_int(f, kbm, line, &lnum, &oct))
+		{
+			fprintf(stderr, "%s: bad header\n", kbm);
+			fclose(f);
+			return 1;
+		}
+		if(size < 0 || size > SCALA_MAX || oct < 0 || oct > n ||
+			ref < 0 || ref > 127)
+		{
+			fprintf(stderr, "%s: map out of range\n", kbm);
+			fclose(f);
+			return 1;
+		}
+		
+		/* missing entries are unmapped */
+		for(i=0;i<size;i++)
+		{
+			if(!next_line(f, line, sizeof(line), &lnum))
+				map[i] = -1;
+			else if(line[strspn(line, " \t")] == 'x')
+				map[i] = -1;
+			else
+				map[i] = atoi(line);
+		}
+		fclose(f);
+	}
+	if(!size)
+	{
+		size = n;
+		for(i=0;i<n;i++)
+			map[i] = i;
+		oct = n;
+	}
+	
+	/* cents of a key from degree 0, or NAN if unmapped */
+	period = deg[oct ? oct : n];
+	ref_cents = NAN;
+	for(k=0;k<=128;k++)
+	{
+		i = k < 128 ? k : ref;
+		d = i - mid;
+		m = map[((d % size) + size) % size];
+		if(m < 0 || (k < 128 && (i < first || i > last)))
+			c = NAN;
+		else
+		{
+			/* degrees past the scale wrap into the next period */
+			c = floor((double)d / size) * period +
+				floor((double)m / n) * deg[n] + deg[m % n];
+		}
+		
+		if(k < 128)
+			hz[k] = c;
+		else
+			ref_cents = c;
+	}
+	if(isnan(ref_cents))
+	{
+		fprintf(stderr, "%s: reference key %d is unmapped\n", kbm ? kbm : scl, ref);
+		return 1;
+	}
+	
+	for(k=0;k<128;k++)
+		hz[k] = isnan(hz[k]) ? 0.0 : ref_hz * pow(2.0, (hz[k] - ref_cents) / 1200.0);
+	return 0;
+}
+
+/*
+ * 19-bit phase increments - keys at or past Nyquist become 0 as well.
+ * Returns how many were dropped that way.
+ */
+int scala_inc(const double hz[128], uint32_t inc[128])
+{
+	int k, drop = 0;
+	
+	for(k=0;k<128;k++)
+	{
+		if(hz[k] >= SCALA_FSAMPLE/2)
+		{
+			inc[k] = 0;
+			drop++;
+		}
+		else if(hz[k] > 0.0)
+		{
+			/* 0 is unmapped, so the lowest keys round up to 1 */
+			inc[k] = (uint32_t)(hz[k] * (1<<19) / SCALA_FSAMPLE + 0.5);
+			if(!inc[k])
+				inc[k] = 1;
+		}
+		else
+			inc[k] = 0;
+	}
+	return drop;
+}
@@ -0,0 +1,15 @@
+/*
+ * scala.h - Scala .scl / .kbm tunings to fm_gen phase increments
+ */
+
+#ifndef __SCALA__
+#define __SCALA__
+
+#include <stdint.h>
+
+#define SCALA_FSAMPLE 46875.0	/* fm_gen sample rate, 48MHz / 1024 */
+
+int scala_load(const char *scl, const char *kbm, double hz[128]);
+int scala_inc(const double hz[128], uint32_t inc[128]);
+
+#endif
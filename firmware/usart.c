@@ -5,9 +5,21 @@
  
 #include <stdio.h>
 #include "stm32f30x.h"
+#include "usart_ring.h"
 
-uint8_t RX_buffer[256];
-uint8_t *RX_wptr, *RX_rptr;
+/*
+ * console runs fast enough for binary bulk uploads - 72MHz / 1M is an
+ * exact divider so the rate error is zero
+ */
+#define USART_BAUD 1000000
+
+/*
+ * The rings are in usart_ring.c. RX is filled by DMA1 channel 5 in
+ * circular mode - the write index is read back from the DMA counter. The
+ * main loop has to come round at least once per RX_SZ byte times (20ms
+ * at 1Mbaud) or input is lost. TX is drained by DMA1 channel 4 so printf
+ * never waits on the UART, one contiguous run of the ring at a time.
+ */
 
 /* USART1 setup */
 void setup_usart1(void)
@@ -15,10 +27,10 @@ void setup_usart1(void)
 	GPIO_InitTypeDef GPIO_InitStructure;
 	USART_InitTypeDef USART_InitStructure;
 	NVIC_InitTypeDef NVIC_InitStructure;
+	DMA_InitTypeDef DMA_InitStructure;
 
-	/* init RX buffer write/read pointers*/
-	RX_wptr = &RX_buffer[0];
-	RX_rptr = &RX_buffer[0];
+	/* empty rings - TX drops when full */
+	usart_ring_init();
 
 	/* Setup USART */
 	RCC_AHBPeriphClockCmd(RCC_AHBPeriph_GPIOB, ENABLE);
@@ -38,15 +50,14 @@ void setup_usart1(void)
 	GPIO_Init(GPIOB, &GPIO_InitStructure);
 
 	/* Configure USART Rx as alternate function push-pull */
-	/* RX not used */
 	GPIO_InitStructure.GPIO_Pin = GPIO_Pin_7;
 	GPIO_Init(GPIOB, &GPIO_InitStructure);
 
 	/* USART configuration */
 	RCC_APB2PeriphClockCmd(RCC_APB2Periph_USART1, ENABLE);
 
-	/* USART = 115k-8-N-1 */
-	USART_InitStructure.USART_BaudRate = 115200;
+	/* USART = 1M-8-N-1 */
+	USART_InitStructure.USART_BaudRate = USART_BAUD;
 	USART_InitStructure.USART_WordLength = USART_WordLength_8b;
 	USART_InitStructure.USART_StopBits = USART_StopBits_1;
 	USART_InitStructure.USART_Parity = USART_Parity_No;
@@ -54,12 +65,43 @@ void setup_usart1(void)
 	USART_InitStructure.USART_Mode = USART_Mode_Rx | USART_Mode_Tx;
 	USART_Init(USART1, &USART_InitStructure);
 	
-	/* Enable RX interrupt */
-	USART_ITConfig(USART1, USART_IT_RXNE, ENABLE);
-
-	/* Enable the USART6 Interrupt */
-	NVIC_InitStructure.NVIC_IRQChannel = USART1_IRQn;
-	NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 0;
+	/* a late DMA read loses a byte rather than stalling RX on ORE */
+	USART_OverrunDetectionConfig(USART1, USART_OVRDetection_Disable);
+	
+	/* RX DMA - USART -> ring, circular, no interrupts */
+	RCC_AHBPeriphClockCmd(RCC_AHBPeriph_DMA1, ENABLE);
+	DMA_DeInit(DMA1_Channel5);
+	DMA_InitStructure.DMA_PeripheralBaseAddr = (uint32_t)&USART1->RDR;
+	DMA_InitStructure.DMA_MemoryBaseAddr = (uint32_t)RX_buffer;
+	DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralSRC;
+	DMA_InitStructure.DMA_BufferSize = RX_SZ;
+	DMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+	DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
+	DMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
+	DMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_Byte;
+	DMA_InitStructure.DMA_Mode = DMA_Mode_Circular;
+	DMA_InitStructure.DMA_Priority = DMA_Priority_Medium;
+	DMA_InitStructure.DMA_M2M = DMA_M2M_Disable;
+	DMA_Init(DMA1_Channel5, &DMA_InitStructure);
+	USART_DMACmd(USART1, USART_DMAReq_Rx, ENABLE);
+	DMA_Cmd(DMA1_Channel5, ENABLE);
+	
+	/* TX DMA - ring -> USART, address & length set per run */
+	DMA_DeInit(DMA1_Channel4);
+	DMA_InitStructure.DMA_PeripheralBaseAddr = (uint32_t)&USART1->TDR;
+	DMA_InitStructure.DMA_MemoryBaseAddr = (uint32_t)TX_buffer;
+	DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralDST;
+	DMA_InitStructure.DMA_BufferSize = 0;
+	DMA_InitStructure.DMA_Mode = DMA_Mode_Normal;
+	DMA_InitStructure.DMA_Priority = DMA_Priority_Low;
+	DMA_Init(DMA1_Channel4, &DMA_InitStructure);
+	DMA_ITConfig(DMA1_Channel4, DMA_IT_TC, ENABLE);
+	USART_DMACmd(USART1, USART_DMAReq_Tx, ENABLE);
+	
+	/* lowest priority - console output must not hold off SPI or MIDI.
+	   main() sets NVIC_PriorityGroup_2 so 3 is a preemption level. */
+	NVIC_InitStructure.NVIC_IRQChannel = DMA1_Channel4_IRQn;
+	NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 3;
 	NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
 	NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
 	NVIC_Init(&NVIC_InitStructure);
@@ -68,88 +110,33 @@ void setup_usart1(void)
 	USART_Cmd(USART1, ENABLE);
 }
 
-int get_usart(void)
-{
-#if 0
-	/* Non-interrupt version */
-	if(USART_GetFlagStatus(USART6, USART_FLAG_RXNE) == SET)
-		return USART_ReceiveData(USART6);
-	else
-		return EOF;
-#else
-	/* interrupt version */
-	int retval;
-	
-	/* check if there's data in the buffer */
-	if(RX_rptr != RX_wptr)
-	{
-		/* get the data */
-		retval = *RX_rptr++;
-		
-		/* wrap the pointer */
-		if((RX_rptr - &RX_buffer[0])>=256)
-			RX_rptr = &RX_buffer[0];
-	}
-	else
-		retval = EOF;
-
-	return retval;
-#endif
-}
-
-/**
-  * @brief  Retargets the C library printf function to the USART.
-  * @param  None
-  * @retval None
-  */
-int outbyte(int ch)
+/*
+ * RX DMA write index
+ */
+uint32_t usart_rx_wptr(void)
 {
-	/* Place your implementation of fputc here */
-	/* e.g. write a character to the USART */
-	USART_SendData(USART1, (uint8_t) ch);
-
-	/* Loop until transmit data register is empty */
-	while (USART_GetFlagStatus(USART1, USART_FLAG_TXE) == RESET)
-	{}
-
-	return ch;
+	return RX_SZ - DMA_GetCurrDataCounter(DMA1_Channel5);
 }
 
-/**
-  * @brief  Retargets the C library printf function to the USART.
-  * @param  None
-  * @retval None
-  */
-int inbyte(void)
+/*
+ * start DMA on a run of the TX ring. Called with IRQs off.
+ */
+void usart_tx_start(const uint8_t *buf, uint32_t len)
 {
-	/* nothing happening yet */
-	return 0;
+	DMA_Cmd(DMA1_Channel4, DISABLE);
+	DMA1_Channel4->CMAR = (uint32_t)buf;
+	DMA_SetCurrDataCounter(DMA1_Channel4, len);
+	DMA_Cmd(DMA1_Channel4, ENABLE);
 }
 
 /*
- * USART IRQ handler - used only for Rx for now
+ * TX DMA done - retire the run and start the next
  */
-void USART1_IRQHandler(void)
+void DMA1_Channel4_IRQHandler(void)
 {
-	if(USART_GetITStatus(USART1, USART_IT_RXNE) != RESET)
+	if(DMA_GetITStatus(DMA1_IT_TC4) != RESET)
 	{
-		/* get the character */
-		uint8_t rxchar = USART_ReceiveData(USART1);
-
-		/* check if there's room in the buffer */
-		if((RX_wptr != RX_rptr-1) &&
-           (RX_wptr - RX_rptr != 255))
-		{
-			/* Yes - Queue the new char */
-			*RX_wptr++ = rxchar;
-	
-			/* Wrap pointer */
-			if((RX_wptr - &RX_buffer[0])>=256)
-				RX_wptr = &RX_buffer[0];
-		}
+		DMA_ClearITPendingBit(DMA1_IT_GL4);
+		usart_tx_done();
 	}
-
-	if(USART_GetITStatus(USART1, USART_IT_TXE) != RESET)
-	{
-	}
-}
\ No newline at end of file
+}
@@ -10,5 +10,7 @@ void setup_usart1(void);
 int get_usart(void);
 int outbyte(int ch);
 int inbyte(void);
+uint8_t usart_tx_policy(uint8_t block);
+uint32_t usart_tx_dropped(uint8_t clr);
 
 #endif
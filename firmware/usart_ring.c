@@ -0,0 +1,150 @@
+/*
+ * usart_ring.c - console RX & TX rings
+ *
+ * Nothing in here touches the hardware. The transport - usart.c on the
+ * STM32, host/host_hal.c off target - fills the RX ring, sends the TX
+ * runs usart_tx_start() hands it and calls usart_tx_done() as each one
+ * finishes.
+ */
+ 
+#include <stdio.h>
+#include "stm32f30x.h"
+#include "usart.h"
+#include "usart_ring.h"
+
+uint8_t RX_buffer[RX_SZ];
+uint32_t RX_rptr;
+
+uint8_t TX_buffer[TX_SZ];
+volatile uint32_t TX_wptr, TX_rptr, TX_dmalen, TX_dropped;
+uint8_t TX_block;
+
+/*
+ * empty both rings - TX drops when full
+ */
+void usart_ring_init(void)
+{
+	RX_rptr = 0;
+	TX_wptr = TX_rptr = TX_dmalen = TX_dropped = 0;
+	TX_block = 0;
+}
+
+/*
+ * start the next run of the TX ring if idle. Call with IRQs off.
+ */
+static void usart_tx_kick(void)
+{
+	uint32_t rptr = TX_rptr & TX_MSK, len = TX_wptr - TX_rptr;
+	
+	if(TX_dmalen || !len)
+		return;
+	
+	/* stop at the end of the buffer, the rest goes next time */
+	if(len > TX_SZ - rptr)
+		len = TX_SZ - rptr;
+	TX_dmalen = len;
+	usart_tx_start(&TX_buffer[rptr], len);
+}
+
+/*
+ * run sent - retire it and start the next. Called from the transport's
+ * completion interrupt.
+ */
+void usart_tx_done(void)
+{
+	TX_rptr += TX_dmalen;
+	TX_dmalen = 0;
+	usart_tx_kick();
+}
+
+/*
+ * choose what outbyte does with a full ring - drop (0) or wait (1) - and
+ * return the old policy. Waiting must not be used from an interrupt
+ * handler.
+ */
+uint8_t usart_tx_policy(uint8_t block)
+{
+	uint8_t old = TX_block;
+	
+	TX_block = block;
+	return old;
+}
+
+/*
+ * get & optionally clear the count of bytes dropped on a full ring
+ */
+uint32_t usart_tx_dropped(uint8_t clr)
+{
+	uint32_t dropped = TX_dropped;
+	
+	if(clr)
+		TX_dropped = 0;
+	return dropped;
+}
+
+int get_usart(void)
+{
+	int retval;
+	uint32_t wptr = usart_rx_wptr();
+	
+	/* check if there's data in the buffer */
+	if(RX_rptr != wptr)
+	{
+		/* get the data */
+		retval = RX_buffer[RX_rptr++];
+		
+		/* wrap the pointer */
+		if(RX_rptr >= RX_SZ)
+			RX_rptr = 0;
+	}
+	else
+		retval = EOF;
+
+	return retval;
+}
+
+/**
+  * @brief  Retargets the C library printf function to the USART.
+  * @param  None
+  * @retval None
+  */
+int outbyte(int ch)
+{
+	uint32_t primask;
+	
+	/* check & reserve a slot with IRQs off, so printf from an interrupt
+	   can't take the same one */
+	primask = __get_PRIMASK();
+	__disable_irq();
+	while(TX_wptr - TX_rptr >= TX_SZ)
+	{
+		/* full - drop the byte or let the transport retire a run */
+		if(!TX_block)
+		{
+			TX_dropped++;
+			__set_PRIMASK(primask);
+			return ch;
+		}
+		__set_PRIMASK(primask);
+		__disable_irq();
+	}
+	
+	/* queue it & start sending if idle */
+	TX_buffer[TX_wptr & TX_MSK] = ch;
+	TX_wptr++;
+	usart_tx_kick();
+	__set_PRIMASK(primask);
+
+	return ch;
+}
+
+/**
+  * @brief  Retargets the C library printf function to the USART.
+  * @param  None
+  * @retval None
+  */
+int inbyte(void)
+{
+	/* nothing happening yet */
+	return 0;
+}
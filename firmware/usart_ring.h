@@ -0,0 +1,32 @@
+/*
+ * usart_ring.h - console ring internals shared by the usart transports
+ */
+ 
+#ifndef __usart_ring__
+#define __usart_ring__
+
+#include "stm32f30x.h"
+
+/*
+ * RX ring filled by the transport, which reports its write index. TX
+ * ring drained by the transport one contiguous run at a time. TX indexes
+ * are free running and only masked on access.
+ */
+#define RX_SZ 2048
+#define TX_SZ 1024
+#define TX_MSK (TX_SZ-1)
+
+extern uint8_t RX_buffer[RX_SZ];
+extern uint32_t RX_rptr;
+extern uint8_t TX_buffer[TX_SZ];
+extern volatile uint32_t TX_wptr, TX_rptr, TX_dmalen, TX_dropped;
+extern uint8_t TX_block;
+
+void usart_ring_init(void);
+void usart_tx_done(void);
+
+/* supplied by the transport - usart.c on the STM32, host/host_hal.c */
+uint32_t usart_rx_wptr(void);
+void usart_tx_start(const uint8_t *buf, uint32_t len);
+
+#endif
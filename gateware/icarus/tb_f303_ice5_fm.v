@@ -54,6 +54,38 @@ module tb_f303_ice5_fm;
 		end
 	endtask
 		
+	// spi burst write task - 3 words to consecutive regs
+	reg [103:0] bsr;
+	task spi_burst3
+		(
+			input [6:0] addr,
+			input [31:0] wdata0,
+			input [31:0] wdata1,
+			input [31:0] wdata2
+		);
+		begin: spi_burst_task
+			
+			bsr = {1'b0,addr,wdata0,wdata1,wdata2};
+			SPI_CSL = 1'b0;
+			SPI_SCLK = 1'b0;
+			SPI_MOSI = bsr[103];
+			
+			repeat(104)
+			begin
+				#100
+				SPI_SCLK = 1'b1;
+				#100
+				SPI_SCLK = 1'b0;
+				bsr = {bsr[102:0],1'b0};
+				SPI_MOSI = bsr[103];
+			end
+			
+			#100
+			SPI_CSL = 1'b1;
+			#100;
+		end
+	endtask
+		
 	f303_ice5_fm
 		uut(
 			// I2S output
@@ -94,9 +126,7 @@ module tb_f303_ice5_fm;
 		spi_rxtx(1'b1, 7'd00, 32'd0);
 		
 		// write params - assume the defaults are good
-		spi_rxtx(1'b0, 7'd10, 32'b110000); // li, ri ena
-		spi_rxtx(1'b0, 7'd11, 32'd0); // op 0
-		spi_rxtx(1'b0, 7'd12, 32'd1); // write
+		spi_burst3(7'd10, 32'b110000, 32'd0, 32'd1); // li, ri ena, op 0, write
 	
 		// wait for opcnt to cycle
 		#22000
@@ -2,6 +2,24 @@
 // 05-07-16 E. Brombaugh
 
 module f303_ice5_fm(
+`ifdef VERILATOR
+	// simulation clock in place of the HF osc
+	input sim_clk,
+	
+	// probes for the harnesses - register & parameter writes for the
+	// co-sim, the final mix for checking the model
+	output sim_we,
+	output [6:0] sim_addr,
+	output sim_pwe,
+	output [7:0] sim_pwaddr,
+	output sim_commit,
+	output sim_shadow,
+	output sim_smpl,
+	output sim_abank,
+	output [23:0] sim_audio_l,
+	output [23:0] sim_audio_r,
+	
+`endif
 	// I2S output
 	output mclk,
 	output sdout,
@@ -21,17 +39,21 @@ module f303_ice5_fm(
 );
 
 	// This should be unique so firmware knows who it's talking to
-	parameter DESIGN_ID = 32'h13370005;
+	parameter DESIGN_ID = 32'h13370009;
 
 	//------------------------------
 	// Instantiate HF Osc with div 1
 	//------------------------------
 	wire clk;
+`ifdef VERILATOR
+	assign clk = sim_clk;
+`else
 	SB_HFOSC #(.CLKHF_DIV("0b00")) OSCInst0 (
 		.CLKHFEN(1'b1),
 		.CLKHFPU(1'b1),
 		.CLKHF(clk)
 	) /* synthesis ROUTE_THROUGH_FABRIC= 0 */;
+`endif
 	
 	//----------------------------------------------------------------------
 	// reset generator - 4 clocks of high-true reset after coming out of cfg
@@ -62,20 +84,29 @@ module f303_ice5_fm(
 	//------------------------------
 	reg [13:0] cnt_limit_reg;
 	reg [18:0] freq;
-	reg [15:0] gate;
+	reg [127:0] gate;
 	reg [2:0] wv;
 	reg [5:0] ar, dr, rr;
 	reg [4:0] sl;
 	reg [8:0] adj;
 	reg ri, li, mod_en, acc_en, acc_cl, fb_en;
-	reg [6:0] pwaddr;
+	reg [7:0] pwaddr;
+	reg [63:0] pkdata;
+	reg pksel;
+	reg shadow;
+	reg [1:0] mode;
+	reg i2s24;
+	reg [3:0] mix_shift;
+	reg [18:0] vpitch;
+	reg [6:0] vvoice;
+	reg [6:0] vsvoice;
 	always @(posedge clk)
 	begin
 		if(reset)
 		begin
 			cnt_limit_reg <= 14'd2499;	// 1/4 sec blink rate
 			freq <= 19'd11185;			// 1kHz audio freq
-			gate <= 16'd0;
+			gate <= 128'd0;
 			wv <= 3'd0;
 			ar <= 6'd30;
 			dr <= 6'd20;
@@ -88,14 +119,23 @@ module f303_ice5_fm(
 			acc_en <= 1'b0;
 			acc_cl <= 1'b0;
 			fb_en <= 1'b0;
-			pwaddr <= 7'h00;
+			pwaddr <= 8'h00;
+			pkdata <= 64'd0;
+			pksel <= 1'b0;
+			shadow <= 1'b0;
+			mode <= 2'd0;
+			i2s24 <= 1'b0;
+			mix_shift <= 4'd8;			// same level as old 16-bit mix
+			vpitch <= 19'd0;
+			vvoice <= 7'd0;
+			vsvoice <= 7'd0;
 		end
 		else if(we)
 		begin
 			case(addr)
 				7'h01: cnt_limit_reg <= wdat;
 				7'h02: freq <= wdat;
-				7'h03: gate <= wdat;
+				7'h03: gate[31:0] <= wdat;
 				7'h04: wv <= wdat;
 				7'h05: ar <= wdat;
 				7'h06: dr <= wdat;
@@ -104,20 +144,73 @@ module f303_ice5_fm(
 				7'h09: adj <= wdat;
 				7'h0A: {ri,li,mod_en,acc_en,acc_cl,fb_en} <= wdat;
 				7'h0B: pwaddr <= wdat;
+				7'h0C: if(wdat[0]) pksel <= 1'b0;
+				7'h0D: {i2s24,mode,shadow} <= wdat;
+				7'h10: pkdata[31:0] <= wdat;
+				7'h11: pkdata[63:32] <= wdat;
+				7'h12:
+				begin
+					pwaddr <= wdat;
+					pksel <= 1'b1;
+				end
+				7'h13:
+				begin
+					vpitch <= wdat[18:0];
+					vvoice <= wdat[30:24];
+				end
+				7'h14: gate[63:32] <= wdat;
+				7'h15: gate[95:64] <= wdat;
+				7'h16: gate[127:96] <= wdat;
+				7'h17: mix_shift <= wdat;
+				7'h1E: vsvoice <= wdat;
 			endcase
 		end
 	end
 	
 	//------------------------------
-	// FM Parameter Write Enable - stretch to two clocks
+	// FM Parameter word - individual fields or pre-packed from 0x10/0x11
+	//------------------------------
+	wire [63:0] pwdata = pksel ? pkdata :
+	{
+		3'h0,	// [63:61] 3-bit unused
+		1'b0,	//    [60] 1-bit ratio freq (packed only)
+		fb_en,	//    [59] 1-bit feedback enable (only one per algo)
+		acc_cl, //    [58] 1-bit clear accumulator
+		acc_en,	//    [57] 1-bit enable accumlation
+		mod_en,	//    [56] 1-bit enable modulation input 
+		ri,		//    [55] 1-bit right out include
+		li,		//    [54] 1-bit left out include
+		rr,		// [53:48] 6-bit release rate
+		sl,		// [47:43] 5-bit sustain level (attenuation)
+		dr,		// [42:37] 6-bit decay rate
+		ar,		// [36:31] 6-bit attack rate
+		adj,	// [30:22] 9-bit attenuation adjust 
+		wv,		// [21:19] 3-bit waveform
+		freq	//  [18:0] 19-bit base frequency
+	};
+	
+	//------------------------------
+	// FM Parameter Write Enable - single clock so it can only block one of
+	// the two clocks fm_gen has for resyncing the shadow bank each op slot.
+	// strobed by ctrl bit 0 or by writing the packed address at 0x12
 	//------------------------------
-	reg [1:0] pwe_pipe = 2'b00;
 	reg pwe = 1'b0;
 	always @(posedge clk)
-	begin
-		pwe_pipe <= {pwe_pipe[0],((addr == 7'h0C) & wdat[0] & we)};
-		pwe <= |pwe_pipe;
-	end
+		pwe <= ((addr == 7'h0C) & wdat[0] & we) | ((addr == 7'h12) & we);
+	
+	//------------------------------
+	// FM Parameter bank commit - single clock
+	//------------------------------
+	reg commit = 1'b0;
+	always @(posedge clk)
+		commit <= (addr == 7'h0C) & wdat[2] & we;
+	
+	//------------------------------
+	// Voice pitch write - single clock after the register is loaded
+	//------------------------------
+	reg vwe = 1'b0;
+	always @(posedge clk)
+		vwe <= (addr == 7'h13) & we;
 	
 	//------------------------------
 	// FM Reset - stretch to two clocks
@@ -134,13 +227,17 @@ module f303_ice5_fm(
 	// readback
 	//------------------------------
 	wire [63:0] readbus;
+	wire [1:0] pstat;
+	wire [127:0] vsilent;
+	wire [16:0] vquiet_rel, vquiet_held;
+	wire [8:0] vsatten;
 	always @(*)
 	begin
 		case(addr)
 			7'h00: rdat = DESIGN_ID;
 			7'h01: rdat = cnt_limit_reg;
 			7'h02: rdat = freq;
-			7'h03: rdat = gate;
+			7'h03: rdat = gate[31:0];
 			7'h04: rdat = wv;
 			7'h05: rdat = ar;
 			7'h06: rdat = dr;
@@ -149,8 +246,25 @@ module f303_ice5_fm(
 			7'h09: rdat = adj;
 			7'h0A: rdat = {ri,li,mod_en,acc_en,acc_cl,fb_en};
 			7'h0B: rdat = pwaddr;
+			7'h0C: rdat = pstat;
+			7'h0D: rdat = {i2s24,mode,shadow};
 			7'h0E: rdat = readbus[31:0];
 			7'h0F: rdat = readbus[63:32];
+			7'h10: rdat = pkdata[31:0];
+			7'h11: rdat = pkdata[63:32];
+			7'h12: rdat = pwaddr;
+			7'h13: rdat = {1'b0,vvoice,5'h00,vpitch};
+			7'h14: rdat = gate[63:32];
+			7'h15: rdat = gate[95:64];
+			7'h16: rdat = gate[127:96];
+			7'h17: rdat = mix_shift;
+			7'h18: rdat = vsilent[31:0];
+			7'h19: rdat = vsilent[63:32];
+			7'h1A: rdat = vsilent[95:64];
+			7'h1B: rdat = vsilent[127:96];
+			7'h1C: rdat = {vquiet_rel[16],8'h00,vquiet_rel[15:9],7'h00,vquiet_rel[8:0]};
+			7'h1D: rdat = {vquiet_held[16],8'h00,vquiet_held[15:9],7'h00,vquiet_held[8:0]};
+			7'h1E: rdat = {9'h000,vsvoice,7'h00,vsatten};
 			default: rdat = 32'd0;
 		endcase
 	end
@@ -159,20 +273,34 @@ module f303_ice5_fm(
 	wire audio_ena;
 	
 	// FM Generator
-	wire signed [15:0] l_data, r_data;
+	wire signed [23:0] l_data, r_data;
 	fm_gen
 		ufm(.clk(clk), .reset(fm_rst), .ena_smpl(audio_ena),
-			.gate(gate), .frq(freq), .ar(ar), .dr(dr),
-			.sl(sl), .rr(rr), .adj(adj), .wv(wv), .ri(ri), .li(li),
-			.mod_en(mod_en), .acc_en(acc_en), .acc_cl(acc_cl), .fb_en(fb_en),
-			.pwaddr(pwaddr), .pwe(pwe),
-			.audio_l(l_data), .audio_r(r_data),
-			.readbus(readbus));
+			.mode(mode), .gate(gate), .pwdata(pwdata), .pwaddr(pwaddr), .pwe(pwe),
+			.shadow(shadow), .commit(commit), .pstat(pstat),
+			.vwdata(vpitch), .vwaddr(vvoice), .vwe(vwe),
+			.mix_shift(mix_shift), .audio_l(l_data), .audio_r(r_data),
+			.readbus(readbus), .vsilent(vsilent),
+			.vquiet_rel(vquiet_rel), .vquiet_held(vquiet_held),
+			.vsraddr(vsvoice), .vsatten(vsatten));
+	
+`ifdef VERILATOR
+	assign sim_we = we;
+	assign sim_addr = addr;
+	assign sim_pwe = pwe;
+	assign sim_pwaddr = pwaddr;
+	assign sim_commit = commit;
+	assign sim_shadow = shadow;
+	assign sim_smpl = audio_ena;
+	assign sim_abank = pstat[1];
+	assign sim_audio_l = l_data;
+	assign sim_audio_r = r_data;
+`endif
 			
 	// I2S serializer
 	i2s_out
 		ui2s(.clk(clk), .reset(reset),
-			.l_data(l_data), .r_data(r_data),
+			.l_data(l_data), .r_data(r_data), .wide(i2s24),
 			.mclk(mclk), .sdout(sdout), .sclk(sclk), .lrclk(lrck),
 			.load(audio_ena));
 	
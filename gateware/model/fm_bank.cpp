@@ -0,0 +1,401 @@
+// fm_bank.cpp: render every patch of a voice bank to WAV for auditioning
+//
+// A bank is a text file of voice_struct patches as in firmware/fm.h:
+//   voice <name>
+// followed by eight op lines with the operator_struct fields
+//   freq atten wave ar dr sl rr flags
+// Commas and braces are ignored so rows pasted from fm.c work as they are.
+// Negative freqs are ratios, flags are numbers or FM_Flag_ names joined
+// with '|'. '#' and '//' start comments.
+//
+// Each patch is one job on a shared queue. A thread takes the next job,
+// packs the ops as FM_PackOperator does, plays one note through fm_simd
+// and writes <n>_<name>.wav. A table of peak, RMS and clipped samples is
+// printed at the end. Clipping is the mix saturating at the output gain,
+// which at the default shift of 8 is the old 16-bit accumulator overflow.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <time.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <string>
+#include "fm_simd.h"
+
+#define FSAMPLE 46875		// 48MHz / 1024
+#define FW_FSAMPLE 46875.0F	// FM_Fsample the firmware computes with
+#define BLOCK 256			// samples per render call
+#define MAX_JOBS 256		// -j limit
+
+// operator_struct / voice_struct
+struct bank_op
+{
+	float freq;
+	uint16_t atten;
+	uint8_t wave, ar, dr, sl, rr, flags;
+};
+
+struct bank_voice
+{
+	std::string name;
+	bank_op ops[8];
+	
+	// results
+	int32_t peak;
+	double rms;
+	uint32_t clips;
+	bool ok;
+};
+
+// FM_Flag_ bits
+static const struct
+{
+	const char *name;
+	uint8_t bit;
+} flag_names[] =
+{
+	{"FB_EN", 1<<0},
+	{"ACC_CL", 1<<1},
+	{"ACC_EN", 1<<2},
+	{"MOD_EN", 1<<3},
+	{"Left", 1<<4},
+	{"Right", 1<<5},
+};
+
+static std::vector<bank_voice> bank;
+static std::atomic<unsigned> next_job;
+static const char *out_dir = ".";
+static int note = 60, wav_bits = 16, mix_shift = 8;
+static double note_len = 1.0, tail_len = 1.0;
+
+//
+// bank file parsing
+//
+static int parse_flags(char *tok, uint8_t *flags)
+{
+	char *f, *save;
+	unsigned i;
+	
+	*flags = 0;
+	for(f=strtok_r(tok, "|", &save);f;f=strtok_r(NULL, "|", &save))
+	{
+		if(!strncmp(f, "FM_Flag_", 8))
+			f += 8;
+		for(i=0;i<sizeof(flag_names)/sizeof(flag_names[0]);i++)
+			if(!strcmp(f, flag_names[i].name))
+				break;
+		if(i < sizeof(flag_names)/sizeof(flag_names[0]))
+			*flags |= flag_names[i].bit;
+		else if(f[0] >= '0' && f[0] <= '9')
+			*flags |= strtoul(f, NULL, 0) & 0x3F;
+		else
+			return 1;
+	}
+	return 0;
+}
+
+static int parse_op(char *line, bank_op *op)
+{
+	char *tok[8], *save;
+	int i;
+	
+	for(i=0;i<8;i++)
+		if(!(tok[i] = strtok_r(i ? NULL : line, " \t\r\n,{}", &save)))
+			return 1;
+	if(strtok_r(NULL, " \t\r\n,{}", &save))
+		return 1;
+	
+	// C float suffixes are fine, strtof stops at them
+	op->freq = strtof(tok[0], NULL);
+	op->atten = strtoul(tok[1], NULL, 0) & 0x1FF;
+	op->wave = strtoul(tok[2], NULL, 0) & 7;
+	op->ar = strtoul(tok[3], NULL, 0) & 0x3F;
+	op->dr = strtoul(tok[4], NULL, 0) & 0x3F;
+	op->sl = strtoul(tok[5], NULL, 0) & 0x1F;
+	op->rr = strtoul(tok[6], NULL, 0) & 0x3F;
+	return parse_flags(tok[7], &op->flags);
+}
+
+static int load_bank(const char *fname)
+{
+	FILE *f;
+	char line[256], *p, *q, *tok;
+	int lnum = 0, nop = 8;
+	bank_voice *v = NULL;
+	
+	if(!(f = fopen(fname, "r")))
+	{
+		perror(fname);
+		return 1;
+	}
+	
+	while(fgets(line, sizeof(line), f))
+	{
+		lnum++;
+		// cut at whichever comment starts first
+		p = strchr(line, '#');
+		q = strstr(line, "//");
+		if(q && (!p || q < p))
+			p = q;
+		if(p)
+			*p = 0;
+		p = line + strspn(line, " \t\r\n,{}");
+		if(!*p)
+			continue;
+		
+		if(!strncmp(p, "voice", 5) && (p[5] == ' ' || p[5] == '\t'))
+		{
+			if(v && nop != 8)
+				break;
+			bank.push_back(bank_voice());
+			v = &bank.back();
+			tok = strtok(p+5, " \t\r\n");
+			v->name = tok ? tok : "voice";
+			nop = 0;
+		}
+		else if(!v || nop == 8 || parse_op(p, &v->ops[nop++]))
+		{
+			fprintf(stderr, "%s:%d: bad line\n", fname, lnum);
+			fclose(f);
+			return 1;
+		}
+	}
+	fclose(f);
+	
+	if(v && nop != 8)
+	{
+		fprintf(stderr, "%s: voice '%s' has %d ops\n", fname, v->name.c_str(), nop);
+		return 1;
+	}
+	return 0;
+}
+
+//
+// FM_CalcFreq, FM_CalcRatio & FM_PackOperator from firmware/fm.c
+//
+static uint32_t calc_freq(float freq)
+{
+	return (uint32_t)((float)(1<<19) * (freq / FW_FSAMPLE)) & 0x7FFFF;
+}
+
+static uint32_t calc_ratio(float ratio)
+{
+	ratio = ratio * (float)(1<<11) + 0.5F;
+	if(ratio > (float)0xFFFF)
+		return 0xFFFF;
+	return (uint32_t)ratio;
+}
+
+static uint64_t pack_op(const bank_op *op)
+{
+	uint64_t pw;
+	
+	if(op->freq < 0.0F)
+		pw = calc_ratio(-op->freq) | ((uint64_t)1 << 60);
+	else
+		pw = calc_freq(op->freq);
+	
+	pw |= (uint64_t)op->wave << 19;
+	pw |= (uint64_t)op->atten << 22;
+	pw |= (uint64_t)op->ar << 31;
+	pw |= (uint64_t)op->dr << 37;
+	pw |= (uint64_t)op->sl << 43;
+	pw |= (uint64_t)op->rr << 48;
+	
+	// routing flags are in the opposite order from reg 10
+	pw |= (uint64_t)((op->flags>>4) & 1) << 54;
+	pw |= (uint64_t)((op->flags>>5) & 1) << 55;
+	pw |= (uint64_t)((op->flags>>3) & 1) << 56;
+	pw |= (uint64_t)((op->flags>>2) & 1) << 57;
+	pw |= (uint64_t)((op->flags>>1) & 1) << 58;
+	pw |= (uint64_t)(op->flags & 1) << 59;
+	return pw;
+}
+
+//
+// WAV out, 16-bit is the top of the 24-bit bus as i2s_out sends it
+//
+static void put_le(FILE *f, uint32_t v, int bytes)
+{
+	while(bytes--)
+	{
+		fputc(v & 0xFF, f);
+		v >>= 8;
+	}
+}
+
+static void wav_header(FILE *f, uint32_t samples)
+{
+	uint32_t bpf = 2*wav_bits/8;
+	uint32_t len = samples*bpf;
+	
+	fwrite("RIFF", 1, 4, f);
+	put_le(f, 36 + len, 4);
+	fwrite("WAVEfmt ", 1, 8, f);
+	put_le(f, 16, 4);
+	put_le(f, 1, 2);					// PCM
+	put_le(f, 2, 2);					// stereo
+	put_le(f, FSAMPLE, 4);
+	put_le(f, FSAMPLE*bpf, 4);
+	put_le(f, bpf, 2);
+	put_le(f, wav_bits, 2);
+	fwrite("data", 1, 4, f);
+	put_le(f, len, 4);
+}
+
+//
+// one job - a note on voice 0, gate off after note_len, then the tail
+//
+static void render_voice(unsigned idx)
+{
+	bank_voice &v = bank[idx];
+	fm_simd fs(8, 1);
+	uint32_t n_on = note_len*FSAMPLE + 0.5, n = n_on + tail_len*FSAMPLE + 0.5;
+	uint32_t i, j, cnt;
+	int32_t l[BLOCK], r[BLOCK], s;
+	double sq = 0.0;
+	int sh = 24 - wav_bits, k;
+	char fname[1024];
+	FILE *f;
+	
+	for(k=0;k<8;k++)
+		fs.set_op(0, k, pack_op(&v.ops[k]));
+	fs.set_pitch(0, calc_freq(440.0F * powf(2.0F, (note - 69.0F) / 12.0F)));
+	fs.set_mix_shift(mix_shift);
+	
+	snprintf(fname, sizeof(fname), "%s/%04u_%s.wav", out_dir, idx, v.name.c_str());
+	if(!(f = fopen(fname, "wb")))
+	{
+		perror(fname);
+		v.ok = false;
+		return;
+	}
+	wav_header(f, n);
+	
+	v.peak = 0;
+	v.clips = 0;
+	for(i=0;i<n;i+=cnt)
+	{
+		fs.set_gate(0, i < n_on);
+		cnt = n - i < BLOCK ? n - i : BLOCK;
+		if(i < n_on && n_on - i < cnt)
+			cnt = n_on - i;
+		fs.render(l, r, cnt);
+		
+		for(j=0;j<cnt;j++)
+		{
+			put_le(f, (uint32_t)l[j] >> sh, wav_bits/8);
+			put_le(f, (uint32_t)r[j] >> sh, wav_bits/8);
+			
+			// stats over both channels, saturated samples count as clips
+			for(k=0;k<2;k++)
+			{
+				s = k ? r[j] : l[j];
+				if(s == 0x7FFFFF || s == -0x800000)
+					v.clips++;
+				s = s < 0 ? -s : s;
+				if(s > v.peak)
+					v.peak = s;
+				sq += (double)s*s;
+			}
+		}
+	}
+	v.rms = sqrt(sq / (2.0*n));
+	v.ok = !ferror(f);
+	if(fclose(f))
+		v.ok = false;
+}
+
+static void worker(void)
+{
+	unsigned idx;
+	
+	while((idx = next_job++) < bank.size())
+		render_voice(idx);
+}
+
+static double dbfs(double x)
+{
+	return x > 0.0 ? 20.0*log10(x / 0x7FFFFF) : -999.0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-j threads] [-d dir] [-n note] [-l secs] [-t secs]\n"
+		"\t[-g shift] [-b 16|24] bank\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	std::vector<std::thread> threads;
+	unsigned i, jobs = std::thread::hardware_concurrency(), clipped = 0;
+	struct timespec t0, t1;
+	double secs;
+	int c, n, err = 0;
+	
+	while((c = getopt(argc, argv, "j:d:n:l:t:g:b:")) != -1)
+	{
+		switch(c)
+		{
+			case 'j':
+				n = atoi(optarg);
+				if(n < 1 || n > MAX_JOBS)
+					usage(argv[0]);
+				jobs = n;
+				break;
+			case 'd': out_dir = optarg; break;
+			case 'n': note = atoi(optarg) & 0x7F; break;
+			case 'l': note_len = atof(optarg); break;
+			case 't': tail_len = atof(optarg); break;
+			case 'g': mix_shift = atoi(optarg) & 15; break;
+			case 'b':
+				wav_bits = atoi(optarg);
+				if(wav_bits != 16 && wav_bits != 24)
+					usage(argv[0]);
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if(optind != argc-1 || note_len < 0 || tail_len < 0)
+		usage(argv[0]);
+	if(load_bank(argv[optind]))
+		return 1;
+	// hardware_concurrency is 0 when it can't tell
+	if(jobs < 1)
+		jobs = 1;
+	if(jobs > MAX_JOBS)
+		jobs = MAX_JOBS;
+	
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for(i=0;i<jobs;i++)
+		threads.push_back(std::thread(worker));
+	for(i=0;i<jobs;i++)
+		threads[i].join();
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec)*1e-9;
+	
+	printf("%-5s %-24s %8s %8s %7s\n", "#", "voice", "peak dB", "rms dB", "clips");
+	for(i=0;i<bank.size();i++)
+	{
+		bank_voice &v = bank[i];
+		
+		if(!v.ok)
+		{
+			printf("%-5u %-24s  write failed\n", i, v.name.c_str());
+			err = 1;
+			continue;
+		}
+		printf("%-5u %-24s %8.1f %8.1f %7u%s\n", i, v.name.c_str(),
+			dbfs(v.peak), dbfs(v.rms), v.clips, v.clips ? " CLIP" : "");
+		clipped += v.clips != 0;
+	}
+	fprintf(stderr, "%u voices, %u clipped, %.2fs on %u threads\n",
+		(unsigned)bank.size(), clipped, secs, jobs);
+	return err;
+}
@@ -0,0 +1,183 @@
+// fm_bench.cpp: fm_simd throughput benchmark and fm_model cross-check
+//
+// Renders random patches with every op running and reports operators per
+// second. -c renders the same patches, pitches and gates through fm_model
+// as register writes instead and stops at the first sample that differs.
+// The first op of each voice never takes the lane accum so the one
+// difference between the two is out of the way.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "fm_model.h"
+#include "fm_simd.h"
+
+#define FSAMPLE 46875		// 48MHz / 1024
+#define BLOCK 64			// samples per render call
+
+static uint32_t seed = 1;
+
+static uint32_t rnd(uint32_t n)
+{
+	seed = seed*1103515245 + 12345;
+	return (seed>>8) % n;
+}
+
+// random op, audible-ish
+static uint64_t rnd_op(int k)
+{
+	uint64_t mod_en = rnd(2), fb_en = rnd(4) == 0;
+	
+	if(k == 0 && !fb_en)
+		mod_en = 0;
+	return ((uint64_t)rnd(2) << 60) |			// ratio
+		(fb_en << 59) |
+		((uint64_t)rnd(2) << 58) |				// acc_cl
+		((uint64_t)rnd(2) << 57) |				// acc_en
+		(mod_en << 56) |
+		((uint64_t)rnd(2) << 55) |				// ri
+		((uint64_t)rnd(2) << 54) |				// li
+		((uint64_t)rnd(64) << 48) |				// rr
+		((uint64_t)rnd(32) << 43) |				// sl
+		((uint64_t)rnd(64) << 37) |				// dr
+		((uint64_t)rnd(64) << 31) |				// ar
+		((uint64_t)rnd(256) << 22) |			// adj
+		((uint64_t)rnd(8) << 19) |				// wv
+		(rnd(2) ? 0x800 + rnd(0x3000) : rnd(0x20000));
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-v voices] [-p ops/voice] [-s seconds] [-c]\n", name);
+	exit(1);
+}
+
+//
+// same patches through fm_model, gates flipping every 4k samples
+//
+static int compare(int opv, int nvc, int n)
+{
+	fm_simd fs(opv, nvc);
+	fm_model fm;
+	int32_t l[BLOCK], r[BLOCK];
+	int v, k, i, j;
+	uint64_t pw;
+	uint32_t inc;
+	
+	if(opv != 2 && opv != 4 && opv != 6 && opv != 8)
+	{
+		fprintf(stderr, "compare needs 2, 4, 6 or 8 ops/voice\n");
+		return 1;
+	}
+	if(nvc > fm_model::ops/opv)
+	{
+		fprintf(stderr, "compare needs at most %d voices\n", fm_model::ops/opv);
+		return 1;
+	}
+	
+	fm.reset();
+	fm.write(0x0D, (4 - opv/2) << 1);
+	for(v=0;v<nvc;v++)
+	{
+		for(k=0;k<opv;k++)
+		{
+			pw = rnd_op(k);
+			fs.set_op(v, k, pw);
+			fm.write(0x10, pw & 0xFFFFFFFF);
+			fm.write(0x11, pw >> 32);
+			fm.write(0x12, v*opv + k);
+		}
+		inc = 0x80 + rnd(0x4000);
+		fs.set_pitch(v, inc);
+		fm.write(0x13, (v<<24) | inc);
+	}
+	
+	for(i=0;i<n;i+=BLOCK)
+	{
+		// new gates
+		if((i & 4095) == 0)
+		{
+			uint32_t g[4] = {0, 0, 0, 0};
+			
+			for(v=0;v<nvc;v++)
+				if(rnd(3))
+					g[v>>5] |= 1u << (v&31);
+			for(v=0;v<nvc;v++)
+				fs.set_gate(v, (g[v>>5]>>(v&31)) & 1);
+			fm.write(0x03, g[0]);
+			fm.write(0x14, g[1]);
+			fm.write(0x15, g[2]);
+			fm.write(0x16, g[3]);
+		}
+		
+		fs.render(l, r, BLOCK);
+		for(j=0;j<BLOCK;j++)
+		{
+			fm.sample();
+			if(fm.audio_l() != l[j] || fm.audio_r() != r[j])
+			{
+				printf("sample %d differs: model %d %d, simd %d %d\n",
+					i+j, fm.audio_l(), fm.audio_r(), l[j], r[j]);
+				return 1;
+			}
+		}
+	}
+	
+	printf("%d voices x %d ops, %d samples match\n", nvc, opv, n);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int opv = 8, nvc = 32, cmp = 0, opt, v, k, i, n;
+	double secs = 10.0, t, ops;
+	int32_t l[BLOCK], r[BLOCK];
+	
+	while((opt = getopt(argc, argv, "v:p:s:c")) != -1)
+	{
+		switch(opt)
+		{
+			case 'v': nvc = atoi(optarg); break;
+			case 'p': opv = atoi(optarg); break;
+			case 's': secs = atof(optarg); break;
+			case 'c': cmp = 1; break;
+			default: usage(argv[0]);
+		}
+	}
+	if(nvc < 1 || opv < 1 || secs <= 0)
+		usage(argv[0]);
+	n = secs*FSAMPLE;
+	
+	if(cmp)
+		return compare(opv, nvc, n);
+	
+	// all voices keyed so every op does real work
+	fm_simd fs(opv, nvc);
+	for(v=0;v<nvc;v++)
+	{
+		for(k=0;k<opv;k++)
+			fs.set_op(v, k, rnd_op(k));
+		fs.set_pitch(v, 0x80 + rnd(0x4000));
+		fs.set_gate(v, true);
+	}
+	
+	t = now();
+	for(i=0;i<n;i+=BLOCK)
+		fs.render(l, r, BLOCK);
+	t = now() - t;
+	
+	ops = (double)nvc*opv*i / t;
+	printf("%d voices x %d ops, %d samples in %.3f s\n", nvc, opv, i, t);
+	printf("%.1f Mops/s, %.1fx realtime, %.0f ops at %d Hz\n",
+		ops*1e-6, i/(t*FSAMPLE), ops/FSAMPLE, FSAMPLE);
+	return 0;
+}
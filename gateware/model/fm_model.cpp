@@ -0,0 +1,556 @@
+// fm_model.cpp: bit-exact C++ model of f303_ice5_fm / fm_gen
+//
+// Widths and wraparound follow the Verilog expression sizes, including the
+// ones that look odd - they are what the gateware does.
+
+#include <string.h>
+#include "fm_model.h"
+
+// LUT contents - generated from the hex files the RTL loads
+static const uint16_t sintab[256] =
+{
+#include "sintab.inc"
+};
+
+static const uint16_t exptab[256] =
+{
+#include "exptab.inc"
+};
+
+//
+// get_env.v - 5 pipeline stages collapsed to one update
+//
+static inline uint16_t get_env(uint8_t &st, uint16_t &ctr, uint16_t &val,
+	uint32_t ar, uint32_t dr, uint32_t sl, uint32_t rr, uint32_t adj,
+	bool active, bool trig)
+{
+	uint32_t nst, rate, inc, sum, ovfl, mul, vsum, asum;
+	
+	// state machine update & rate select
+	switch(st)
+	{
+		case 0:		// attack
+			nst = (val == 0) ? 1 : 0;
+			rate = ar;
+			break;
+		case 1:		// decay
+			nst = ((uint32_t)(val>>4) >= sl) ? 2 : 1;
+			rate = dr;
+			break;
+		case 2:		// sustain
+			nst = active ? 2 : 3;
+			rate = 0;
+			break;
+		default:	// release
+			nst = trig ? 0 : 3;
+			rate = rr;
+			break;
+	}
+	
+	// 18-bit counter sum, top 3 bits are the step
+	inc = (4 | (rate&3)) << (rate>>2);
+	sum = ctr + inc;
+	ovfl = (sum>>15) & 7;
+	
+	// attack scale - the product is only 9 bits wide in the RTL
+	mul = ((val * ovfl) & 0x1FF) >> 3;
+	
+	// 10-bit value update
+	if(st == 0)
+		vsum = (ovfl == 0) ? val : ((val - (mul + 1)) & 0x3FF);
+	else if(st & 1)
+		vsum = val + ovfl;
+	else
+		vsum = val;
+	asum = (vsum + adj) & 0x3FF;
+	
+	st = nst;
+	ctr = sum & 0x7FFF;
+	val = (vsum <= 511) ? vsum : 511;
+	return (asum <= 511) ? asum : 511;
+}
+
+//
+// get_wave.v - 16-bit log domain waveform
+//
+static inline uint16_t get_wave(uint32_t wv, uint32_t phs)
+{
+	uint32_t p9 = (phs>>9)&1, p8 = (phs>>8)&1, p7 = (phs>>7)&1;
+	uint32_t sign, inv, idx, src, addr;
+	
+	switch(wv)
+	{
+		case 0:		// Full Sine
+			sign = p9; inv = p8; idx = phs&0xFF; src = 0;
+			break;
+		case 1:		// Positive Half Sine + zero
+			sign = 0; inv = p8; idx = phs&0xFF; src = p9;
+			break;
+		case 2:		// Positive Half Sine x 2
+			sign = 0; inv = p8; idx = phs&0xFF; src = 0;
+			break;
+		case 3:		// Positive Quarter Sine + zero x 2
+			sign = 0; inv = p8; idx = phs&0xFF; src = p8;
+			break;
+		case 4:		// Full Sine2F + zero
+			sign = p8; inv = p7; idx = ((phs&0x7F)<<1)|p7; src = p9;
+			break;
+		case 5:		// Positive Half Sine2F x 2 + zero
+			sign = 0; inv = p7; idx = ((phs&0x7F)<<1)|p7; src = p9;
+			break;
+		case 6:		// Square
+			sign = p9; inv = p8; idx = phs&0xFF; src = 2;
+			break;
+		default:	// Expo Saw
+			sign = p9; inv = p9; idx = phs&0xFF; src = 4|(p9^p8);
+			break;
+	}
+	
+	addr = inv ? idx^0xFF : idx;
+	
+	switch(src)
+	{
+		case 0:  return (sign<<15) | sintab[addr];
+		case 1:  return 0x0C00;
+		case 2:  return sign<<15;
+		case 4:  return (sign<<15) | (addr<<3);
+		default: return (sign<<15) | 0x0800 | (addr<<3);
+	}
+}
+
+//
+// exp_conv.v - 12-bit signed linear output
+//
+static inline int32_t exp_conv(uint16_t wave, uint32_t atten)
+{
+	uint16_t sum;
+	uint32_t shift, lin;
+	
+	if(atten == 511)
+		return 0;
+	
+	sum = wave + (atten<<3);
+	shift = (sum>>8) & 0x7F;
+	lin = shift < 12 ? (0x400 | exptab[(sum&0xFF)^0xFF]) >> shift : 0;
+	if(sum & 0x8000)
+		lin ^= 0xFFF;
+	
+	// sign extend
+	return (int32_t)(lin<<20)>>20;
+}
+
+fm_model::fm_model()
+{
+	// block RAMs power up cleared
+	memset(pmem, 0, sizeof(pmem));
+	reset();
+}
+
+void fm_model::reset(void)
+{
+	cnt_limit = 2499;
+	freq = 11185;
+	memset(gate, 0, sizeof(gate));
+	wv = 0;
+	ar = 30;
+	dr = 20;
+	sl = 0;
+	rr = 40;
+	adj = 20;
+	flags = 0;
+	pwaddr = 0;
+	pkdata = 0;
+	pksel = false;
+	shadow = false;
+	mode = 0;
+	cfg_i2s24 = false;
+	mix_shift = 8;
+	vpitch = 0;
+	vvoice = 0;
+	vsvoice = 0;
+	fm_rst();
+}
+
+//
+// fm_gen reset. ramclr takes 256 clocks, assumed done before the next sample.
+//
+void fm_model::fm_rst(void)
+{
+	int i;
+	
+	memset(dgate, 0, sizeof(dgate));
+	memset(ddgate, 0, sizeof(ddgate));
+	abank = 0;
+	cmt_pend = false;
+	rs_arm = false;
+	rs_done = false;
+	memset(pdirty, 0, sizeof(pdirty));
+	rs_need = true;
+	
+	// ramclr only clears the active bank
+	memset(pmem[0], 0, sizeof(pmem[0]));
+	memset(vmem, 0, sizeof(vmem));
+	memset(qmem, 0, sizeof(qmem));
+	for(i=0;i<ops;i++)
+	{
+		s_phs[i] = 0;
+		s_ctr[i] = 0;
+		s_st[i] = 3;
+		s_val[i] = 511;
+	}
+	memset(fmem, 0, sizeof(fmem));
+	
+	mod_acc[0] = mod_acc[1] = 0;
+	acc_l = acc_r = 0;
+	aud_l = aud_r = 0;
+	memset(fb_pend, 0, sizeof(fb_pend));
+	fb_seq = 0;
+	
+	vmin[0] = vmin[1] = 511;
+	for(i=0;i<vcs;i++)
+		vsmem[i] = 511;
+	memset(vsilent, 0xFF, sizeof(vsilent));
+	q_rel = q_held = 0;
+	vquiet_rel = vquiet_held = 0;
+}
+
+//
+// pwe - packed word or the legacy individual fields
+//
+void fm_model::param_write(void)
+{
+	uint64_t pw;
+	
+	if(pksel)
+		pw = pkdata;
+	else
+		pw = ((uint64_t)(flags&0x01) << 59) |		// fb_en
+			((uint64_t)(flags&0x02) << 57) |		// acc_cl
+			((uint64_t)(flags&0x04) << 55) |		// acc_en
+			((uint64_t)(flags&0x08) << 53) |		// mod_en
+			((uint64_t)(flags&0x10) << 50) |		// li
+			((uint64_t)(flags&0x20) << 50) |		// ri
+			((uint64_t)rr << 48) |
+			((uint64_t)sl << 43) |
+			((uint64_t)dr << 37) |
+			((uint64_t)ar << 31) |
+			((uint64_t)adj << 22) |
+			((uint64_t)wv << 19) |
+			freq;
+	
+	pmem[abank^shadow][pwaddr] = pw;
+	if(shadow)
+		pdirty[pwaddr] = 1;
+	else
+		rs_need = true;
+}
+
+void fm_model::write(uint8_t addr, uint32_t data)
+{
+	switch(addr & 0x7F)
+	{
+		case 0x01: cnt_limit = data & 0x3FFF; break;
+		case 0x02: freq = data & 0x7FFFF; break;
+		case 0x03: gate[0] = data; break;
+		case 0x04: wv = data & 7; break;
+		case 0x05: ar = data & 0x3F; break;
+		case 0x06: dr = data & 0x3F; break;
+		case 0x07: sl = data & 0x1F; break;
+		case 0x08: rr = data & 0x3F; break;
+		case 0x09: adj = data & 0x1FF; break;
+		case 0x0A: flags = data & 0x3F; break;
+		case 0x0B: pwaddr = data & 0xFF; break;
+		case 0x0C:
+			// pwe & commit a clock after the write, fm_rst after that
+			if(data & 1)
+			{
+				pksel = false;
+				param_write();
+			}
+			if((data & 4) && shadow)
+				cmt_pend = true;
+			if(data & 2)
+				fm_rst();
+			break;
+		case 0x0D:
+			shadow = data & 1;
+			mode = (data>>1) & 3;
+			cfg_i2s24 = (data>>3) & 1;
+			break;
+		case 0x10: pkdata = (pkdata & 0xFFFFFFFF00000000ULL) | data; break;
+		case 0x11: pkdata = (pkdata & 0xFFFFFFFFULL) | ((uint64_t)data<<32); break;
+		case 0x12:
+			pwaddr = data & 0xFF;
+			pksel = true;
+			param_write();
+			break;
+		case 0x13:
+			vpitch = data & 0x7FFFF;
+			vvoice = (data>>24) & 0x7F;
+			vmem[vvoice] = vpitch;
+			break;
+		case 0x14: gate[1] = data; break;
+		case 0x15: gate[2] = data; break;
+		case 0x16: gate[3] = data; break;
+		case 0x17: mix_shift = data & 0xF; break;
+		case 0x1E: vsvoice = data & 0x7F; break;
+	}
+}
+
+uint32_t fm_model::read(uint8_t addr)
+{
+	switch(addr & 0x7F)
+	{
+		case 0x00: return design_id;
+		case 0x01: return cnt_limit;
+		case 0x02: return freq;
+		case 0x03: return gate[0];
+		case 0x04: return wv;
+		case 0x05: return ar;
+		case 0x06: return dr;
+		case 0x07: return sl;
+		case 0x08: return rr;
+		case 0x09: return adj;
+		case 0x0A: return flags;
+		case 0x0B: return pwaddr;
+		case 0x0C: return (abank<<1) | cmt_pend;
+		case 0x0D: return (cfg_i2s24<<3) | (mode<<1) | shadow;
+		case 0x0E: return readbus & 0xFFFFFFFF;
+		case 0x0F: return readbus >> 32;
+		case 0x10: return pkdata & 0xFFFFFFFF;
+		case 0x11: return pkdata >> 32;
+		case 0x12: return pwaddr;
+		case 0x13: return (vvoice<<24) | vpitch;
+		case 0x14: return gate[1];
+		case 0x15: return gate[2];
+		case 0x16: return gate[3];
+		case 0x17: return mix_shift;
+		case 0x18: return vsilent[0];
+		case 0x19: return vsilent[1];
+		case 0x1A: return vsilent[2];
+		case 0x1B: return vsilent[3];
+		case 0x1C: return ((vquiet_rel & 0x10000)<<15) | ((vquiet_rel & 0xFE00)<<7) | (vquiet_rel & 0x1FF);
+		case 0x1D: return ((vquiet_held & 0x10000)<<15) | ((vquiet_held & 0xFE00)<<7) | (vquiet_held & 0x1FF);
+		case 0x1E: return (vsvoice<<16) | vsmem[vsvoice];
+		default: return 0;
+	}
+}
+
+//
+// one op slot on the fb memory - commit the [v,1] write from 3 slots back
+//
+void fm_model::fb_slot(void)
+{
+	fb_pend_t &p = fb_pend[fb_seq];
+	
+	if(p.vld)
+	{
+		fmem[p.adr] = p.dat;
+		p.vld = false;
+	}
+}
+
+void fm_model::fb_next(void)
+{
+	fb_seq = (fb_seq == 2) ? 0 : fb_seq + 1;
+}
+
+//
+// voice activity, updated with each op's env state - see fm_gen
+//
+void fm_model::vstat(int voice, bool first, bool last, bool carrier,
+	uint32_t atten, bool mgate)
+{
+	int lane = voice & 1;
+	uint32_t op_min = carrier ? atten : 511;
+	uint32_t nxt = (first || op_min < vmin[lane]) ? op_min : vmin[lane];
+	uint32_t &q = mgate ? q_held : q_rel;
+	
+	vmin[lane] = nxt;
+	if(last)
+		vsmem[voice] = nxt;
+	
+	if(first && voice == 0)
+	{
+		// publish last scan, the search regs keep their stale voice & atten
+		vquiet_rel = q_rel;
+		vquiet_held = q_held;
+		q_rel &= 0xFFFF;
+		q_held &= 0xFFFF;
+	}
+	else if(last)
+	{
+		if(nxt == 511)
+			vsilent[voice>>5] |= 1u<<(voice&31);
+		else
+			vsilent[voice>>5] &= ~(1u<<(voice&31));
+		if(!(q & 0x10000) || nxt > (q & 0x1FF))
+			q = 0x10000 | (voice<<9) | nxt;
+	}
+}
+
+//
+// one operator, in scan order
+//
+void fm_model::op(int adr, int voice, bool first, bool last)
+{
+	uint64_t pw = pmem[abank][adr];
+	uint32_t frq = pw & 0x7FFFF;
+	uint32_t p_wv = (pw>>19) & 7;
+	uint32_t p_adj = (pw>>22) & 0x1FF;
+	uint32_t p_ar = (pw>>31) & 0x3F;
+	uint32_t p_dr = (pw>>37) & 0x3F;
+	uint32_t p_sl = (pw>>43) & 0x1F;
+	uint32_t p_rr = (pw>>48) & 0x3F;
+	bool p_li = (pw>>54) & 1;
+	bool p_ri = (pw>>55) & 1;
+	bool p_mod_en = (pw>>56) & 1;
+	bool p_acc_en = (pw>>57) & 1;
+	bool p_acc_cl = (pw>>58) & 1;
+	bool p_fb_en = (pw>>59) & 1;
+	bool p_ratio = (pw>>60) & 1;
+	int lane = voice & 1;
+	bool mgate = (dgate[voice>>5]>>(voice&31)) & 1;
+	bool mtrig = mgate & !((ddgate[voice>>5]>>(voice&31)) & 1);
+	uint32_t o_frq, phs, phsmod, atten, mod_prev;
+	int32_t out, fb_acc;
+	
+	// unused op at rest - only the env counter moves, so skip the rest
+	if(!pw && (s_st[adr] == 3) && (s_val[adr] == 511) && !mtrig)
+	{
+		qmem[adr] = 0;
+		s_ctr[adr] = (s_ctr[adr] + 4) & 0x7FFF;
+		if(first)
+			mod_acc[lane] = 0;
+		vstat(voice, first, last, false, 511, mgate);
+		fb_slot();
+		fb_next();
+		return;
+	}
+	
+	// ratio ops use last sample's product
+	o_frq = p_ratio ? qmem[adr] : frq;
+	qmem[adr] = ((uint64_t)vmem[voice] * (frq & 0xFFFF) >> 11) & 0x7FFFF;
+	
+	// NCO
+	phs = mtrig ? 0 : (s_phs[adr] + o_frq) & 0x7FFFF;
+	s_phs[adr] = phs;
+	
+	// phase modulation from the lane accum or the voice's fb average
+	fb_slot();
+	phsmod = phs >> 9;
+	if(p_mod_en)
+		phsmod += p_fb_en ? fmem[2*voice+1] : mod_acc[lane];
+	phsmod &= 0x3FF;
+	
+	// envelope, wave & expo
+	atten = get_env(s_st[adr], s_ctr[adr], s_val[adr],
+		p_ar, p_dr, p_sl, p_rr, p_adj, mgate, mtrig);
+	out = exp_conv(get_wave(p_wv, phsmod), atten);
+	vstat(voice, first, last, p_li | p_ri, atten, mgate);
+	
+	// modulation accum for the next op of this voice
+	mod_prev = (p_acc_cl | first) ? 0 : mod_acc[lane];
+	mod_acc[lane] = (p_acc_en ? mod_prev + out : mod_prev) & 0x3FF;
+	
+	// fb - [v,0] is visible to the next op, [v,1] lands 3 slots on
+	fb_acc = out + (int16_t)fmem[2*voice];
+	if(p_fb_en)
+	{
+		fmem[2*voice] = fb_acc & 0xFFFF;
+		fb_pend[fb_seq].vld = true;
+		fb_pend[fb_seq].adr = 2*voice+1;
+		fb_pend[fb_seq].dat = (fb_acc>>1) & 0xFFFF;
+	}
+	fb_next();
+	
+	// mix
+	if(p_li)
+		acc_l = (acc_l + out) & 0xFFFFFF;
+	if(p_ri)
+		acc_r = (acc_r + out) & 0xFFFFFF;
+}
+
+//
+// mix gain & 24-bit saturation
+//
+int32_t fm_model::saturate(int32_t mix) const
+{
+	int64_t g = (int64_t)((int32_t)((uint32_t)mix<<8)>>8) << mix_shift;
+	
+	if(g > 0x7FFFFF)
+		return 0x7FFFFF;
+	if(g < -0x800000)
+		return -0x800000;
+	return (int32_t)g;
+}
+
+void fm_model::sample(void)
+{
+	uint32_t opv, pstep, pbase, k, voice, i;
+	int lane, n = 0;
+	
+	// bank swap or resync bookkeeping
+	if(cmt_pend && rs_done)
+	{
+		abank ^= 1;
+		memset(pdirty, 0, sizeof(pdirty));
+		rs_need = true;
+		cmt_pend = false;
+		rs_arm = true;
+		rs_done = false;
+	}
+	else
+	{
+		rs_done = rs_arm;
+		rs_arm = true;
+	}
+	
+	// gate edges
+	for(i=0;i<4;i++)
+	{
+		ddgate[i] = dgate[i];
+		dgate[i] = gate[i];
+	}
+	
+	// dump the last scan
+	aud_l = saturate(acc_l);
+	aud_r = saturate(acc_r);
+	acc_l = acc_r = 0;
+	
+	// scan whole voice pairs with their ops interleaved
+	opv = ((~mode & 3) << 1) | 1;
+	pstep = 2*(opv+1);
+	voice = 0;
+	for(pbase=0;;pbase+=pstep)
+	{
+		for(k=0;k<=opv;k++)
+			for(lane=0;lane<2;lane++)
+			{
+				op(pbase + lane*(opv+1) + k, voice+lane, k==0, k==opv);
+				n++;
+			}
+		voice += 2;
+		if(pbase + 2*pstep > (uint32_t)ops)
+			break;
+	}
+	
+	// the scan copies each active op into the shadow bank unless it was
+	// written since the swap - only worth doing when the active bank moved
+	if(rs_need)
+	{
+		for(i=0;i<(uint32_t)n;i++)
+			if(!pdirty[i])
+				pmem[abank^1][i] = pmem[abank][i];
+		rs_need = n < ops;
+	}
+	if(pwaddr < (uint32_t)n)
+		readbus = pmem[abank][pwaddr];
+	
+	// idle slots until the next sample
+	for(;n<ops;n++)
+	{
+		fb_slot();
+		fb_next();
+	}
+}
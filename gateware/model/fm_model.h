@@ -0,0 +1,102 @@
+// fm_model.h: bit-exact C++ model of f303_ice5_fm / fm_gen
+//
+// Covers the SPI register file of the top level and everything in fm_gen
+// (get_env, get_wave, exp_conv and the sintab/exptab LUTs). One call to
+// sample() is one ena_smpl period of the RTL: the mix dump at the start of
+// the period and the whole op scan. Register writes land between samples.
+// audio_l/r() are what fm_gen's audio regs hold after the dump, i.e. the
+// mix of the previous scan, which is what i2s_out loads at the next
+// ena_smpl. The Verilator harness's -m checks every read and every sample
+// of that mix against the RTL.
+
+#ifndef __FM_MODEL__
+#define __FM_MODEL__
+
+#include <stdint.h>
+
+class fm_model
+{
+public:
+	static const int ops = 256;				// operators in the scan
+	static const int vcs = ops/2;			// max voices
+	static const uint32_t design_id = 0x13370009;
+	
+	fm_model();
+	
+	// top level POR - registers and fm_gen
+	void reset(void);
+	
+	// SPI slave accesses
+	void write(uint8_t addr, uint32_t data);
+	uint32_t read(uint8_t addr);
+	
+	// run one sample period
+	void sample(void);
+	
+	// fm_gen audio outputs, 24-bit signed
+	int32_t audio_l(void) const { return aud_l; }
+	int32_t audio_r(void) const { return aud_r; }
+	
+	// i2s_out frame select
+	bool i2s24(void) const { return cfg_i2s24; }
+	
+private:
+	// top level registers
+	uint32_t cnt_limit, freq, wv, ar, dr, sl, rr, adj, flags;
+	uint32_t gate[4];
+	uint32_t pwaddr;
+	uint64_t pkdata;
+	bool pksel, shadow, cfg_i2s24;
+	uint32_t mode, mix_shift, vpitch, vvoice, vsvoice;
+	
+	// fm_gen sample state
+	uint32_t dgate[4], ddgate[4];
+	uint32_t abank;
+	bool cmt_pend, rs_arm, rs_done;
+	uint8_t pdirty[ops];
+	bool rs_need;							// shadow may differ from active
+	uint64_t readbus;
+	
+	// fm_gen memories
+	uint64_t pmem[2][ops];
+	uint32_t vmem[vcs];
+	uint32_t qmem[ops];
+	uint32_t s_phs[ops];
+	uint16_t s_ctr[ops];
+	uint8_t s_st[ops];
+	uint16_t s_val[ops];
+	uint16_t fmem[2*vcs];
+	
+	// fm_gen op to op state
+	uint32_t mod_acc[2];
+	int32_t acc_l, acc_r;
+	int32_t aud_l, aud_r;
+	
+	// voice activity - loudest carrier per voice, silent bits and the
+	// quietest voice search as {vld,voice,atten}
+	uint16_t vmin[2];
+	uint16_t vsmem[vcs];
+	uint32_t vsilent[4];
+	uint32_t q_rel, q_held;
+	uint32_t vquiet_rel, vquiet_held;
+	
+	// fb [v,1] writes land 3 op slots after the op that makes them
+	struct fb_pend_t
+	{
+		bool vld;
+		uint16_t adr;
+		uint16_t dat;
+	} fb_pend[3];
+	uint32_t fb_seq;						// slot mod 3
+	
+	void fm_rst(void);
+	void param_write(void);
+	void fb_slot(void);
+	void fb_next(void);
+	void op(int adr, int voice, bool first, bool last);
+	void vstat(int voice, bool first, bool last, bool carrier,
+		uint32_t atten, bool mgate);
+	int32_t saturate(int32_t mix) const;
+};
+
+#endif
@@ -0,0 +1,174 @@
+// fm_render.cpp: render register write scripts through fm_model to WAV
+//
+// Script lines, '#' starts a comment:
+//   w <addr> <data>	SPI register write
+//   r <addr>			SPI register read, printed to stdout
+//   s <samples>		render samples
+//   t <seconds>		render seconds
+// Numbers take C syntax (0x.. for hex).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "fm_model.h"
+
+#define FSAMPLE 46875		// 48MHz / 1024
+
+static const char *scr_name;
+static int lnum;
+static FILE *wav;
+static int wav_bits = 16;
+static uint32_t wav_samples;
+
+// little-endian header fields
+static void put_le(uint32_t v, int bytes)
+{
+	while(bytes--)
+	{
+		fputc(v & 0xFF, wav);
+		v >>= 8;
+	}
+}
+
+static void wav_header(void)
+{
+	uint32_t bpf = 2*wav_bits/8;
+	uint32_t len = wav_samples*bpf;
+	
+	fseek(wav, 0, SEEK_SET);
+	fwrite("RIFF", 1, 4, wav);
+	put_le(36 + len, 4);
+	fwrite("WAVEfmt ", 1, 8, wav);
+	put_le(16, 4);
+	put_le(1, 2);					// PCM
+	put_le(2, 2);					// stereo
+	put_le(FSAMPLE, 4);
+	put_le(FSAMPLE*bpf, 4);
+	put_le(bpf, 2);
+	put_le(wav_bits, 2);
+	fwrite("data", 1, 4, wav);
+	put_le(len, 4);
+}
+
+// 16-bit output is the top of the 24-bit bus, as i2s_out sends it
+static void render(fm_model &fm, uint32_t n)
+{
+	int sh = 24 - wav_bits;
+	
+	while(n--)
+	{
+		fm.sample();
+		put_le((uint32_t)fm.audio_l() >> sh, wav_bits/8);
+		put_le((uint32_t)fm.audio_r() >> sh, wav_bits/8);
+		wav_samples++;
+	}
+}
+
+// next script token
+static char *arg(void)
+{
+	char *tok = strtok(NULL, " \t\r\n");
+	
+	if(!tok)
+	{
+		fprintf(stderr, "%s:%d: missing argument\n", scr_name, lnum);
+		exit(1);
+	}
+	return tok;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-b 16|24] [-o out.wav] script\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *out = "fm_render.wav";
+	char line[256], *tok;
+	FILE *scr;
+	fm_model *fm;
+	int c;
+	uint32_t addr, data;
+	clock_t t0;
+	double secs;
+	
+	while((c = getopt(argc, argv, "b:o:")) != -1)
+	{
+		switch(c)
+		{
+			case 'b':
+				wav_bits = atoi(optarg);
+				if(wav_bits != 16 && wav_bits != 24)
+					usage(argv[0]);
+				break;
+			case 'o':
+				out = optarg;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if(optind != argc-1)
+		usage(argv[0]);
+	
+	scr_name = argv[optind];
+	if(!(scr = fopen(scr_name, "r")))
+	{
+		perror(scr_name);
+		return 1;
+	}
+	if(!(wav = fopen(out, "wb")))
+	{
+		perror(out);
+		return 1;
+	}
+	wav_header();
+	
+	fm = new fm_model;
+	t0 = clock();
+	while(fgets(line, sizeof(line), scr))
+	{
+		lnum++;
+		if((tok = strchr(line, '#')))
+			*tok = 0;
+		if(!(tok = strtok(line, " \t\r\n")))
+			continue;
+		
+		switch(tok[0])
+		{
+			case 'w':
+				addr = strtoul(arg(), NULL, 0);
+				data = strtoul(arg(), NULL, 0);
+				fm->write(addr, data);
+				break;
+			case 'r':
+				addr = strtoul(arg(), NULL, 0);
+				printf("%d: reg 0x%02x = 0x%08x\n", lnum, addr, fm->read(addr));
+				break;
+			case 's':
+				render(*fm, strtoul(arg(), NULL, 0));
+				break;
+			case 't':
+				render(*fm, atof(arg())*FSAMPLE + 0.5);
+				break;
+			default:
+				fprintf(stderr, "%s:%d: unknown command '%s'\n",
+					scr_name, lnum, tok);
+				return 1;
+		}
+	}
+	secs = (double)(clock() - t0) / CLOCKS_PER_SEC;
+	
+	wav_header();
+	fclose(wav);
+	fclose(scr);
+	delete fm;
+	
+	fprintf(stderr, "%s: %u samples in %.2fs (%.1fx real time)\n", out,
+		wav_samples, secs, secs > 0 ? wav_samples/(secs*FSAMPLE) : 0.0);
+	return 0;
+}
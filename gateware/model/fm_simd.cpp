@@ -0,0 +1,262 @@
+// fm_simd.cpp: vectorized software renderer for the fm_gen algorithm
+//
+// Every lane loop below is branch-free so it vectorizes - selects instead
+// of ifs, table reads as gathers. Build with -O3 and the target's SIMD
+// flags (-mavx2, or NEON on ARM) and check with -fopt-info-vec.
+
+#include <stdlib.h>
+#include <string.h>
+#include "fm_simd.h"
+
+#define L FM_LANES
+
+// lane select, c is 0 or 1 - plain arithmetic so gcc keeps it in vectors
+static inline int32_t sel(int32_t c, int32_t a, int32_t b)
+{
+	return b ^ ((a ^ b) & -c);
+}
+
+// LUT contents - generated from the hex files the RTL loads
+static const int32_t sintab[256] =
+{
+#include "sintab.inc"
+};
+
+static const int32_t exptab[256] =
+{
+#include "exptab.inc"
+};
+
+fm_simd::fm_simd(int ops_per_voice, int voices)
+{
+	int i, l;
+	
+	opv = ops_per_voice;
+	nvc = voices;
+	nblk = (voices + L - 1) / L;
+	ob = (op_blk *)aligned_alloc(32, nblk*opv*sizeof(op_blk));
+	vb = (vc_blk *)aligned_alloc(32, nblk*sizeof(vc_blk));
+	memset(ob, 0, nblk*opv*sizeof(op_blk));
+	memset(vb, 0, nblk*sizeof(vc_blk));
+	
+	// ops start released at max atten like smem after ramclr
+	for(i=0;i<nblk*opv;i++)
+		for(l=0;l<L;l++)
+		{
+			ob[i].st[l] = 3;
+			ob[i].val[l] = 511;
+		}
+	
+	mix_shift = 8;
+	acc_l = acc_r = 0;
+}
+
+fm_simd::~fm_simd()
+{
+	free(ob);
+	free(vb);
+}
+
+void fm_simd::set_op(int voice, int op, uint64_t pw)
+{
+	op_blk &o = ob[(voice/L)*opv + op];
+	int l = voice % L;
+	
+	o.frq[l] = pw & 0x7FFFF;
+	o.wv[l] = (pw>>19) & 7;
+	o.adj[l] = (pw>>22) & 0x1FF;
+	o.ar[l] = (pw>>31) & 0x3F;
+	o.dr[l] = (pw>>37) & 0x3F;
+	o.sl[l] = (pw>>43) & 0x1F;
+	o.rr[l] = (pw>>48) & 0x3F;
+	o.li[l] = (pw>>54) & 1;
+	o.ri[l] = (pw>>55) & 1;
+	o.mod_en[l] = (pw>>56) & 1;
+	o.acc_en[l] = (pw>>57) & 1;
+	o.acc_cl[l] = (pw>>58) & 1;
+	o.fb_en[l] = (pw>>59) & 1;
+	o.ratio[l] = (pw>>60) & 1;
+}
+
+void fm_simd::set_pitch(int voice, uint32_t inc)
+{
+	vb[voice/L].pitch[voice%L] = inc & 0x7FFFF;
+}
+
+void fm_simd::set_gate(int voice, bool on)
+{
+	vb[voice/L].gate[voice%L] = on;
+}
+
+//
+// one sample of FM_LANES voices
+//
+void fm_simd::sample(vc_blk &v, op_blk *o)
+{
+	int32_t mgate[L], trig[L];
+	int k, l;
+	
+	// gate edges, voice accums
+	for(l=0;l<L;l++)
+	{
+		v.ddgate[l] = v.dgate[l];
+		v.dgate[l] = v.gate[l];
+		mgate[l] = v.dgate[l];
+		trig[l] = v.dgate[l] & ~v.ddgate[l];
+		v.mod[l] = 0;
+		v.mix_l[l] = 0;
+		v.mix_r[l] = 0;
+	}
+	
+	for(k=0;k<opv;k++)
+	{
+		op_blk &p = o[k];
+		int32_t first = (k == 0);
+		int32_t phsmod[L], atten[L], out[L];
+		
+		// ratio ops use last sample's product. pitch x ratio is 35 bits
+		// so the ratio is split to keep it in 32-bit lanes.
+		for(l=0;l<L;l++)
+		{
+			int32_t frq = p.frq[l], q = p.q[l], fb1 = v.fb1[l];
+			int32_t a, b, phs, modin;
+			
+			a = v.pitch[l] * (frq & 0xFF);
+			b = v.pitch[l] * ((frq>>8) & 0xFF);
+			p.q[l] = ((b + (a>>8)) >> 3) & 0x7FFFF;
+			
+			// NCO
+			phs = (p.phs[l] + (p.ratio[l] ? q : frq)) & 0x7FFFF;
+			phs = trig[l] ? 0 : phs;
+			p.phs[l] = phs;
+			
+			// fb average lands two ops of the voice after it's made
+			fb1 = v.pend2_vld[l] ? v.pend2[l] : fb1;
+			v.fb1[l] = fb1;
+			modin = p.fb_en[l] ? fb1 : v.mod[l];
+			phsmod[l] = ((phs>>9) + (p.mod_en[l] ? modin : 0)) & 0x3FF;
+		}
+		
+		// get_env
+		for(l=0;l<L;l++)
+		{
+			int32_t st = p.st[l], val = p.val[l];
+			int32_t ar = p.ar[l], dr = p.dr[l], rr = p.rr[l];
+			int32_t s0 = (st == 0), s1 = (st == 1), s2 = (st == 2);
+			int32_t rate, nst, sum, ovfl, mul, vsum, asum;
+			
+			rate = sel(s0, ar, sel(s1, dr, sel(s2, 0, rr)));
+			nst = sel(s0, (val == 0), sel(s1, 1 + ((val>>4) >= p.sl[l]),
+				sel(s2, 3 - mgate[l], 3 - 3*trig[l])));
+			sum = p.ctr[l] + ((4 | (rate&3)) << (rate>>2));
+			ovfl = sum >> 15;
+			mul = ((val * ovfl) & 0x1FF) >> 3;
+			vsum = sel(s0, sel(ovfl != 0, (val - mul - 1) & 0x3FF, val),
+				val + (ovfl & -(st & 1)));
+			asum = (vsum + p.adj[l]) & 0x3FF;
+			p.st[l] = nst;
+			p.ctr[l] = sum & 0x7FFF;
+			p.val[l] = sel(vsum > 511, 511, vsum);
+			atten[l] = sel(asum > 511, 511, asum);
+		}
+		
+		// get_wave & exp_conv
+		for(l=0;l<L;l++)
+		{
+			int32_t ph = phsmod[l], wv = p.wv[l];
+			int32_t p9, p8, p7, dbl, idx, inv, sign, src, addr, lut, wave;
+			int32_t esum, sh, lin;
+			
+			p9 = (ph>>9) & 1;
+			p8 = (ph>>8) & 1;
+			p7 = (ph>>7) & 1;
+			dbl = (wv == 4) | (wv == 5);
+			idx = sel(dbl, ((ph&0x7F)<<1) | p7, ph & 0xFF);
+			inv = sel(dbl, p7, sel(wv == 7, p9, p8));
+			sign = sel((wv == 0) | (wv == 6) | (wv == 7), p9, p8 & (wv == 4));
+			src = sel(wv == 6, 2, sel(wv == 7, 4 | (p9^p8),
+				sel((wv == 1) | dbl, p9, p8 & (wv == 3))));
+			addr = idx ^ (0xFF & -inv);
+			lut = sintab[addr];
+			wave = sel(src == 0, lut, sel(src == 1, 0x0C00, sel(src == 2, 0,
+				((src & 1) << 11) | (addr<<3))));
+			wave |= sel(src == 1, 0, sign<<15);
+			
+			esum = (wave + (atten[l]<<3)) & 0xFFFF;
+			sh = (esum>>8) & 0x7F;
+			lin = (0x400 | exptab[(esum&0xFF)^0xFF]) >> (sh & 15);
+			lin = sel(sh < 12, lin, 0) ^ (0xFFF & -(esum>>15));
+			out[l] = sel(atten[l] == 511, 0, (lin<<20)>>20);
+		}
+		
+		// modulation accum, fb and mix
+		for(l=0;l<L;l++)
+		{
+			int32_t fb_en = p.fb_en[l], fb0 = v.fb0[l], prev, fb_acc;
+			
+			prev = (p.acc_cl[l] | first) ? 0 : v.mod[l];
+			v.mod[l] = (p.acc_en[l] ? prev + out[l] : prev) & 0x3FF;
+			
+			fb_acc = out[l] + fb0;
+			v.pend2[l] = v.pend1[l];
+			v.pend2_vld[l] = v.pend1_vld[l];
+			v.pend1[l] = ((fb_acc>>1)<<16)>>16;
+			v.pend1_vld[l] = fb_en;
+			v.fb0[l] = fb_en ? ((fb_acc<<16)>>16) : fb0;
+			
+			v.mix_l[l] += p.li[l] ? out[l] : 0;
+			v.mix_r[l] += p.ri[l] ? out[l] : 0;
+		}
+	}
+	
+	// fb writes still in flight land before the next sample
+	for(l=0;l<L;l++)
+	{
+		v.fb1[l] = v.pend2_vld[l] ? v.pend2[l] : v.fb1[l];
+		v.fb1[l] = v.pend1_vld[l] ? v.pend1[l] : v.fb1[l];
+		v.pend1_vld[l] = v.pend2_vld[l] = 0;
+	}
+}
+
+//
+// mix gain & 24-bit saturation as in fm_gen
+//
+int32_t fm_simd::saturate(int32_t mix) const
+{
+	int64_t g = (int64_t)((int32_t)((uint32_t)mix<<8)>>8) << mix_shift;
+	
+	if(g > 0x7FFFFF)
+		return 0x7FFFFF;
+	if(g < -0x800000)
+		return -0x800000;
+	return (int32_t)g;
+}
+
+//
+// output lags the ops by one sample as fm_gen's does
+//
+void fm_simd::render(int32_t *l, int32_t *r, int n)
+{
+	int i, b, j;
+	
+	for(i=0;i<n;i++)
+	{
+		if(l)
+			l[i] = saturate(acc_l);
+		if(r)
+			r[i] = saturate(acc_r);
+		acc_l = acc_r = 0;
+		
+		for(b=0;b<nblk;b++)
+		{
+			sample(vb[b], &ob[b*opv]);
+			for(j=0;j<L;j++)
+			{
+				acc_l += vb[b].mix_l[j];
+				acc_r += vb[b].mix_r[j];
+			}
+		}
+		acc_l &= 0xFFFFFF;
+		acc_r &= 0xFFFFFF;
+	}
+}
@@ -0,0 +1,73 @@
+// fm_simd.h: vectorized software renderer for the fm_gen algorithm
+//
+// Same log-sine / exp table engine as fm_gen - the eight get_wave waves,
+// get_env envelopes, routing flags, ratio ops and feedback - but with
+// voices independent of each other so a block of FM_LANES voices runs one
+// op at a time through straight-line lane loops the compiler turns into
+// SSE/AVX/NEON code. Ops are packed parameter words in the pmem format.
+//
+// Output matches fm_model for the same patches, pitches and gates with one
+// exception: in fm_gen the first op of a voice sees the modulation accum
+// left by the voice before it in the scan. Here it sees zero.
+
+#ifndef __FM_SIMD__
+#define __FM_SIMD__
+
+#include <stdint.h>
+
+#define FM_LANES 8
+
+class fm_simd
+{
+public:
+	fm_simd(int ops_per_voice, int voices);
+	~fm_simd();
+	
+	int ops_per_voice(void) const { return opv; }
+	int voices(void) const { return nvc; }
+	
+	// voice setup
+	void set_op(int voice, int op, uint64_t pw);
+	void set_pitch(int voice, uint32_t inc);
+	void set_gate(int voice, bool on);
+	void set_mix_shift(int shift) { mix_shift = shift & 15; }
+	
+	// render 24-bit samples, l & r may be null
+	void render(int32_t *l, int32_t *r, int n);
+	
+private:
+	// one op of FM_LANES voices
+	struct op_blk
+	{
+		int32_t frq[FM_LANES], wv[FM_LANES], adj[FM_LANES];
+		int32_t ar[FM_LANES], dr[FM_LANES], sl[FM_LANES], rr[FM_LANES];
+		int32_t li[FM_LANES], ri[FM_LANES], mod_en[FM_LANES];
+		int32_t acc_en[FM_LANES], acc_cl[FM_LANES], fb_en[FM_LANES];
+		int32_t ratio[FM_LANES];
+		int32_t phs[FM_LANES], ctr[FM_LANES], st[FM_LANES];
+		int32_t val[FM_LANES], q[FM_LANES];
+	} __attribute__((aligned(32)));
+	
+	// per voice state of FM_LANES voices
+	struct vc_blk
+	{
+		int32_t pitch[FM_LANES], gate[FM_LANES];
+		int32_t dgate[FM_LANES], ddgate[FM_LANES];
+		int32_t mod[FM_LANES];
+		int32_t fb0[FM_LANES], fb1[FM_LANES];
+		int32_t pend1[FM_LANES], pend1_vld[FM_LANES];
+		int32_t pend2[FM_LANES], pend2_vld[FM_LANES];
+		int32_t mix_l[FM_LANES], mix_r[FM_LANES];
+	} __attribute__((aligned(32)));
+	
+	int opv, nvc, nblk;
+	op_blk *ob;
+	vc_blk *vb;
+	int mix_shift;
+	int32_t acc_l, acc_r;
+	
+	void sample(vc_blk &v, op_blk *o);
+	int32_t saturate(int32_t mix) const;
+};
+
+#endif
@@ -2,49 +2,53 @@
 // 2016-06-01 E. Brombaugh
 
 module fm_gen(clk, reset, ena_smpl,
-		gate, frq, ar, dr, 
-		sl, rr, adj, wv, ri, li,
-		mod_en, acc_en, acc_cl, fb_en,
-		pwaddr, pwe,
-		audio_l, audio_r,
-		readbus);
+		mode, gate, pwdata, pwaddr, pwe, shadow, commit, pstat,
+		vwdata, vwaddr, vwe,
+		mix_shift, audio_l, audio_r,
+		readbus, vsilent, vquiet_rel, vquiet_held, vsraddr, vsatten);
 	parameter fsz = 19;				// Bits in freq word
 	parameter rsz = 6;				// Bits in rate word
 	parameter lsz = 5;				// Bits in level word
 	parameter asz = 9;				// Bits in atten word
 	parameter csz = 15;				// Bits in counter word
-	parameter osz = 7;				// Bits in operator address
-	parameter ops = 128;			// number of operators
+	parameter osz = 8;				// Bits in operator address
+	parameter ops = 256;			// number of operators - multiple of 16
+	parameter vsz = osz-1;			// Bits in voice address
+	parameter vcs = ops/2;			// max number of voices (2-op)
+	parameter msz = 24;				// Bits in mix bus and audio out
 	
 	input clk;						// Main system clock
 	input reset;					// POR
 	input ena_smpl;					// sample clock enable
-	input [15:0] gate;				// Envelope start/stop (keydown)
-	input [fsz-1:0] frq;			// param in - Frequency word
-	input [rsz-1:0] ar, dr, rr;		// param in - attack, decay, release rates
-	input [lsz-1:0] sl;				// param in - sustain level
-	input [asz-1:0] adj;			// param in - attenuation adjust
-	input [2:0] wv;					// param in - waveform select
-	input ri;						// param in - right out include
-	input li;						// param in - left out include
-	input mod_en;					// param in - enable modulation input 
-	input acc_en;					// param in - enable accumlation
-	input acc_cl; 					// param in - clear accumulator
-	input fb_en;					// param in - feedback enable (only one per algo)
-	input [6:0] pwaddr;				// op address for parameter write
+	input [1:0] mode;				// ops per voice - 0:8, 1:6, 2:4, 3:2
+	input [vcs-1:0] gate;			// Envelope start/stop (keydown)
+	input [63:0] pwdata;			// packed parameter word for write
+	input [osz-1:0] pwaddr;			// op address for parameter write
 	input pwe;						// parameter write strobe
-	output signed [15:0] audio_l;	// final audio out
-	output signed [15:0] audio_r;	// final audio out
+	input shadow;					// parameter writes go to shadow bank
+	input commit;					// swap shadow bank in at next sample
+	output [1:0] pstat;				// param status - {active bank, commit pending}
+	input [fsz-1:0] vwdata;			// voice pitch (base phase increment)
+	input [vsz-1:0] vwaddr;			// voice address for pitch write
+	input vwe;						// voice pitch write strobe
+	input [3:0] mix_shift;			// mix gain - 8 matches old 16-bit level
+	output signed [msz-1:0] audio_l;	// final audio out
+	output signed [msz-1:0] audio_r;	// final audio out
 	output [63:0] readbus;			// parameter diagnostic
+	output [vcs-1:0] vsilent;		// voices with all carriers at max atten
+	output [16:0] vquiet_rel;		// {vld,voice,atten} quietest gated-off voice
+	output [16:0] vquiet_held;		// {vld,voice,atten} quietest gated-on voice
+	input [vsz-1:0] vsraddr;		// voice for loudest carrier readback
+	output [asz-1:0] vsatten;		// loudest carrier atten of that voice
 	
 	// trigger edge detector
-	reg [15:0] dgate, ddgate;
+	reg [vcs-1:0] dgate, ddgate;
 	always @(posedge clk)
 	begin
 		if(reset)
 		begin
-			dgate <= 16'b0;
-			ddgate <= 16'b0;
+			dgate <= {vcs{1'b0}};
+			ddgate <= {vcs{1'b0}};
 		end
 		else
 		begin
@@ -55,97 +59,228 @@ module fm_gen(clk, reset, ena_smpl,
 			end
 		end
 	end
-	wire [15:0] trig = dgate & ~ddgate;
+	wire [vcs-1:0] trig = dgate & ~ddgate;
 	
-	// syncable 1/8 enable generator and op counter
-	reg [2:0] enacnt;
-	reg ena_8;
-	reg [9:0] ena_8d;
-	reg [osz-1:0] opcnt, opcnt_d;
+	// syncable 1/4 enable generator and op scan. Ops take 4 clocks but an
+	// op's output isn't ready until 9 clocks after it starts, so voices are
+	// scanned in pairs with their ops interleaved - each op sees the
+	// previous op of its own voice 8 clocks back. The number of ops per
+	// voice is latched at the start of each scan, which covers as many
+	// whole voice pairs as fit and then stops until the next sample.
+	reg [1:0] enacnt;
+	reg ena_4, run;
+	reg [12:0] ena_d;
+	reg [2:0] opv;						// ops per voice - 1
+	reg [2:0] opk;						// op within voice
+	reg lane;							// voice within pair
+	reg [osz:0] pbase;					// 1st op address of voice pair
+	reg [vsz-2:0] pidx;					// voice pair
+	reg [osz-1:0] opadr, opadr_d, opadr_dd;
+	reg [vsz-1:0] voice, voice_d, voice_dd;	// voice, lsb is lane
+	reg first_d, first_dd;
+	reg last_d;
 	reg ramclr;
+	
+	// next op in the scan
+	wire [4:0] pstep = {opv,1'b0} + 5'd2;	// ops per voice pair
+	wire pair_end = lane & (opk == opv);
+	wire nxt_lane = ~lane;
+	wire [2:0] nxt_opk = pair_end ? 3'd0 : (lane ? opk + 3'd1 : opk);
+	wire [osz:0] nxt_pbase = pair_end ? pbase + pstep : pbase;
+	wire [vsz-2:0] nxt_pidx = pair_end ? pidx + 1'b1 : pidx;
+	wire [osz:0] nxt_adr = nxt_pbase + (nxt_lane ? opv + 1'b1 : 1'b0) + nxt_opk;
+	
+	// last op issued when the pair after the next one won't fit
+	wire last_op = nxt_lane & (nxt_opk == opv) &
+		((nxt_pbase + {pstep,1'b0}) > ops);
+	
 	always @(posedge clk)
 	begin
 		if(reset)
 		begin
-			enacnt <= 3'b000;
-			ena_8 <= 1'b1;
-			ena_8d <= 10'h000;
-			opcnt <= 7'h00;
-			opcnt_d <= 7'h00;
+			enacnt <= 2'b00;
+			ena_4 <= 1'b0;
+			run <= 1'b0;
+			ena_d <= 13'h0000;
+			opv <= 3'd7;
+			opk <= 3'd0;
+			lane <= 1'b0;
+			pbase <= {osz+1{1'b0}};
+			pidx <= {vsz-1{1'b0}};
+			opadr <= {osz{1'b0}};
+			opadr_d <= {osz{1'b0}};
+			opadr_dd <= {osz{1'b0}};
+			voice <= {vsz{1'b0}};
+			voice_d <= {vsz{1'b0}};
+			voice_dd <= {vsz{1'b0}};
+			first_d <= 1'b0;
+			first_dd <= 1'b0;
+			last_d <= 1'b0;
 			ramclr <= 1'b1;
 		end
 		else
 		begin
 			if(ramclr)
 			begin
-				opcnt <= opcnt + 7'd1;
-				if(opcnt == 7'd127)
+				opadr <= opadr + 1'b1;
+				if(opadr == ops-1)
 					ramclr <= 1'b0;
 			end
 			else
 			begin
 				if(ena_smpl)
 				begin
-					enacnt <= 3'b001;
-					ena_8 <= 1'b0;
-					opcnt <= 7'h00;
+					// op 0 of voice 0 starts with the sample
+					enacnt <= 2'b01;
+					ena_4 <= 1'b0;
+					run <= 1'b1;
+					opv <= {~mode,1'b1};
+					opk <= 3'd0;
+					lane <= 1'b0;
+					pbase <= {osz+1{1'b0}};
+					pidx <= {vsz-1{1'b0}};
+					opadr <= {osz{1'b0}};
+					voice <= {vsz{1'b0}};
 				end
 				else
 				begin
-					enacnt <= enacnt + 3'd1;
+					enacnt <= enacnt + 2'd1;
 				
-					if(enacnt == 3'b111)
-						ena_8 <= 1'b1;
+					if((enacnt == 2'b11) & run)
+						ena_4 <= 1'b1;
 					else
-						ena_8 <= 1'b0;
+						ena_4 <= 1'b0;
 								
-					if(ena_8)
-						opcnt <= opcnt + 7'd1;
+					if(ena_4)
+					begin
+						opk <= nxt_opk;
+						lane <= nxt_lane;
+						pbase <= nxt_pbase;
+						pidx <= nxt_pidx;
+						opadr <= nxt_adr[osz-1:0];
+						voice <= {nxt_pidx,nxt_lane};
+						if(last_op)
+							run <= 1'b0;
+					end
 				end
 				
-				ena_8d <= {ena_8d[8:0],ena_8};
+				ena_d <= {ena_d[11:0],ena_smpl|ena_4};
 				
-				if(ena_8d[7])
-					opcnt_d <= opcnt;
+				// two stages of op delay for late pipeline steps
+				if(ena_d[3])
+				begin
+					opadr_d <= opadr;
+					voice_d <= voice;
+					first_d <= (opk == 3'd0);
+					last_d <= (opk == opv);
+				end
+				if(ena_d[7])
+				begin
+					opadr_dd <= opadr_d;
+					voice_dd <= voice_d;
+					first_dd <= first_d;
+				end
 			end
 		end
 	end
 	
-	// Parameter storage memory - 64 bits x 127 ops -> 4 block RAMs
-	reg [63:0] pmem [ops-1:0];
-	wire [63:0] pwdata = 
-	{
-		4'h0,	// [63:60] 4-bit unused
-		fb_en,	//    [59] 1-bit feedback enable (only one per algo)
-		acc_cl, //    [58] 1-bit clear accumulator
-		acc_en,	//    [57] 1-bit enable accumlation
-		mod_en,	//    [56] 1-bit enable modulation input 
-		ri,		//    [55] 1-bit right out include
-		li,		//    [54] 1-bit left out include
-		rr,		// [53:48] 6-bit release rate
-		sl,		// [47:43] 5-bit sustain level (attenuation)
-		dr,		// [42:37] 6-bit decay rate
-		ar,		// [36:31] 6-bit attack rate
-		adj,	// [30:22] 9-bit attenuation adjust 
-		wv,		// [21:19] 3-bit waveform
-		frq		//  [18:0] 19-bit base frequency
-	};
+	// Parameter storage memory - 64 bits x 2 banks x 256 ops -> 8 block RAMs
+	//  [63:61] 3-bit unused
+	//     [60] 1-bit frequency is a ratio of the voice pitch
+	//     [59] 1-bit feedback enable (only one per algo)
+	//     [58] 1-bit clear accumulator
+	//     [57] 1-bit enable accumlation
+	//     [56] 1-bit enable modulation input 
+	//     [55] 1-bit right out include
+	//     [54] 1-bit left out include
+	//  [53:48] 6-bit release rate
+	//  [47:43] 5-bit sustain level (attenuation)
+	//  [42:37] 6-bit decay rate
+	//  [36:31] 6-bit attack rate
+	//  [30:22] 9-bit attenuation adjust 
+	//  [21:19] 3-bit waveform
+	//   [18:0] 19-bit base frequency, or u5.11 ratio in [15:0]
+	//
+	// The scan reads the active bank. With shadow set, parameter writes go
+	// to the other bank and a commit swaps the banks at the next sample so
+	// a whole patch change is heard at once. The shadow is kept equal to
+	// the active bank by copying each op's scan read into it when the
+	// write port is idle, skipping ops written since the last swap. A
+	// commit waits for one full resync pass after the previous swap.
+	reg [63:0] pmem [2*ops-1:0];
+	reg abank;							// active bank
+	reg [ops-1:0] pdirty;				// shadow ops newer than active
+	reg cmt_pend;						// commit requested
+	reg rs_arm;							// resync pass in progress
+	reg rs_done;						// shadow resynced since last swap
+	always @(posedge clk)
+	begin
+		if(reset)
+		begin
+			abank <= 1'b0;
+			pdirty <= {ops{1'b0}};
+			cmt_pend <= 1'b0;
+			rs_arm <= 1'b0;
+			rs_done <= 1'b0;
+		end
+		else
+		begin
+			if(ena_smpl & cmt_pend & rs_done)
+			begin
+				// swap banks
+				abank <= ~abank;
+				pdirty <= {ops{1'b0}};
+				cmt_pend <= commit & shadow;
+				rs_arm <= 1'b1;
+				rs_done <= 1'b0;
+			end
+			else
+			begin
+				if(commit & shadow)
+					cmt_pend <= 1'b1;
+				if(ena_smpl & ~ramclr)
+				begin
+					rs_arm <= 1'b1;
+					rs_done <= rs_arm;
+				end
+				if(pwe & shadow)
+					pdirty[pwaddr] <= 1'b1;
+			end
+		end
+	end
+	
+	// resync request for the op being scanned - retried until write port free
+	reg rs_pend;
+	always @(posedge clk)
+	begin
+		if(reset | ena_d[3])
+			rs_pend <= 1'b0;
+		else if(ena_d[1])
+			rs_pend <= 1'b1;
+		else if(~pwe)
+			rs_pend <= 1'b0;
+	end
+	
+	reg [63:0] pout;
 	always @(posedge clk) // Write memory.
 	begin
 		if(ramclr)
-			pmem[opcnt] <= 64'h0; // Using write address bus.
+			pmem[{abank,opadr}] <= 64'h0; // Using write address bus.
 		else if (pwe)
-			pmem[pwaddr] <= pwdata; // Using write address bus.
+			pmem[{abank^shadow,pwaddr}] <= pwdata; // Using write address bus.
+		else if (rs_pend & ~pdirty[opadr])
+			pmem[{~abank,opadr}] <= pout; // resync shadow from scan
 	end
 	
-	reg [63:0] pout;
 	always @(posedge clk) // Read memory.
-		pout <= pmem[opcnt]; // Using opcnt.
+		pout <= pmem[{abank,opadr}]; // Using opadr.
 	
+	assign pstat = {abank,cmt_pend};
+
 	// parameter diagnostic
 	reg [63:0] readbus;
 	always @(posedge clk)
-		if((opcnt == pwaddr) & ena_8d[1])
+		if((opadr == pwaddr) & ena_d[1])
 			readbus <= pout;
 		
 	// break out parameters
@@ -154,11 +289,12 @@ module fm_gen(clk, reset, ena_smpl,
 	wire [lsz-1:0] p_sl;
 	wire [asz-1:0] p_adj;
 	wire [2:0] p_wv;
-	wire p_ri, p_li, p_mod_en,p_acc_en,p_acc_cl,p_fb_en;
-	wire [4:0] p_dummy;
+	wire p_ri, p_li, p_mod_en,p_acc_en,p_acc_cl,p_fb_en,p_ratio;
+	wire [2:0] p_dummy;
 	assign
 	{
 		p_dummy,
+		p_ratio,
 		p_fb_en,
 		p_acc_cl,
 		p_acc_en,
@@ -174,9 +310,61 @@ module fm_gen(clk, reset, ena_smpl,
 		p_frq
 	} = pout;
 	
-	// delay some of the params to 2nd cycle
-	reg	p_ri_d, p_li_d, p_acc_cl_d, p_acc_en_d;
-	reg p_fb_en_d;
+	// voice pitch memory - 19 bits x 128 voices -> 2 block RAMs
+	reg [fsz-1:0] vmem [vcs-1:0];
+	reg [fsz-1:0] vout;
+	always @(posedge clk) // Write memory.
+	begin
+		if(ramclr)
+			vmem[opadr[vsz-1:0]] <= {fsz{1'b0}};
+		else if(vwe)
+			vmem[vwaddr] <= vwdata;
+	end
+	
+	always @(posedge clk) // Read memory.
+		vout <= vmem[voice];
+	
+	// ratio multiply - voice pitch x u5.11 ratio for each op, registered in
+	// and out. SB_MAC16 is only 16x16, so synth_ice40 -dsp splits the 19x16
+	// product into pitch[15:0] x ratio and pitch[18:16] x ratio: two of the
+	// LP4K's four SB_MAC16s plus a ~20 LC adder to sum the partial products.
+	// The pitch can't be narrowed to 16 bits without losing ~0.7Hz steps.
+	reg [fsz-1:0] mcand;
+	reg [15:0] mplier;
+	reg [fsz+15:0] mprod;
+	always @(posedge clk)
+	begin
+		if(ena_d[1])
+		begin
+			mcand <= vout;
+			mplier <= p_frq[15:0];
+		end
+		
+		if(ena_d[2])
+			mprod <= mcand * mplier;
+	end
+	
+	// product memory - 19 bits x 256 ops -> 2 block RAMs. Products are
+	// used on the next sample so ratio ops lag a pitch change by one sample.
+	reg [fsz-1:0] qmem [ops-1:0];
+	reg [fsz-1:0] qout;
+	always @(posedge clk) // Write memory.
+	begin
+		if(ramclr)
+			qmem[opadr] <= {fsz{1'b0}};
+		else if(ena_d[3])
+			qmem[opadr] <= mprod[fsz+10:11];
+	end
+	
+	always @(posedge clk) // Read memory.
+		qout <= qmem[opadr];
+	
+	// op frequency - fixed or scaled from the voice pitch
+	wire [fsz-1:0] o_frq = p_ratio ? qout : p_frq;
+	
+	// delay some of the params to the next two op slots
+	reg	p_ri_d, p_li_d, p_acc_cl_d, p_acc_en_d, p_fb_en_d;
+	reg	p_ri_dd, p_li_dd, p_acc_cl_dd, p_acc_en_dd, p_fb_en_dd;
 	always @(posedge clk)
 	begin
 		if(reset)
@@ -186,10 +374,15 @@ module fm_gen(clk, reset, ena_smpl,
 			p_acc_cl_d <= 1'b0;
 			p_acc_en_d <= 1'b0;
 			p_fb_en_d <= 1'b0;
+			p_ri_dd <= 1'b0;
+			p_li_dd <= 1'b0;
+			p_acc_cl_dd <= 1'b0;
+			p_acc_en_dd <= 1'b0;
+			p_fb_en_dd <= 1'b0;
 		end
 		else
 		begin
-			if(ena_8d[7])
+			if(ena_d[3])
 			begin
 				p_ri_d <= p_ri;
 				p_li_d <= p_li;
@@ -197,10 +390,19 @@ module fm_gen(clk, reset, ena_smpl,
 				p_acc_en_d <= p_acc_en;
 				p_fb_en_d <= p_fb_en;
 			end
+			
+			if(ena_d[7])
+			begin
+				p_ri_dd <= p_ri_d;
+				p_li_dd <= p_li_d;
+				p_acc_cl_dd <= p_acc_cl_d;
+				p_acc_en_dd <= p_acc_en_d;
+				p_fb_en_dd <= p_fb_en_d;
+			end
 		end
 	end
 
-	// state storage memory - 48 bits x 127 ops -> 3 block RAMs
+	// state storage memory - 48 bits x 256 ops -> 3 block RAMs
 	reg [47:0] smem [ops-1:0];
 	reg [18:0] o_phs;
 	wire [1:0] o_st;
@@ -222,18 +424,18 @@ module fm_gen(clk, reset, ena_smpl,
 		15'd0,	// [33:19] 15-bit envelope delay counter = 0
 		19'd0	//  [18:0] 19-bit operator waveform phase = 0
 	};
-	wire swe = ena_8d[6];				// write updated state at cycle 7
+	wire swe = ena_d[6];				// write updated state at cycle 7
 	always @(posedge clk) 				// Write memory.
 	begin
 		if (ramclr)
-			smem[opcnt] <= st_rst; 		// Using write address bus.
+			smem[opadr] <= st_rst; 		// Using write address bus.
 		else if (swe)
-			smem[opcnt] <= swdata; 		// Using write address bus.
+			smem[opadr_d] <= swdata; 	// Using write address bus.
 	end
 	
 	reg [47:0] sout;
 	always @(posedge clk) 				// Read memory.
-		sout <= smem[opcnt]; 			// Using opcnt.
+		sout <= smem[opadr]; 			// Using opadr.
 	
 	// break out the state
 	wire [18:0] s_phs;
@@ -251,60 +453,82 @@ module fm_gen(clk, reset, ena_smpl,
 	} = sout;
 
 	wire [11:0] op_out;					// operator output for summing
-	reg [15:0] fmem [31:0];				// fb memory - 16 bits x 2 locs x 16 voices -> 1 block RAMs
+	wire signed [15:0] op_out_sx = {{4{op_out[11]}},op_out};
+	
+	// fb memory - 16 bits x 2 locs x 128 voices -> 1 block RAM. [v,0] holds
+	// the last output of the voice's fb op and [v,1] the average of the
+	// last two, which is what the fb op is modulated with. The phase mod
+	// read is at cycle 1 of the op and the fb update at cycles 9-12, so
+	// the single read port is shared between op slots at different phases.
+	reg [15:0] fmem [2*vcs-1:0];
 	reg [15:0] fout;					// fb memory read data
-	wire fwe = |ena_8d[4:3] & p_fb_en_d;	// fb memory write enable
-	wire faccsel = ena_8d[2];			// fb accum input select
-	wire faccena = |ena_8d[3:2];		// fb accum write enable
-	wire faddr = ena_8d[4] | ena_8d[1];	// fb memory addr lsb
-	wire facc = faccsel;				// fb accum / dump ctrl
-	wire fwsel = ena_8d[4];				// fb write bus mux sel
-	wire fasel = |ena_8d[4:2];          // fb r/w address select
-	wire [4:0] frwaddr = fasel ? {opcnt_d[6:3],faddr} : {opcnt[6:3],faddr};		// fb r/w address
-	wire signed [16:0] fb_acc_in = faccsel ? {{4{op_out[11]}},op_out} : fout;
+	reg [vsz-1:0] fvc;					// fb voice being updated
+	reg fwe_ena;						// fb update enabled for this op
 	reg signed [16:0] fb_acc;			// fb accum
-	wire signed [15:0] fwdata = fwsel ? fb_acc[16:1] : {{4{op_out[11]}},op_out}; // fb memory write data
+	wire fwe = |ena_d[12:11] & fwe_ena;	// fb memory write enable
+	wire fwsel = ena_d[12];				// fb write loc & data select
+	wire [vsz:0] fraddr = ena_d[1] ? {voice,1'b1} : {voice_dd,1'b0};
+	wire [vsz:0] fwaddr = {fvc,fwsel};
+	wire signed [15:0] fwdata = fwsel ? fb_acc[16:1] : fb_acc[15:0];
 	
 	// Write memory
 	always @(posedge clk)
 	begin
 		if (ramclr)
-			fmem[opcnt[6:2]] <= 16'h0000;
+			fmem[opadr] <= 16'h0000;
 		else if (fwe)
-			fmem[frwaddr] <= fwdata;
+			fmem[fwaddr] <= fwdata;
 	end
 	
 	// Read memory
 	always @(posedge clk)
 	begin
-		fout <= fmem[frwaddr];
+		fout <= fmem[fraddr];
 	end
 	
-	// accumulator
+	// fb voice & enable - held for the writes
 	always @(posedge clk)
 	begin
-		if(faccena)
+		if(reset)
 		begin
-			if(facc)
-				fb_acc <= fb_acc_in;	// load
-			else
-				fb_acc <= fb_acc + fb_acc_in;	// accumulate
+			fvc <= {vsz{1'b0}};
+			fwe_ena <= 1'b0;
 		end
+		else if(ena_d[10])
+		begin
+			fvc <= voice_dd;
+			fwe_ena <= p_fb_en_dd;
+		end
+	end
+	
+	// accumulator - load new output then add previous
+	always @(posedge clk)
+	begin
+		if(ena_d[9])
+			fb_acc <= op_out_sx;	// load
+		else if(ena_d[11])
+			fb_acc <= fb_acc + $signed(fout);	// accumulate
 	end
 
 	// mux the gate & trigger
-	reg mtrig, mgate;
+	reg mtrig, mgate, mgate_d;
 	always @(posedge clk)
 	begin
 		if(reset)
 		begin
 			mtrig <= 1'b0;
 			mgate <= 1'b0;
+			mgate_d <= 1'b0;
 		end
-		else if(ena_8d[0])
+		else
 		begin
-			mtrig <= trig[opcnt[6:3]];
-			mgate <= dgate[opcnt[6:3]];
+			if(ena_d[0])
+			begin
+				mtrig <= trig[voice];
+				mgate <= dgate[voice];
+			end
+			if(ena_d[3])
+				mgate_d <= mgate;
 		end
 	end
 	
@@ -316,41 +540,59 @@ module fm_gen(clk, reset, ena_smpl,
 			phs <= 19'd0;
 		else
 		begin
-			if(ena_8d[1])
+			if(ena_d[1])
 			begin
 				if(mtrig)
 					phs <= 19'd0;
 				else
-					phs <= s_phs + p_frq;
+					phs <= s_phs + o_frq;
 			end
 		end
 	end
 	
-	// Modulation accumulator
-	reg [9:0] mod_acc; 	// only bottom 10 bits used - others wrap
+	// Modulation accumulators - one per lane of the voice pair
+	reg [9:0] mod_acc0, mod_acc1; 	// only bottom 10 bits used - others wrap
+	wire [9:0] mod_prev = voice_dd[0] ? mod_acc1 : mod_acc0;
+	reg [9:0] mod_nxt;
+	always @(*)
+	begin
+		if(p_acc_cl_dd | first_dd)
+		begin
+			if(p_acc_en_dd)
+				mod_nxt = op_out[9:0];	// start new accum
+			else
+				mod_nxt = 10'd0;	// just clear
+		end
+		else
+		begin
+			if(p_acc_en_dd)
+				mod_nxt = mod_prev + op_out[9:0];	// accumulate
+			else
+				mod_nxt = mod_prev;
+		end
+	end
+	
 	always @(posedge clk)
 	begin
 		if(reset)
-			mod_acc <= 10'd0;
+		begin
+			mod_acc0 <= 10'd0;
+			mod_acc1 <= 10'd0;
+		end
 		else
 		begin
-			if(ena_8d[9])
+			if(ena_d[9])
 			begin
-				if(p_acc_cl_d | (opcnt_d[2:0] == 3'd0))
-				begin
-					if(p_acc_en_d)
-						mod_acc <= op_out[9:0];	// start new accum
-					else
-						mod_acc <= 10'd0;	// just clear
-				end
+				if(voice_dd[0])
+					mod_acc1 <= mod_nxt;
 				else
-				begin
-					if(p_acc_en_d)
-						mod_acc <= mod_acc + op_out[9:0];	// accumulate
-				end
+					mod_acc0 <= mod_nxt;
 			end
 		end
 	end
+	
+	// modulation for the op being scanned
+	wire [9:0] mod_acc = voice[0] ? mod_acc1 : mod_acc0;
 				
 	// add modulation source to phase and truncate to 10 bits for wave LUT
 	reg [9:0] phsmod;
@@ -360,7 +602,7 @@ module fm_gen(clk, reset, ena_smpl,
 			phsmod <= 19'd0;
 		else
 		begin
-			if(ena_8d[2])
+			if(ena_d[2])
 			begin
 				if(p_mod_en)
 					phsmod <= phs[18:9] + (p_fb_en ? fout[9:0] : mod_acc);
@@ -377,7 +619,7 @@ module fm_gen(clk, reset, ena_smpl,
 			o_phs <= 19'd0;
 		else
 		begin
-			if(ena_8d[3])
+			if(ena_d[3])
 				o_phs <= phs;
 		end
 	end
@@ -399,37 +641,149 @@ module fm_gen(clk, reset, ena_smpl,
 	// instantiate the expo converter - 3 clocks latency
 	exp_conv
 		u_expo(.clk(clk), .wave(wvfrm), .atten(atten), .out(op_out));
+	
+	// voice activity - the lowest carrier atten of each voice is tracked
+	// per lane as env results come out with the state write, and stored at
+	// the voice's last op. A voice is silent when that's max atten, which
+	// exp_conv outputs as 0. The quietest voice with its gate off and with
+	// it on are found over each scan and published when op 0 of the next
+	// scan gets here, after the last op of the previous one.
+	reg [asz-1:0] vmin0, vmin1;
+	wire [asz-1:0] vmin_prev = voice_d[0] ? vmin1 : vmin0;
+	wire [asz-1:0] vmin_op = (p_li_d | p_ri_d) ? atten : {asz{1'b1}};
+	wire [asz-1:0] vmin_nxt = (first_d | (vmin_op < vmin_prev)) ? vmin_op : vmin_prev;
+	wire vs_we = swe & last_d;
+	always @(posedge clk)
+	begin
+		if(reset)
+		begin
+			vmin0 <= {asz{1'b1}};
+			vmin1 <= {asz{1'b1}};
+		end
+		else if(swe)
+		begin
+			if(voice_d[0])
+				vmin1 <= vmin_nxt;
+			else
+				vmin0 <= vmin_nxt;
+		end
+	end
+	
+	// per-voice loudest carrier - 9 bits x 128 voices -> 1 block RAM
+	reg [asz-1:0] vsmem [vcs-1:0];
+	reg [asz-1:0] vsatten;
+	always @(posedge clk) // Write memory.
+	begin
+		if(ramclr)
+			vsmem[opadr[vsz-1:0]] <= {asz{1'b1}};
+		else if(vs_we)
+			vsmem[voice_d] <= vmin_nxt;
+	end
+	
+	always @(posedge clk) // Read memory.
+		vsatten <= vsmem[vsraddr];
+	
+	// silent bitmap & quietest voice search
+	reg [vcs-1:0] vsilent;
+	reg [16:0] vquiet_rel, vquiet_held;
+	reg qr_vld, qh_vld;
+	reg [vsz-1:0] qr_voice, qh_voice;
+	reg [asz-1:0] qr_att, qh_att;
+	always @(posedge clk)
+	begin
+		if(reset)
+		begin
+			vsilent <= {vcs{1'b1}};
+			vquiet_rel <= 17'd0;
+			vquiet_held <= 17'd0;
+			qr_vld <= 1'b0;
+			qh_vld <= 1'b0;
+			qr_voice <= {vsz{1'b0}};
+			qh_voice <= {vsz{1'b0}};
+			qr_att <= {asz{1'b0}};
+			qh_att <= {asz{1'b0}};
+		end
+		else if(swe)
+		begin
+			if(first_d & (voice_d == {vsz{1'b0}}))
+			begin
+				// publish last scan
+				vquiet_rel <= {qr_vld,qr_voice,qr_att};
+				vquiet_held <= {qh_vld,qh_voice,qh_att};
+				qr_vld <= 1'b0;
+				qh_vld <= 1'b0;
+			end
+			else if(last_d)
+			begin
+				vsilent[voice_d] <= &vmin_nxt;
+				if(~mgate_d & (~qr_vld | (vmin_nxt > qr_att)))
+				begin
+					qr_vld <= 1'b1;
+					qr_voice <= voice_d;
+					qr_att <= vmin_nxt;
+				end
+				if(mgate_d & (~qh_vld | (vmin_nxt > qh_att)))
+				begin
+					qh_vld <= 1'b1;
+					qh_voice <= voice_d;
+					qh_att <= vmin_nxt;
+				end
+			end
+		end
+	end
 		
-	// accumulate osc output
-	wire signed [15:0] op_out_sx = {{4{op_out[11]}},op_out};
-	reg signed [15:0] acc_l, acc_r;		// output accumulators
-	reg signed [15:0] audio_l, audio_r;	// final audio out
+	// accumulate osc output - wide enough for all ops at full level
+	wire signed [msz-1:0] op_out_mx = {{msz-12{op_out[11]}},op_out};
+	reg signed [msz-1:0] acc_l, acc_r;		// output accumulators
+	reg signed [msz-1:0] mix_l, mix_r;		// finished sums
+	reg mix_ld;
 	always @(posedge clk)
 		if(reset)
 		begin
-			acc_l <= 16'h000;
-			acc_r <= 16'h000;
-			audio_l <= 16'h000;
-			audio_r <= 16'h000;
+			acc_l <= {msz{1'b0}};
+			acc_r <= {msz{1'b0}};
+			mix_l <= {msz{1'b0}};
+			mix_r <= {msz{1'b0}};
+			mix_ld <= 1'b0;
 		end
 		else
 		begin
-			if(ena_8d[9])
+			mix_ld <= 1'b0;
+			if(ena_d[9])
 			begin
-				if(opcnt_d == 7'h00)
+				if(opadr_dd == {osz{1'b0}})
 				begin
 					// dump
-					audio_l <= acc_l;
-					audio_r <= acc_r;
-					acc_l <= p_li_d ? op_out_sx : 16'h000;
-					acc_r <= p_ri_d ? op_out_sx : 16'h000;
+					mix_l <= acc_l;
+					mix_r <= acc_r;
+					mix_ld <= 1'b1;
+					acc_l <= p_li_dd ? op_out_mx : {msz{1'b0}};
+					acc_r <= p_ri_dd ? op_out_mx : {msz{1'b0}};
 				end
 				else
 				begin
 					// accumulate
-					acc_l <= acc_l + (p_li_d ? op_out_sx : 16'h000);
-					acc_r <= acc_r + (p_ri_d ? op_out_sx : 16'h000);
+					acc_l <= acc_l + (p_li_dd ? op_out_mx : {msz{1'b0}});
+					acc_r <= acc_r + (p_ri_dd ? op_out_mx : {msz{1'b0}});
 				end
 			end
 		end
+	
+	// apply mix gain and saturate instead of wrapping
+	wire signed [msz+15:0] gain_l = {{16{mix_l[msz-1]}},mix_l} <<< mix_shift;
+	wire signed [msz+15:0] gain_r = {{16{mix_r[msz-1]}},mix_r} <<< mix_shift;
+	wire ovf_l = ~((&gain_l[msz+15:msz-1]) | ~(|gain_l[msz+15:msz-1]));
+	wire ovf_r = ~((&gain_r[msz+15:msz-1]) | ~(|gain_r[msz+15:msz-1]));
+	reg signed [msz-1:0] audio_l, audio_r;	// final audio out
+	always @(posedge clk)
+		if(reset)
+		begin
+			audio_l <= {msz{1'b0}};
+			audio_r <= {msz{1'b0}};
+		end
+		else if(mix_ld)
+		begin
+			audio_l <= ovf_l ? {gain_l[msz+15],{msz-1{~gain_l[msz+15]}}} : gain_l[msz-1:0];
+			audio_r <= ovf_r ? {gain_r[msz+15],{msz-1{~gain_r[msz+15]}}} : gain_r[msz-1:0];
+		end
 endmodule
@@ -1,14 +1,18 @@
 //
 // i2s_out: I2S serializer
 //
+// wide = 0: 32fs frame, top 16 bits of each channel
+// wide = 1: 64fs frame, 24 bits left justified in 32-bit slots
+//
 module i2s_out(clk, reset,
-				l_data, r_data,
+				l_data, r_data, wide,
 				mclk, sdout, sclk, lrclk,
 				load);
 	
 	input clk;									// System clock
 	input reset;								// System POR
-	input signed [15:0] l_data, r_data;			// inputs
+	input signed [23:0] l_data, r_data;			// inputs
+	input wide;									// 24-bit frame select
 	output mclk;								// I2S master clock (256x)
 	output sdout;								// I2S serial data
 	output sclk;								// I2S serial clock
@@ -21,7 +25,15 @@ module i2s_out(clk, reset,
 		uclk(.clk(clk), .reset(reset),
 			.mclk(mclk), .mclk_ena(mclk_ena), .rate(load));
 	
-	// Serial Clock divider (/8 for 48MHz -> 48kHz)
+	// frame format changes only at a sample boundary
+	reg wd;
+	always @(posedge clk)
+		if(reset)
+			wd <= 1'b0;
+		else if(load)
+			wd <= wide;
+	
+	// Serial Clock divider (/8 for 32fs or /4 for 64fs)
 	reg [2:0] scnt;		// serial clock divide register
 	always @(posedge clk)
 		if(reset)
@@ -35,24 +47,25 @@ module i2s_out(clk, reset,
 	reg p_sclk;			// 1 cycle wide copy of serial clock
 	always @(posedge clk)
 		if (mclk_ena)
-			p_sclk <= (scnt==3'b000);
+			p_sclk <= wd ? (scnt[1:0]==2'b00) : (scnt==3'b000);
 	
 	// Shift register advances on serial clock
-	reg [31:0] sreg;
+	reg [63:0] sreg;
 	always @(posedge clk)
 		if(load)
-			sreg <= {l_data,r_data};
+			sreg <= wide ? {l_data,8'h00,r_data,8'h00} :
+				{l_data[23:8],r_data[23:8],32'h0};
 		else if(p_sclk & mclk_ena)
-			sreg <= {sreg[30:0],1'b0};
+			sreg <= {sreg[62:0],1'b0};
 	
 	// 1 serial clock cycle delay on data relative to LRCLK
 	reg sdout;
 	always @(posedge clk)
 		if(p_sclk & mclk_ena)
-			sdout <= sreg[31];
+			sdout <= sreg[63];
 	
 	// Generate LR clock
-	reg [3:0] lrcnt;
+	reg [4:0] lrcnt;
 	reg lrclk;
 	always @(posedge clk)
 		if(reset | load)
@@ -62,7 +75,7 @@ module i2s_out(clk, reset,
 		end
 		else if(p_sclk & mclk_ena)
 		begin
-			if(lrcnt == 4'd15)
+			if(lrcnt == (wd ? 5'd31 : 5'd15))
 			begin
 				lrcnt <= 0;
 				lrclk <= ~lrclk;
@@ -75,7 +88,7 @@ module i2s_out(clk, reset,
 	reg sclk_p0, sclk;
 	always @(posedge clk)
 	begin
-		sclk_p0 <= scnt[2];
+		sclk_p0 <= wd ? scnt[1] : scnt[2];
 		sclk <= sclk_p0;
 	end
 endmodule
@@ -14,6 +14,11 @@
 // The next 7 are address bits.
 // The last 32 are data bits
 // Read data is sent in current transfer based on early address/direction
+//
+// Burst writes: if CS stays low after the first 40 bits then each further
+// 32 bits is written to the next address. Every word generates its own
+// we pulse with addr/wdat updated together so a single transfer can fill
+// a run of consecutive registers. Reads are single-word only.
 
 `timescale 1 ns/1 ps
 
@@ -40,11 +45,12 @@ module spi_slave(clk, reset,
 	reg [dsz-1:0] mosi_shift;		// shift reg
 	reg rd;							// direction flag
 	reg [asz-1:0] addr;				// address bits
+	reg [asz-1:0] nxt_addr;			// address of next burst word
 	reg eoa;						// end of address flag
 	reg	re;							// read flag
 	reg [dsz-1:0] wdat;				// write data reg
-	reg eot;						// end of transfer flag
 	wire       spi_reset = reset | spicsl;	// combined reset
+	wire       eow = (mosi_cnt == (asz+dsz));	// end of word
  	always@(posedge spiclk or posedge spi_reset)
 		if (spi_reset)
 		begin
@@ -52,12 +58,14 @@ module spi_slave(clk, reset,
 			mosi_shift <= 32'h0;
 			eoa <= 'b0;
 			rd <= 'b0;
-			eot <= 'b0;
 		end
 		else 
 		begin
-			// Counter keeps track of bits received
-			mosi_cnt <= mosi_cnt + 1;
+			// Counter keeps track of bits received, wraps to data for bursts
+			if(eow)
+				mosi_cnt <= asz+1;
+			else
+				mosi_cnt <= mosi_cnt + 1;
 			
 			// Shift register grabs incoming data
 			mosi_shift <= {mosi_shift[dsz-2:0], spimosi};
@@ -67,25 +75,34 @@ module spi_slave(clk, reset,
 				rd <= spimosi;
 			
 			// Grab Address
-			if(mosi_cnt == asz)
+			if((mosi_cnt == asz) & ~eoa)
 			begin
 				addr <= {mosi_shift[asz-2:0],spimosi};
+				nxt_addr <= {mosi_shift[asz-2:0],spimosi};
 				eoa <= 1'b1;
 			end
 			
 			// Generate Read pulse
-			re <= rd & (mosi_cnt == asz);
+			re <= rd & (mosi_cnt == asz) & ~eoa;
 
-			if(mosi_cnt == (asz+dsz))
+			if(eow)
 			begin
-				// Grab data
+				// Grab data and the address it belongs to
 				wdat <= {mosi_shift[dsz-2:0],spimosi};
-				
-				// End-of-transmission (used to generate Write pulse)
-				eot <= 1'b1;
+				addr <= nxt_addr;
+				nxt_addr <= nxt_addr + 1;
 			end
 		end
 	
+	// End-of-word toggle (used to generate Write pulse) - not cleared by CS
+	// so back-to-back words and transfers each give exactly one edge
+	reg eot;
+ 	always@(posedge spiclk or posedge reset)
+		if (reset)
+			eot <= 1'b0;
+		else if(eow & ~rd)
+			eot <= ~eot;
+	
   	// outgoing shift register is clocked on falling edge
 	reg [dsz-1:0] miso_shift;
 	always @(negedge spiclk or posedge spi_reset)
@@ -116,6 +133,6 @@ module spi_slave(clk, reset,
 		else
 	 	begin
 			we_dly <= {we_dly[1:0],eot};
-			we <= ~we_dly[2] & we_dly[1] & ~rd;
+			we <= we_dly[2] ^ we_dly[1];
 		end
 endmodule
@@ -0,0 +1,30 @@
+// sb_stubs.v: iCE40 primitive stand-ins for the Verilator build
+// The HF osc is replaced by sim_clk in the top level. The LED path is
+// left idle - nothing here affects audio.
+
+module SB_LFOSC(CLKLFEN, CLKLFPU, CLKLF);
+	input CLKLFEN, CLKLFPU;
+	output CLKLF;
+	
+	assign CLKLF = 1'b0;
+endmodule
+
+module SB_RGB_DRV(RGBLEDEN, RGB0PWM, RGB1PWM, RGB2PWM, RGBPU,
+		RGB0, RGB1, RGB2);
+	parameter RGB0_CURRENT = "0b000000";
+	parameter RGB1_CURRENT = "0b000000";
+	parameter RGB2_CURRENT = "0b000000";
+	input RGBLEDEN, RGB0PWM, RGB1PWM, RGB2PWM, RGBPU;
+	output RGB0, RGB1, RGB2;
+	
+	assign RGB0 = RGBLEDEN & RGB0PWM;
+	assign RGB1 = RGBLEDEN & RGB1PWM;
+	assign RGB2 = RGBLEDEN & RGB2PWM;
+endmodule
+
+module SB_LED_DRV_CUR(EN, LEDPU);
+	input EN;
+	output LEDPU;
+	
+	assign LEDPU = EN;
+endmodule
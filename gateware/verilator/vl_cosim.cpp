@@ -0,0 +1,641 @@
+// vl_cosim.cpp: firmware / gateware co-simulation of f303_ice5_fm
+//
+// Links the host build of the firmware - fm.c, cmd.c and the async queue
+// & write cache in ice5_queue.c - against the Verilator model of the top
+// level. The ice5 transport here takes the place of ice5.c and bit-bangs
+// SPI_CSL/SCLK/MOSI at the chosen SCK: queued frames go out in the
+// background like the DMA does, blocking writes & reads wait for the
+// queue and then for their own frame. Firmware code itself takes no
+// simulated time. The main loop (FM_NoteService) runs every -m clocks and
+// DWT->CYCCNT follows simulated time at 72MHz.
+//
+// Script lines, '#' starts a comment:
+//   on <note> [vel]	FM_NoteOn
+//   off <note>			FM_NoteOff
+//   prog <slot>		FM_SetNotePatch(&voices[slot])
+//   bend <cents>		FM_SetBend
+//   cmd <line>			console command line, as typed
+//   s <samples>		run until this many more I2S frames are out
+//   t <seconds>		run for this much audio
+//   c <clocks>			run 48MHz clocks
+//
+// Every register write, pmem write and commit is stamped as it lands in
+// the FPGA with the sample it fell in and its clock offset from that
+// sample's ena_smpl (0-1023). pmem writes made with shadow on also get the
+// sample their bank swap put them live. on/off calls are timed to the
+// first gate write after them, if it lands before the next call. -l lists
+// every landing, the summary always follows.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#include "verilated.h"
+#include "Vf303_ice5_fm.h"
+#include "vl_i2s.h"
+
+extern "C" {
+#include "fm.h"
+#include "ice5.h"
+#include "ice5_queue.h"
+#include "cmd.h"
+#include "usart.h"
+#include "host_hal.h"
+}
+
+#define CLK_HZ 48000000
+#define SMPL_CLKS 1024		// clocks per sample
+#define NO_SMPL 0xFFFFFFFF
+
+static Vf303_ice5_fm *top;
+static uint64_t clocks;
+static const char *scr_name;
+static int lnum;
+static i2s_wav wav;
+
+// firmware side
+static uint32_t sck = 9000000;		// SPI clock
+static uint32_t frame_gap = 72;		// CS high & DMA restart, clocks
+static uint32_t loop_clks = 240;	// main loop period, clocks
+static uint64_t next_loop;
+static int in_fw, in_irq;
+
+// SPI master - one frame at a time, stepped from tick()
+enum {SPI_IDLE, SPI_LOW, SPI_HIGH, SPI_GAP};
+static struct
+{
+	int state;
+	int async;						// frame came off the queue
+	uint8_t hdr;
+	uint32_t data[ICE5_BURST_MAX];
+	int bits, bit;
+	uint32_t wait;					// clocks to the next edge
+	uint32_t acc;					// half period remainder
+	uint32_t miso;
+	uint64_t frames, bytes, busy;
+} spi;
+
+// what landed when
+enum {LAND_REG, LAND_PMEM, LAND_COMMIT, LAND_SWAP};
+struct landing
+{
+	uint64_t clk;
+	uint32_t smpl;					// sample it fell in
+	uint16_t ofs;					// clocks after that sample's ena_smpl
+	uint8_t kind;
+	uint8_t addr;					// register or pmem address
+	uint32_t live;					// swap sample for shadowed pmem writes
+};
+static std::vector<landing> lands;
+static size_t live_from;			// first pmem write not yet swapped in
+static uint32_t smpl_n;
+static uint64_t smpl_clk;
+static int abank_d;
+
+// min / avg / max
+struct minmax
+{
+	uint32_t n = 0;
+	double sum = 0, min = 0, max = 0;
+	
+	void add(double v)
+	{
+		if(!n || v < min)
+			min = v;
+		if(!n || v > max)
+			max = v;
+		sum += v;
+		n++;
+	}
+	
+	void print(const char *name, const char *unit)
+	{
+		if(n)
+			printf("  %-22s %6u  min %8.1f  avg %8.1f  max %8.1f %s\n",
+				name, n, min, sum/n, max, unit);
+		else
+			printf("  %-22s %6u\n", name, n);
+	}
+};
+static minmax st_pmem_ofs, st_gate_ofs, st_live, st_swap, st_event;
+static uint64_t cmt_clk, event_clk;
+static int cmt_wait, event_wait;
+
+//
+// half an SCK period in whole clocks, spread so the average rate is exact
+//
+static uint32_t spi_half(void)
+{
+	uint32_t n;
+	
+	spi.acc += CLK_HZ;
+	n = spi.acc / (2*sck);
+	spi.acc -= n*2*sck;
+	return n ? n : 1;
+}
+
+// MOSI for the current bit - header byte then the data words, MSB first
+static int spi_mosi(void)
+{
+	int b = spi.bit;
+	
+	if(b < 8)
+		return (spi.hdr >> (7-b)) & 1;
+	b -= 8;
+	return (spi.data[b/32] >> (31-(b&31))) & 1;
+}
+
+static void spi_start(uint8_t hdr, const uint32_t *data, int count, int async)
+{
+	spi.hdr = hdr;
+	memcpy(spi.data, data, count*sizeof(uint32_t));
+	spi.bits = 8 + 32*count;
+	spi.bit = 0;
+	spi.async = async;
+	spi.miso = 0;
+	spi.frames++;
+	spi.bytes += 1 + 4*count;
+	
+	// mode 0 - first bit set up with CS
+	top->SPI_CSL = 0;
+	top->SPI_SCLK = 0;
+	top->SPI_MOSI = spi_mosi();
+	top->eval();
+	spi.state = SPI_LOW;
+	spi.wait = spi_half();
+}
+
+//
+// next SPI edge, called with spi.wait run out
+//
+static void spi_edge(void)
+{
+	uint32_t cnt;
+	
+	switch(spi.state)
+	{
+		case SPI_LOW:
+			top->SPI_SCLK = 1;
+			top->eval();
+			spi.state = SPI_HIGH;
+			spi.wait = spi_half();
+			break;
+		
+		case SPI_HIGH:
+			// sample MISO before the falling edge shifts it
+			spi.miso = (spi.miso<<1) | top->SPI_MISO;
+			top->SPI_SCLK = 0;
+			if(++spi.bit < spi.bits)
+			{
+				top->SPI_MOSI = spi_mosi();
+				spi.state = SPI_LOW;
+				spi.wait = spi_half();
+			}
+			else
+			{
+				top->SPI_CSL = 1;
+				spi.state = SPI_GAP;
+				spi.wait = frame_gap ? frame_gap : 1;
+			}
+			top->eval();
+			break;
+		
+		case SPI_GAP:
+			spi.state = SPI_IDLE;
+			if(spi.async)
+			{
+				// DMA done IRQ - retire the frame & start the next
+				cnt = (spi.bits - 8)/32;
+				ICE5_q_byt_done += 1 + 4*cnt;
+				ICE5_q_frm_done++;
+				ICE5_q_busy = 0;
+				in_irq = 1;
+				ICE5_Queue_Kick();
+				in_irq = 0;
+			}
+			break;
+	}
+}
+
+//
+// register / pmem / commit landings & bank swaps on this clock
+//
+static void probe(void)
+{
+	landing l;
+	size_t i;
+	
+	if(top->sim_smpl)
+	{
+		smpl_n++;
+		smpl_clk = clocks;
+	}
+	l.clk = clocks;
+	l.smpl = smpl_n;
+	l.ofs = clocks - smpl_clk;
+	l.live = NO_SMPL;
+	
+	if(top->sim_we)
+	{
+		l.kind = LAND_REG;
+		l.addr = top->sim_addr;
+		lands.push_back(l);
+		if(l.addr == 0x03 || (l.addr >= 0x14 && l.addr <= 0x16))
+		{
+			st_gate_ofs.add(l.ofs);
+			if(event_wait)
+			{
+				st_event.add((clocks - event_clk)*1e6/CLK_HZ);
+				event_wait = 0;
+			}
+		}
+	}
+	if(top->sim_pwe)
+	{
+		l.kind = LAND_PMEM;
+		l.addr = top->sim_pwaddr;
+		st_pmem_ofs.add(l.ofs);
+		
+		// direct writes are heard at once, shadowed ones wait for a swap
+		if(!top->sim_shadow)
+			l.live = l.smpl;
+		lands.push_back(l);
+	}
+	if(top->sim_commit)
+	{
+		l.kind = LAND_COMMIT;
+		l.addr = 0;
+		lands.push_back(l);
+		if(!cmt_wait)
+			cmt_clk = clocks;
+		cmt_wait = 1;
+	}
+	if(top->sim_abank != abank_d)
+	{
+		abank_d = top->sim_abank;
+		l.kind = LAND_SWAP;
+		l.addr = abank_d;
+		lands.push_back(l);
+		if(cmt_wait)
+			st_swap.add((double)(clocks - cmt_clk)/SMPL_CLKS);
+		cmt_wait = 0;
+		
+		// the swap goes live with the sample it came at
+		for(i=live_from;i<lands.size();i++)
+			if(lands[i].kind == LAND_PMEM && lands[i].live == NO_SMPL)
+			{
+				lands[i].live = smpl_n;
+				st_live.add(smpl_n - lands[i].smpl);
+			}
+		live_from = lands.size();
+	}
+}
+
+// one 48MHz clock, plus the main loop when it is due
+static void tick(void)
+{
+	top->sim_clk = 1;
+	top->eval();
+	wav.edge(top->sclk, top->lrck, top->sdout);
+	probe();
+	top->sim_clk = 0;
+	top->eval();
+	clocks++;
+	
+	if(spi.state != SPI_IDLE)
+	{
+		spi.busy++;
+		if(!--spi.wait)
+			spi_edge();
+	}
+	
+	if(!in_fw && clocks >= next_loop)
+	{
+		in_fw = 1;
+		FM_NoteService();
+		in_fw = 0;
+		next_loop = clocks + loop_clks;
+	}
+}
+
+static void run(uint64_t n)
+{
+	while(n--)
+		tick();
+}
+
+static void run_frames(uint32_t n)
+{
+	n += wav.samples;
+	while(wav.samples < n)
+		tick();
+}
+
+// target cycles for DWT->CYCCNT
+static uint32_t sim_cycles(void)
+{
+	return clocks*3/2;
+}
+
+//
+// ice5 transport - the queue drains in the background, blocking calls
+// wait for it then send their own frame
+//
+static uint32_t spi_blocking(uint8_t hdr, const uint32_t *data, int count)
+{
+	while(ICE5_q_busy || (ICE5_q_rptr != ICE5_q_wptr))
+		tick();
+	spi_start(hdr, data, count, 0);
+	while(spi.state != SPI_IDLE)
+		tick();
+	return spi.miso;
+}
+
+void ICE5_Init(void)
+{
+	ICE5_Queue_Init();
+}
+
+uint8_t ICE5_FPGA_Config(uint8_t *bitmap, uint32_t size)
+{
+	ICE5_FPGA_Cache_Invalidate();
+	return 0;
+}
+
+uint8_t ICE5_FPGA_ConfigRLE(uint8_t *rle, uint32_t size)
+{
+	ICE5_FPGA_Cache_Invalidate();
+	return 0;
+}
+
+// the model needs no bitstream
+uint32_t ICE5_RLE_Size(uint8_t *rle)
+{
+	return 0;
+}
+
+void ICE5_Queue_Kick(void)
+{
+	uint32_t hdr, cnt, i, data[ICE5_BURST_MAX];
+	
+	if(!ICE5_q_busy && (ICE5_q_rptr != ICE5_q_wptr) && (spi.state == SPI_IDLE))
+	{
+		hdr = ICE5_queue[ICE5_q_rptr++ & ICE5_QUEUE_MSK];
+		cnt = hdr >> 8;
+		for(i=0;i<cnt;i++)
+			data[i] = ICE5_queue[ICE5_q_rptr++ & ICE5_QUEUE_MSK];
+		ICE5_q_busy = 1;
+		spi_start(hdr & 0x7F, data, cnt, 1);
+	}
+	
+	// ICE5_Queue_Post() spins for room before it posts, which would never
+	// end here - stall the firmware now instead so the next post fits
+	if(!in_irq)
+		while(ICE5_QUEUE_SZ - (ICE5_q_wptr - ICE5_q_rptr) < ICE5_BURST_MAX+1)
+			tick();
+}
+
+void ICE5_FPGA_Slave_Write(uint8_t Reg, uint32_t Data)
+{
+	if(ICE5_Cache_Filter(Reg, &Data, 1))
+		return;
+	
+	spi_blocking(Reg & 0x7F, &Data, 1);
+}
+
+void ICE5_FPGA_Slave_WriteBurst(uint8_t Reg, const uint32_t *Data, uint32_t Count)
+{
+	if(ICE5_Cache_Filter(Reg, Data, Count))
+		return;
+	
+	spi_blocking(Reg & 0x7F, Data, Count);
+}
+
+void ICE5_FPGA_Slave_Read(uint8_t Reg, uint32_t *Data)
+{
+	uint32_t dummy = 0;
+	
+	*Data = spi_blocking(0x80 | (Reg & 0x7F), &dummy, 1);
+}
+
+//
+// report
+//
+static void list_lands(void)
+{
+	size_t i;
+	
+	printf("%12s %8s %5s  what\n", "clock", "sample", "ofs");
+	for(i=0;i<lands.size();i++)
+	{
+		landing &l = lands[i];
+		
+		printf("%12llu %8u %5u  ", (unsigned long long)l.clk, l.smpl, l.ofs);
+		switch(l.kind)
+		{
+			case LAND_REG:
+				printf("reg 0x%02X\n", l.addr);
+				break;
+			case LAND_PMEM:
+				if(l.live == NO_SMPL)
+					printf("pmem 0x%02X  not live\n", l.addr);
+				else
+					printf("pmem 0x%02X  live @ %u\n", l.addr, l.live);
+				break;
+			case LAND_COMMIT:
+				printf("commit\n");
+				break;
+			case LAND_SWAP:
+				printf("bank swap -> %u\n", l.addr);
+				break;
+		}
+	}
+}
+
+static void summary(void)
+{
+	printf("SPI %u Hz: %llu frames, %llu bytes, bus busy %.1f%%\n",
+		(unsigned)sck, (unsigned long long)spi.frames,
+		(unsigned long long)spi.bytes, clocks ? 100.0*spi.busy/clocks : 0.0);
+	st_pmem_ofs.print("pmem write offset", "clocks");
+	st_gate_ofs.print("gate write offset", "clocks");
+	st_live.print("shadow write to live", "samples");
+	st_swap.print("commit to swap", "samples");
+	st_event.print("note call to gate", "us");
+}
+
+// rest of the script line
+static char *rest(void)
+{
+	char *tok = strtok(NULL, "\r\n");
+	
+	return tok ? tok + strspn(tok, " \t") : (char *)"";
+}
+
+// next script token
+static char *arg(void)
+{
+	char *tok = strtok(NULL, " \t\r\n");
+	
+	if(!tok)
+	{
+		fprintf(stderr, "%s:%d: missing argument\n", scr_name, lnum);
+		exit(1);
+	}
+	return tok;
+}
+
+// console command, then whatever it printed
+static void console(const char *cmd)
+{
+	uint8_t out[256];
+	uint32_t n;
+	
+	while(*cmd)
+		cmd_parse(*cmd++);
+	cmd_parse('\r');
+	while((n = host_usart_out(out, sizeof(out))))
+		fwrite(out, 1, n, stdout);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-b 16|24] [-o out.wav] [-k sck] [-g gap] "
+		"[-m loop] [-l] script\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *out = "vl_cosim.wav";
+	char line[256], *tok;
+	FILE *scr;
+	int c, list = 0;
+	uint8_t note;
+	clock_t t0;
+	double secs;
+	
+	Verilated::commandArgs(argc, argv);
+	
+	while((c = getopt(argc, argv, "b:o:k:g:m:l")) != -1)
+	{
+		switch(c)
+		{
+			case 'b':
+				wav.bits = atoi(optarg);
+				if(wav.bits != 16 && wav.bits != 24)
+					usage(argv[0]);
+				break;
+			case 'o': out = optarg; break;
+			case 'k': sck = strtoul(optarg, NULL, 0); break;
+			case 'g': frame_gap = strtoul(optarg, NULL, 0); break;
+			case 'm': loop_clks = strtoul(optarg, NULL, 0); break;
+			case 'l': list = 1; break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if(optind != argc-1 || !sck || sck > CLK_HZ/2 || !loop_clks)
+		usage(argv[0]);
+	
+	scr_name = argv[optind];
+	if(!(scr = fopen(scr_name, "r")))
+	{
+		perror(scr_name);
+		return 1;
+	}
+	if(!wav.open(out))
+	{
+		perror(out);
+		return 1;
+	}
+	
+	// idle pins, then let the reset pipe and fm_gen ramclr finish
+	top = new Vf303_ice5_fm;
+	top->sim_clk = 0;
+	top->SPI_CSL = 1;
+	top->SPI_SCLK = 0;
+	top->SPI_MOSI = 0;
+	top->eval();
+	in_fw = 1;
+	t0 = clock();
+	run(1024);
+	
+	// boot the firmware on simulated time
+	host_cycles = sim_cycles;
+	setup_usart1();
+	FM_Init();
+	init_cmd();
+	in_fw = 0;
+	
+	while(fgets(line, sizeof(line), scr))
+	{
+		lnum++;
+		if((tok = strchr(line, '#')))
+			*tok = 0;
+		if(!(tok = strtok(line, " \t\r\n")))
+			continue;
+		
+		// a new call ends the wait for the last one's gate write
+		in_fw = 1;
+		if(strlen(tok) > 1)
+			event_wait = 0;
+		if(!strcmp(tok, "on"))
+		{
+			note = strtoul(arg(), NULL, 0);
+			tok = strtok(NULL, " \t\r\n");
+			event_clk = clocks;
+			event_wait = 1;
+			FM_NoteOn(note, tok ? strtoul(tok, NULL, 0) : 100);
+		}
+		else if(!strcmp(tok, "off"))
+		{
+			event_clk = clocks;
+			event_wait = 1;
+			FM_NoteOff(strtoul(arg(), NULL, 0));
+		}
+		else if(!strcmp(tok, "prog"))
+			FM_SetNotePatch(&voices[strtoul(arg(), NULL, 0) % FM_Num_Patches]);
+		else if(!strcmp(tok, "bend"))
+			FM_SetBend(strtol(arg(), NULL, 0));
+		else if(!strcmp(tok, "cmd"))
+			console(rest());
+		else
+		{
+			in_fw = 0;
+			switch(tok[0])
+			{
+				case 's':
+					run_frames(strtoul(arg(), NULL, 0));
+					break;
+				case 't':
+					run_frames(atof(arg())*FSAMPLE + 0.5);
+					break;
+				case 'c':
+					run(strtoull(arg(), NULL, 0));
+					break;
+				default:
+					fprintf(stderr, "%s:%d: unknown command '%s'\n",
+						scr_name, lnum, tok);
+					return 1;
+			}
+		}
+		in_fw = 0;
+	}
+	secs = (double)(clock() - t0) / CLOCKS_PER_SEC;
+	
+	top->final();
+	delete top;
+	wav.close();
+	fclose(scr);
+	
+	if(list)
+		list_lands();
+	summary();
+	fprintf(stderr, "%s: %u samples, %llu clocks in %.1fs\n", out,
+		wav.samples, (unsigned long long)clocks, secs);
+	return 0;
+}
@@ -0,0 +1,286 @@
+// vl_harness.cpp: Verilator harness for f303_ice5_fm
+//
+// Drives the SPI pins from the same scripts fm_render takes and decodes
+// the I2S sdout/lrck stream into a WAV file. Script lines, '#' starts a
+// comment:
+//   w <addr> <data>	SPI register write
+//   r <addr>			SPI register read, printed to stdout
+//   s <samples>		run until this many more I2S frames are out
+//   t <seconds>		run for this much audio
+//   c <clocks>			run 48MHz clocks
+// SPI transfers take real (simulated) time, so audio keeps flowing
+// while they are sent.
+//
+// -m runs fm_model in lockstep and checks every read and every sample of
+// the mix against it. The model takes its whole scan at each ena_smpl and
+// its writes as the SPI frame ends, while the RTL scan spreads over the
+// sample, so a read may see the scan before or after the model's. It
+// passes if it matches either - per bit for the silent words 0x18-0x1B,
+// which fill in voice by voice. The mix has no such slack, as pmem swaps
+// and gates take effect at the sample; a pitch, mix gain or unshadowed
+// parameter write landing mid-scan can make it differ. Mismatches are
+// flagged and make the exit status 1.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "verilated.h"
+#include "Vf303_ice5_fm.h"
+#include "vl_i2s.h"
+#include "fm_model.h"
+
+static Vf303_ice5_fm *top;
+static uint64_t clocks;
+static fm_model *model, *model_prev;	// after & before the last ena_smpl
+static uint32_t mismatches, audio_diffs;
+static bool smpl_last;
+static int spi_half = 3;	// clocks per SPI half bit - 8MHz
+static const char *scr_name;
+static int lnum;
+static i2s_wav wav;
+
+// 24-bit mix probe to int
+static int32_t audio(uint32_t v)
+{
+	return (int32_t)(v<<8)>>8;
+}
+
+//
+// check the mix fm_gen has just handed to the I2S against the model's -
+// the first few differences are printed, the rest only counted
+//
+static void audio_check(void)
+{
+	int32_t l = audio(top->sim_audio_l), r = audio(top->sim_audio_r);
+	
+	if(l == model->audio_l() && r == model->audio_r())
+		return;
+	if(audio_diffs++ < 10)
+		printf("sample %u: audio %d %d  model %d %d MISMATCH\n",
+			wav.samples, l, r, model->audio_l(), model->audio_r());
+}
+
+// one 48MHz clock
+static void tick(void)
+{
+	top->sim_clk = 1;
+	top->eval();
+	wav.edge(top->sclk, top->lrck, top->sdout);
+	if(model && top->sim_smpl && !smpl_last)
+	{
+		audio_check();
+		*model_prev = *model;
+		model->sample();
+	}
+	smpl_last = top->sim_smpl;
+	top->sim_clk = 0;
+	top->eval();
+	clocks++;
+}
+
+static void run(uint64_t n)
+{
+	while(n--)
+		tick();
+}
+
+static void run_frames(uint32_t n)
+{
+	n += wav.samples;
+	while(wav.samples < n)
+		tick();
+}
+
+//
+// SPI mode 0 transfer - 1 r/w bit, 7 address bits, 32 data bits
+//
+static uint32_t spi_xfer(int rw, uint8_t addr, uint32_t data)
+{
+	uint64_t sr = ((uint64_t)rw<<39) | ((uint64_t)(addr&0x7F)<<32) | data;
+	int i;
+	
+	top->SPI_CSL = 0;
+	top->SPI_SCLK = 0;
+	top->SPI_MOSI = (sr>>39) & 1;
+	top->eval();
+	run(spi_half);
+	
+	for(i=0;i<40;i++)
+	{
+		top->SPI_SCLK = 1;
+		top->eval();
+		run(spi_half);
+		
+		// sample MISO before the falling edge shifts it
+		sr = (sr<<1) | top->SPI_MISO;
+		top->SPI_SCLK = 0;
+		top->SPI_MOSI = (sr>>39) & 1;
+		top->eval();
+		run(spi_half);
+	}
+	
+	top->SPI_CSL = 1;
+	top->eval();
+	run(8);
+	
+	return sr & 0xFFFFFFFF;
+}
+
+//
+// check a read against the model - returns 1 if neither sample matches
+//
+static int model_check(uint8_t addr, uint32_t data)
+{
+	uint32_t cur = model->read(addr), prev = model_prev->read(addr);
+	
+	if(addr >= 0x18 && addr <= 0x1B)
+		return ((data ^ cur) & (data ^ prev)) != 0;
+	return data != cur && data != prev;
+}
+
+// next script token
+static char *arg(void)
+{
+	char *tok = strtok(NULL, " \t\r\n");
+	
+	if(!tok)
+	{
+		fprintf(stderr, "%s:%d: missing argument\n", scr_name, lnum);
+		exit(1);
+	}
+	return tok;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-m] [-b 16|24] [-o out.wav] script\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *out = "vl_harness.wav";
+	char line[256], *tok;
+	FILE *scr;
+	int c;
+	uint32_t addr, data;
+	clock_t t0;
+	double secs;
+	
+	Verilated::commandArgs(argc, argv);
+	
+	while((c = getopt(argc, argv, "mb:o:")) != -1)
+	{
+		switch(c)
+		{
+			case 'b':
+				wav.bits = atoi(optarg);
+				if(wav.bits != 16 && wav.bits != 24)
+					usage(argv[0]);
+				break;
+			case 'o':
+				out = optarg;
+				break;
+			case 'm':
+				model = new fm_model;
+				model_prev = new fm_model;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if(optind != argc-1)
+		usage(argv[0]);
+	
+	scr_name = argv[optind];
+	if(!(scr = fopen(scr_name, "r")))
+	{
+		perror(scr_name);
+		return 1;
+	}
+	if(!wav.open(out))
+	{
+		perror(out);
+		return 1;
+	}
+	
+	// idle pins, then let the reset pipe and fm_gen ramclr finish
+	top = new Vf303_ice5_fm;
+	top->sim_clk = 0;
+	top->SPI_CSL = 1;
+	top->SPI_SCLK = 0;
+	top->SPI_MOSI = 0;
+	top->eval();
+	t0 = clock();
+	run(1024);
+	
+	while(fgets(line, sizeof(line), scr))
+	{
+		lnum++;
+		if((tok = strchr(line, '#')))
+			*tok = 0;
+		if(!(tok = strtok(line, " \t\r\n")))
+			continue;
+		
+		switch(tok[0])
+		{
+			case 'w':
+				addr = strtoul(arg(), NULL, 0);
+				data = strtoul(arg(), NULL, 0);
+				spi_xfer(0, addr, data);
+				if(model)
+				{
+					model->write(addr, data);
+					model_prev->write(addr, data);
+				}
+				break;
+			case 'r':
+				addr = strtoul(arg(), NULL, 0);
+				data = spi_xfer(1, addr, 0);
+				printf("%d: reg 0x%02x = 0x%08x", lnum, addr, data);
+				if(model && model_check(addr & 0x7F, data))
+				{
+					printf("  model 0x%08x / 0x%08x MISMATCH",
+						model_prev->read(addr), model->read(addr));
+					mismatches++;
+				}
+				printf("\n");
+				break;
+			case 's':
+				run_frames(strtoul(arg(), NULL, 0));
+				break;
+			case 't':
+				run_frames(atof(arg())*FSAMPLE + 0.5);
+				break;
+			case 'c':
+				run(strtoull(arg(), NULL, 0));
+				break;
+			default:
+				fprintf(stderr, "%s:%d: unknown command '%s'\n",
+					scr_name, lnum, tok);
+				return 1;
+		}
+	}
+	secs = (double)(clock() - t0) / CLOCKS_PER_SEC;
+	
+	top->final();
+	delete top;
+	wav.close();
+	fclose(scr);
+	
+	fprintf(stderr, "%s: %u samples, %llu clocks in %.1fs\n", out,
+		wav.samples, (unsigned long long)clocks, secs);
+	if(secs > 0)
+		fprintf(stderr, "%.0f samples/s, %.2f MHz, %.3fx real time\n",
+			wav.samples/secs, clocks/secs/1e6, wav.samples/(secs*FSAMPLE));
+	if(model)
+	{
+		fprintf(stderr, "%u reads and %u samples differ from the model\n",
+			mismatches, audio_diffs);
+		delete model;
+		delete model_prev;
+	}
+	return mismatches != 0 || audio_diffs != 0;
+}
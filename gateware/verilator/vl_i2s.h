@@ -0,0 +1,112 @@
+// vl_i2s.h: I2S capture to WAV for the Verilator harnesses
+//
+// Feed edge() the sclk/lrck/sdout pins after every clock. Whole left +
+// right frames are written to the WAV file at 16 or 24 bits.
+
+#ifndef __VL_I2S__
+#define __VL_I2S__
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define FSAMPLE 46875		// 48MHz / 1024
+
+class i2s_wav
+{
+public:
+	int bits = 16;
+	uint32_t samples = 0;
+	
+	bool open(const char *name)
+	{
+		if(!(wav = fopen(name, "wb")))
+			return false;
+		header();
+		return true;
+	}
+	
+	void close(void)
+	{
+		header();
+		fclose(wav);
+	}
+	
+	//
+	// I2S - bits are taken on the rising sclk edge and belong to the channel
+	// lrck selected one edge earlier. Slot data is MSB first so a 16-bit
+	// slot and the top of a 32-bit one line up the same way.
+	//
+	void edge(int sclk, int lrck, int sdout)
+	{
+		int ch;
+		
+		if(sclk && !sclk_d)
+		{
+			ch = lr_d;
+			lr_d = lrck;
+			
+			if(ch != slot_ch)
+			{
+				// slot done - a frame is left then right, both whole
+				if(slot_ch == 0)
+				{
+					left_sr = slot_sr;
+					left_ok = slot_ok;
+				}
+				else if((slot_ch == 1) && slot_ok && left_ok)
+				{
+					put_le(left_sr >> (32-bits), bits/8);
+					put_le(slot_sr >> (32-bits), bits/8);
+					samples++;
+				}
+				slot_ok = (slot_ch >= 0);
+				slot_ch = ch;
+				slot_sr = 0;
+				slot_bits = 0;
+			}
+			
+			if(slot_bits < 32)
+				slot_sr |= (uint32_t)sdout << (31-slot_bits);
+			slot_bits++;
+		}
+		sclk_d = sclk;
+	}
+
+private:
+	FILE *wav = NULL;
+	int sclk_d = 0, lr_d = -1, slot_ch = -1, slot_ok = 0, left_ok = 0;
+	uint32_t slot_sr = 0, left_sr = 0;
+	int slot_bits = 0;
+	
+	// little-endian header fields
+	void put_le(uint32_t v, int bytes)
+	{
+		while(bytes--)
+		{
+			fputc(v & 0xFF, wav);
+			v >>= 8;
+		}
+	}
+	
+	void header(void)
+	{
+		uint32_t bpf = 2*bits/8;
+		uint32_t len = samples*bpf;
+		
+		fseek(wav, 0, SEEK_SET);
+		fwrite("RIFF", 1, 4, wav);
+		put_le(36 + len, 4);
+		fwrite("WAVEfmt ", 1, 8, wav);
+		put_le(16, 4);
+		put_le(1, 2);					// PCM
+		put_le(2, 2);					// stereo
+		put_le(FSAMPLE, 4);
+		put_le(FSAMPLE*bpf, 4);
+		put_le(bpf, 2);
+		put_le(bits, 2);
+		fwrite("data", 1, 4, wav);
+		put_le(len, 4);
+	}
+};
+
+#endif